@@ -1,41 +1,1264 @@
+#define _POSIX_C_SOURCE 200809L
 #include "libabl.h"
 #include <stdio.h>
 #include <assert.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
-static uint64_t xorshift_state[2] = { 0xdeadbeef, 0xbeefdead };
+#ifdef _OPENMP
+#include <omp.h>
+#else
+static int omp_get_max_threads(void) { return 1; }
+static int omp_get_num_threads(void) { return 1; }
+static int omp_get_thread_num(void) { return 0; }
+static double omp_get_wtime(void) { return (double) clock() / CLOCKS_PER_SEC; }
+#endif
 
-static uint64_t xorshift128plus() {
-	uint64_t x = xorshift_state[0];
-	uint64_t const y = xorshift_state[1];
-	xorshift_state[0] = y;
-	x ^= x << 23; // a
-	xorshift_state[1] = x ^ y ^ (x >> 17) ^ (y >> 26); // b, c
-	return xorshift_state[1] + y;
+/* Philox4x32-10, see Salmon et al., "Parallel random numbers: as easy as 1, 2, 3" */
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+#define RANDOM_SEED 0xdeadbeefu
+#define RANDOM_STREAM_MAIN 0xffffffffu
+
+typedef struct {
+	/* { call number, timestep, agent index (low), agent index (high) } */
+	uint32_t counter[4];
+	/* { seed, step } */
+	uint32_t key[2];
+} random_stream;
+
+static uint64_t philox4x32_10(const random_stream *s) {
+	uint32_t c0 = s->counter[0], c1 = s->counter[1], c2 = s->counter[2], c3 = s->counter[3];
+	uint32_t k0 = s->key[0], k1 = s->key[1];
+	for (int round = 0; round < 10; round++) {
+		uint64_t p0 = (uint64_t) PHILOX_M0 * c0;
+		uint64_t p1 = (uint64_t) PHILOX_M1 * c2;
+		uint32_t n0 = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+		uint32_t n2 = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+		c1 = (uint32_t) p1;
+		c3 = (uint32_t) p0;
+		c0 = n0;
+		c2 = n2;
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+	return ((uint64_t) c0 << 32) | c1;
+}
+
+/* Used by the main thread outside of parallel steps */
+static random_stream main_stream = { { 0, 0, 0, 0 }, { RANDOM_SEED, RANDOM_STREAM_MAIN } };
+/* Stream of the agent that is currently being stepped on this thread */
+static random_stream agent_stream;
+static bool in_agent_step = false;
+#pragma omp threadprivate(agent_stream, in_agent_step)
+/* Key of the agent streams, which differs between MPI ranks */
+static uint32_t agent_stream_seed = RANDOM_SEED;
+
+void random_set_rank(unsigned rank) {
+	agent_stream_seed = RANDOM_SEED + rank;
+}
+
+void random_begin_agent(unsigned step, unsigned timestep, size_t index) {
+	agent_stream.counter[0] = 0;
+	agent_stream.counter[1] = timestep;
+	agent_stream.counter[2] = (uint32_t) index;
+	agent_stream.counter[3] = (uint32_t) ((uint64_t) index >> 32);
+	agent_stream.key[0] = agent_stream_seed;
+	agent_stream.key[1] = step;
+	in_agent_step = true;
+}
+
+void random_end_agents(void) {
+	in_agent_step = false;
+}
+
+static uint64_t random_next(void) {
+	random_stream *s = in_agent_step ? &agent_stream : &main_stream;
+	uint64_t x = philox4x32_10(s);
+	s->counter[0]++;
+	return x;
+}
+
+abl_float random_float(abl_float min, abl_float max) {
+	// Use the top 53 bits, which are exactly representable as a double
+	uint64_t x = random_next();
+	return min + (max - min) * (abl_float) ((double) (x >> 11) * (1.0 / 9007199254740992.0));
+}
+
+int random_int(int min, int max) {
+	unsigned n = max-min+1;
+	if ((n & (n-1)) == 0) {
+		return min + (int) (random_next() & (n - 1));
+	}
+
+	// Not the fastest way to do this
+	unsigned r = UINT_MAX % n;
+	unsigned x;
+	do {
+		x = random_next();
+	} while (x >= UINT_MAX - r);
+	return min + x % n;
+}
+
+void spatial_grid_init(spatial_grid *grid, float3 min, float3 size, abl_float cell_size,
+		spatial_index_kind kind, bool wrap) {
+	abl_float mins[3] = { min.x, min.y, min.z };
+	abl_float sizes[3] = { size.x, size.y, size.z };
+
+	memset(grid, 0, sizeof(spatial_grid));
+	grid->num_cells = 1;
+	for (int i = 0; i < 3; i++) {
+		grid->min[i] = mins[i];
+		grid->cell_size[i] = cell_size;
+		if (wrap && sizes[i] > 0) {
+			// Cells must not extend beyond the border, otherwise wrapped
+			// queries would miss agents
+			abl_float dim = floor(sizes[i] / cell_size);
+			grid->dims[i] = dim >= 1 ? (int) dim : 1;
+			grid->cell_size[i] = sizes[i] / grid->dims[i];
+			grid->period[i] = sizes[i];
+			grid->wraps = true;
+		} else {
+			abl_float dim = ceil(sizes[i] / cell_size);
+			grid->dims[i] = dim >= 1 ? (int) dim : 1;
+		}
+		grid->num_cells *= grid->dims[i];
+		// The tree covers the same box as the grid
+		grid->tree_scale[i] =
+			(1 << SPATIAL_TREE_MAX_DEPTH) / (grid->dims[i] * grid->cell_size[i]);
+	}
+	grid->cell_start = calloc(grid->num_cells + 1, sizeof(size_t));
+	grid->kind = kind;
+}
+
+typedef struct {
+	uint64_t code;
+	size_t id;
+} spatial_tree_key;
+
+/* Interleaves the bits of the tree coordinates, so that sorting by the code
+ * sorts the agents into tree order */
+static uint64_t spatial_tree_code(int x, int y, int z, bool is_3d) {
+	uint64_t code = 0;
+	for (int bit = SPATIAL_TREE_MAX_DEPTH - 1; bit >= 0; bit--) {
+		if (is_3d) {
+			code = (code << 1) | ((z >> bit) & 1);
+		}
+		code = (code << 1) | ((y >> bit) & 1);
+		code = (code << 1) | ((x >> bit) & 1);
+	}
+	return code;
+}
+
+/* First key in [begin, end) whose code is at least code */
+static size_t spatial_tree_lower_bound(
+		const spatial_tree_key *keys, size_t begin, size_t end, uint64_t code) {
+	while (begin < end) {
+		size_t mid = begin + (end - begin) / 2;
+		if (keys[mid].code < code) {
+			begin = mid + 1;
+		} else {
+			end = mid;
+		}
+	}
+	return begin;
+}
+
+static size_t spatial_tree_add_node(spatial_grid *grid) {
+	if (grid->num_nodes == grid->nodes_cap) {
+		grid->nodes_cap = grid->nodes_cap ? 2 * grid->nodes_cap : 64;
+		grid->nodes = realloc(grid->nodes, grid->nodes_cap * sizeof(spatial_tree_node));
+	}
+	return grid->num_nodes++;
+}
+
+/* Adds the node covering the agents [begin, end), which all share the first
+ * depth levels of their code, and its subtree in pre-order */
+static void spatial_tree_build_node(
+		spatial_grid *grid, const spatial_tree_key *keys, size_t begin, size_t end,
+		uint64_t code, int depth, bool is_3d) {
+	int dims = is_3d ? 3 : 2;
+	int shift = SPATIAL_TREE_MAX_DEPTH - depth;
+	size_t index = spatial_tree_add_node(grid);
+	spatial_tree_node *node = &grid->nodes[index];
+	for (int axis = 0; axis < 3; axis++) {
+		int c = 0;
+		for (int level = depth - 1; level >= 0; level--) {
+			c = (c << 1) | (int) ((code >> (level * dims + axis)) & 1);
+		}
+		node->lo[axis] = axis < dims ? c << shift : 0;
+		node->hi[axis] = axis < dims ? ((c + 1) << shift) - 1 : 0;
+	}
+	node->begin = begin;
+	node->end = end;
+	node->leaf = end - begin <= SPATIAL_TREE_LEAF_SIZE || depth == SPATIAL_TREE_MAX_DEPTH;
+
+	if (!node->leaf) {
+		// Only non-empty children are stored
+		int level_bits = (shift - 1) * dims;
+		size_t child_begin = begin;
+		for (uint64_t child = 0; child < ((uint64_t) 1 << dims); child++) {
+			uint64_t child_code = (code << dims) | child;
+			size_t child_end = spatial_tree_lower_bound(
+				keys, child_begin, end, (child_code + 1) << level_bits);
+			if (child_end != child_begin) {
+				spatial_tree_build_node(
+					grid, keys, child_begin, child_end, child_code, depth + 1, is_3d);
+			}
+			child_begin = child_end;
+		}
+	}
+
+	// The nodes may have been reallocated
+	grid->nodes[index].skip = grid->num_nodes;
+}
+
+/* Sorts the agents by code with a stable LSD radix sort. Every thread handles
+ * the same contiguous block of keys in all passes, so that equal codes stay in
+ * index order independently of the number of threads. */
+static void spatial_tree_sort(spatial_grid *grid, size_t n, int bits) {
+	spatial_tree_key *src = grid->keys;
+	spatial_tree_key *dst = grid->keys_tmp;
+	int num_threads = omp_get_num_threads();
+	int self = omp_get_thread_num();
+	size_t *hist = grid->hist + (size_t) self * 256;
+
+	for (int shift = 0; shift < bits; shift += 8) {
+		memset(hist, 0, 256 * sizeof(size_t));
+		#pragma omp for schedule(static)
+		for (size_t i = 0; i < n; i++) {
+			hist[(src[i].code >> shift) & 0xff]++;
+		}
+
+		#pragma omp single
+		{
+			size_t offset = 0;
+			for (int digit = 0; digit < 256; digit++) {
+				for (int t = 0; t < num_threads; t++) {
+					size_t count = grid->hist[(size_t) t * 256 + digit];
+					grid->hist[(size_t) t * 256 + digit] = offset;
+					offset += count;
+				}
+			}
+		}
+
+		#pragma omp for schedule(static)
+		for (size_t i = 0; i < n; i++) {
+			dst[hist[(src[i].code >> shift) & 0xff]++] = src[i];
+		}
+
+		spatial_tree_key *tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	#pragma omp single
+	if (src != grid->keys) {
+		grid->keys_tmp = grid->keys;
+		grid->keys = src;
+	}
+}
+
+static void spatial_tree_build(
+		spatial_grid *grid, const void *pos_start, size_t n, size_t stride, bool is_3d) {
+	#pragma omp single
+	{
+		size_t hist_len = (size_t) omp_get_num_threads() * 256;
+		if (hist_len > grid->hist_cap) {
+			grid->hist_cap = hist_len;
+			grid->hist = realloc(grid->hist, hist_len * sizeof(size_t));
+		}
+	}
+
+	spatial_tree_key *keys = grid->keys;
+	#pragma omp for
+	for (size_t i = 0; i < n; i++) {
+		const char *pos = (const char *) pos_start + stride * i;
+		int x, y, z = 0;
+		if (is_3d) {
+			const float3 *p = (const float3 *) pos;
+			x = spatial_tree_coord(grid, 0, p->x);
+			y = spatial_tree_coord(grid, 1, p->y);
+			z = spatial_tree_coord(grid, 2, p->z);
+		} else {
+			const float2 *p = (const float2 *) pos;
+			x = spatial_tree_coord(grid, 0, p->x);
+			y = spatial_tree_coord(grid, 1, p->y);
+		}
+		keys[i].code = spatial_tree_code(x, y, z, is_3d);
+		keys[i].id = i;
+	}
+
+	spatial_tree_sort(grid, n, SPATIAL_TREE_MAX_DEPTH * (is_3d ? 3 : 2));
+
+	keys = grid->keys;
+	#pragma omp for
+	for (size_t i = 0; i < n; i++) {
+		grid->ids[i] = keys[i].id;
+	}
+
+	// The tree only has about n / SPATIAL_TREE_LEAF_SIZE nodes, build it serially
+	#pragma omp single
+	{
+		grid->num_nodes = 0;
+		if (n) {
+			spatial_tree_build_node(grid, keys, 0, n, 0, 0, is_3d);
+		}
+
+		double occupancy = 0;
+		for (size_t i = 0; i < grid->num_nodes; i++) {
+			const spatial_tree_node *node = &grid->nodes[i];
+			if (node->leaf) {
+				double k = node->end - node->begin;
+				occupancy += k * k;
+			}
+		}
+		grid->density = n ? occupancy / n : 0;
+	}
+}
+
+void spatial_grid_init_lattice(spatial_grid *grid, int pad, bool is_3d) {
+	size_t len = 1;
+	grid->lattice_pad = pad;
+	for (int i = 0; i < 3; i++) {
+		grid->lattice_dims[i] = grid->dims[i] + (i < 2 || is_3d ? 2 * pad : 0);
+		len *= grid->lattice_dims[i];
+	}
+	grid->lattice = malloc(len * sizeof(size_t));
+}
+
+/* Set if some cell holds more than one agent, shared by the team */
+static bool spatial_lattice_collision;
+
+/* Fills the lattice, including its padding, from the cells of the grid */
+static void spatial_lattice_fill(spatial_grid *grid) {
+	const int *dims = grid->lattice_dims;
+	size_t len = (size_t) dims[0] * dims[1] * dims[2];
+
+	#pragma omp single
+	spatial_lattice_collision = false;
+
+	#pragma omp for
+	for (size_t l = 0; l < len; l++) {
+		int coords[3] = {
+			(int) (l % dims[0]),
+			(int) (l / dims[0] % dims[1]),
+			(int) (l / ((size_t) dims[0] * dims[1])),
+		};
+		size_t cell = 0;
+		size_t scale = 1;
+		bool inside = true;
+		for (int axis = 0; axis < 3; axis++) {
+			int n = grid->dims[axis];
+			int c = coords[axis] - (dims[axis] > n ? grid->lattice_pad : 0);
+			if (c < 0 || c >= n) {
+				if (!(grid->period[axis] > 0)) {
+					inside = false;
+					break;
+				}
+				c = (c % n + n) % n;
+			}
+			cell += c * scale;
+			scale *= n;
+		}
+
+		size_t agent = LATTICE_EMPTY;
+		if (inside) {
+			size_t begin = grid->cell_start[cell];
+			size_t end = grid->cell_start[cell + 1];
+			if (end - begin > 1) {
+				#pragma omp atomic write
+				spatial_lattice_collision = true;
+			} else if (end > begin) {
+				agent = grid->ids[begin];
+			}
+		}
+		grid->lattice[l] = agent;
+	}
+
+	#pragma omp single
+	if (spatial_lattice_collision) {
+		fprintf(stderr, "Lattice cells can hold at most one agent\n");
+		exit(1);
+	}
+}
+
+/* Agents in cells with more agents than this are considered crowded */
+#define SPATIAL_AUTO_CROWDED_CELL (8 * SPATIAL_TREE_LEAF_SIZE)
+
+void spatial_grid_build(
+		spatial_grid *grid, const void *pos_start, size_t len, size_t stride, bool is_3d) {
+	size_t n = len;
+	#pragma omp single
+	{
+		if (n > grid->cap) {
+			grid->cap = n;
+			grid->ids = realloc(grid->ids, n * sizeof(size_t));
+			if (grid->kind != SPATIAL_INDEX_TREE) {
+				grid->cells = realloc(grid->cells, n * sizeof(size_t));
+			}
+			if (grid->kind == SPATIAL_INDEX_TREE || grid->kind == SPATIAL_INDEX_AUTO) {
+				grid->keys = realloc(grid->keys, n * sizeof(spatial_tree_key));
+				grid->keys_tmp = realloc(grid->keys_tmp, n * sizeof(spatial_tree_key));
+			}
+		}
+		grid->use_tree = grid->kind == SPATIAL_INDEX_TREE;
+	}
+
+	if (!grid->use_tree) {
+		#pragma omp for
+		for (size_t i = 0; i < n; i++) {
+			const char *pos = (const char *) pos_start + stride * i;
+			if (is_3d) {
+				const float3 *p = (const float3 *) pos;
+				grid->cells[i] = spatial_grid_cell(grid,
+					spatial_grid_coord(grid, 0, p->x),
+					spatial_grid_coord(grid, 1, p->y),
+					spatial_grid_coord(grid, 2, p->z));
+			} else {
+				const float2 *p = (const float2 *) pos;
+				grid->cells[i] = spatial_grid_cell(grid,
+					spatial_grid_coord(grid, 0, p->x),
+					spatial_grid_coord(grid, 1, p->y), 0);
+			}
+		}
+
+		// Counting sort by cell. Agents within a cell stay in index order,
+		// so iteration order does not depend on the number of threads.
+		#pragma omp single
+		{
+			size_t *start = grid->cell_start;
+			memset(start, 0, (grid->num_cells + 1) * sizeof(size_t));
+			for (size_t i = 0; i < n; i++) {
+				start[grid->cells[i] + 1]++;
+			}
+
+			// Use the tree if most agents are in crowded cells
+			if (grid->kind == SPATIAL_INDEX_AUTO) {
+				size_t crowded = 0;
+				for (size_t c = 0; c < grid->num_cells; c++) {
+					if (start[c + 1] > SPATIAL_AUTO_CROWDED_CELL) {
+						crowded += start[c + 1];
+					}
+				}
+				grid->use_tree = 2 * crowded > n;
+			}
+
+			if (!grid->use_tree) {
+				for (size_t c = 0; c < grid->num_cells; c++) {
+					start[c + 1] += start[c];
+				}
+				for (size_t i = 0; i < n; i++) {
+					grid->ids[start[grid->cells[i]]++] = i;
+				}
+				// The scatter advanced each start to the start of the next cell, shift back
+				memmove(start + 1, start, grid->num_cells * sizeof(size_t));
+				start[0] = 0;
+
+				double occupancy = 0;
+				for (size_t c = 0; c < grid->num_cells; c++) {
+					double k = start[c + 1] - start[c];
+					occupancy += k * k;
+				}
+				grid->density = n ? occupancy / n : 0;
+			}
+		}
+	}
+
+	if (grid->use_tree) {
+		spatial_tree_build(grid, pos_start, n, stride, is_3d);
+	}
+	if (grid->kind == SPATIAL_INDEX_LATTICE) {
+		spatial_lattice_fill(grid);
+	}
+
+	#pragma omp single
+	grid->valid = true;
+}
+
+void spatial_grid_free(spatial_grid *grid) {
+	free(grid->cell_start);
+	free(grid->ids);
+	free(grid->cells);
+	free(grid->nodes);
+	free(grid->keys);
+	free(grid->keys_tmp);
+	free(grid->hist);
+	free(grid->lattice);
+	memset(grid, 0, sizeof(spatial_grid));
+}
+
+static inline float3 verlet_load_pos(const void *pos_start, size_t stride, size_t i, bool is_3d) {
+	const char *pos = (const char *) pos_start + stride * i;
+	if (is_3d) {
+		return *(const float3 *) pos;
+	}
+	const float2 *p = (const float2 *) pos;
+	return float3_create(p->x, p->y, 0);
+}
+
+/* Number of neighbors of query agent i within radius, which are stored
+ * starting at ids if it is not NULL */
+static size_t verlet_collect(
+		const spatial_grid *grid, abl_float radius, float3 p,
+		const void *pos, size_t stride, bool is_3d, size_t *ids) {
+	float3 period = float3_create(grid->period[0], grid->period[1], grid->period[2]);
+	size_t count = 0;
+	spatial_grid_iter it = spatial_grid_query(grid, p, radius);
+	for (size_t id; spatial_grid_next(&it, &id);) {
+		float3 q = verlet_load_pos(pos, stride, id, is_3d);
+		abl_float dist = grid->wraps ? dist_wrap_float3(q, p, period) : dist_float3(q, p);
+		if (dist <= radius) {
+			if (ids) {
+				ids[count] = id;
+			}
+			count++;
+		}
+	}
+	return count;
+}
+
+void verlet_list_build(
+		verlet_list *list, const spatial_grid *grid, abl_float radius,
+		const void *query_pos, size_t query_len, size_t query_stride,
+		const void *pos, size_t len, size_t stride, bool is_3d) {
+	#pragma omp single
+	{
+		if (query_len > list->query_cap) {
+			list->query_cap = query_len;
+			list->start = realloc(list->start, (query_len + 1) * sizeof(size_t));
+			list->query_pos = realloc(list->query_pos, query_len * sizeof(float3));
+		}
+		if (len > list->cap) {
+			list->cap = len;
+			list->pos = realloc(list->pos, len * sizeof(float3));
+		}
+		list->query_len = query_len;
+		list->len = len;
+		list->start[0] = 0;
+	}
+
+	// Count the neighbors first, so that every agent gets a fixed range of ids
+	#pragma omp for schedule(static)
+	for (size_t i = 0; i < query_len; i++) {
+		float3 p = verlet_load_pos(query_pos, query_stride, i, is_3d);
+		list->query_pos[i] = p;
+		list->start[i + 1] = verlet_collect(grid, radius, p, pos, stride, is_3d, NULL);
+	}
+	#pragma omp for
+	for (size_t i = 0; i < len; i++) {
+		list->pos[i] = verlet_load_pos(pos, stride, i, is_3d);
+	}
+
+	#pragma omp single
+	{
+		for (size_t i = 0; i < query_len; i++) {
+			list->start[i + 1] += list->start[i];
+		}
+		if (list->start[query_len] > list->ids_cap) {
+			list->ids_cap = list->start[query_len];
+			list->ids = realloc(list->ids, list->ids_cap * sizeof(size_t));
+		}
+	}
+
+	#pragma omp for schedule(static)
+	for (size_t i = 0; i < query_len; i++) {
+		verlet_collect(grid, radius, list->query_pos[i], pos, stride, is_3d,
+			list->ids + list->start[i]);
+	}
+
+	#pragma omp single
+	list->valid = true;
+}
+
+/* Largest squared displacements, shared by the team */
+static abl_float verlet_query_disp2;
+static abl_float verlet_disp2;
+/* Whether the list has to be rebuilt regardless of the displacements */
+static bool verlet_invalid;
+
+static inline abl_float verlet_disp2_of(float3 a, float3 b) {
+	float3 d = float3_sub(a, b);
+	return dot_float3(d, d);
+}
+
+bool verlet_list_stale(
+		const verlet_list *list, abl_float skin,
+		const void *query_pos, size_t query_len, size_t query_stride,
+		const void *pos, size_t len, size_t stride, bool is_3d) {
+	// The header is checked by one thread, because verlet_list_build() may
+	// already update it while slower threads are still here
+	#pragma omp single
+	{
+		verlet_invalid = !list->valid || list->query_len != query_len || list->len != len;
+		verlet_query_disp2 = verlet_disp2 = 0;
+	}
+	if (verlet_invalid) {
+		return true;
+	}
+
+	#pragma omp for reduction(max: verlet_query_disp2)
+	for (size_t i = 0; i < query_len; i++) {
+		abl_float d2 = verlet_disp2_of(
+			verlet_load_pos(query_pos, query_stride, i, is_3d), list->query_pos[i]);
+		if (d2 > verlet_query_disp2) verlet_query_disp2 = d2;
+	}
+
+	// Query agents are usually their own neighbors
+	bool same = query_pos == pos;
+	if (!same) {
+		#pragma omp for reduction(max: verlet_disp2)
+		for (size_t i = 0; i < len; i++) {
+			abl_float d2 = verlet_disp2_of(
+				verlet_load_pos(pos, stride, i, is_3d), list->pos[i]);
+			if (d2 > verlet_disp2) verlet_disp2 = d2;
+		}
+	}
+
+	abl_float query_disp = sqrt(verlet_query_disp2);
+	abl_float disp = same ? query_disp : sqrt(verlet_disp2);
+	// The shared maxima are reset by the next call
+	#pragma omp barrier
+	return query_disp + disp > skin;
+}
+
+void verlet_list_free(verlet_list *list) {
+	free(list->start);
+	free(list->ids);
+	free(list->query_pos);
+	free(list->pos);
+	memset(list, 0, sizeof(verlet_list));
+}
+
+static inline bool spatial_neighbor_less(spatial_neighbor a, spatial_neighbor b) {
+	return a.dist2 < b.dist2 || (a.dist2 == b.dist2 && a.id < b.id);
+}
+
+static void spatial_heap_sift_down(spatial_neighbor *heap, size_t n, size_t i) {
+	for (;;) {
+		size_t largest = i;
+		size_t left = 2 * i + 1, right = 2 * i + 2;
+		if (left < n && spatial_neighbor_less(heap[largest], heap[left])) largest = left;
+		if (right < n && spatial_neighbor_less(heap[largest], heap[right])) largest = right;
+		if (largest == i) {
+			return;
+		}
+		spatial_neighbor tmp = heap[i];
+		heap[i] = heap[largest];
+		heap[largest] = tmp;
+		i = largest;
+	}
+}
+
+/* Offers an agent to the max-heap of the k closest agents found so far */
+static inline void spatial_heap_offer(
+		spatial_neighbor *heap, size_t *n, size_t k, spatial_neighbor c) {
+	if (*n < k) {
+		size_t i = (*n)++;
+		while (i > 0 && spatial_neighbor_less(heap[(i - 1) / 2], c)) {
+			heap[i] = heap[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+		heap[i] = c;
+	} else if (spatial_neighbor_less(c, heap[0])) {
+		heap[0] = c;
+		spatial_heap_sift_down(heap, k, 0);
+	}
+}
+
+static inline abl_float spatial_dist2(const spatial_grid *grid, float3 a, float3 b) {
+	abl_float d[3] = { a.x - b.x, a.y - b.y, a.z - b.z };
+	abl_float sum = 0;
+	for (int axis = 0; axis < 3; axis++) {
+		abl_float delta = grid->period[axis] > 0 ? wrap_delta(d[axis], grid->period[axis]) : d[axis];
+		sum += delta * delta;
+	}
+	return sum;
+}
+
+static inline int spatial_wrap_cell(int c, int n) {
+	c %= n;
+	return c < 0 ? c + n : c;
+}
+
+static size_t spatial_grid_nearest_rings(const spatial_grid *grid, float3 p, size_t k,
+		const void *pos, size_t stride, bool is_3d, spatial_neighbor *heap) {
+	abl_float ps[3] = { p.x, p.y, p.z };
+	int center[3];
+	for (int axis = 0; axis < 3; axis++) {
+		if (grid->period[axis] > 0) {
+			abl_float rel = ps[axis] - grid->min[axis];
+			ps[axis] -= floor(rel / grid->period[axis]) * grid->period[axis];
+		}
+		center[axis] = spatial_grid_coord(grid, axis, ps[axis]);
+	}
+
+	/* Box of cells visited so far. It starts out empty, and once it spans a
+	 * wrapping axis it does not grow along that axis anymore. */
+	int lo[3] = { 1, 1, 1 }, hi[3] = { 0, 0, 0 };
+	bool full[3] = { false, false, false };
+	size_t n = 0;
+	for (int r = 0;; r++) {
+		int prev_lo[3], prev_hi[3];
+		bool grown = false;
+		/* Distance to the closest cell that is still unvisited */
+		abl_float bound = INFINITY;
+		for (int axis = 0; axis < 3; axis++) {
+			int dims = grid->dims[axis];
+			prev_lo[axis] = lo[axis];
+			prev_hi[axis] = hi[axis];
+			if (!full[axis]) {
+				lo[axis] = center[axis] - r;
+				hi[axis] = center[axis] + r;
+				if (grid->period[axis] > 0) {
+					if (hi[axis] - lo[axis] + 1 >= dims) {
+						hi[axis] = lo[axis] + dims - 1;
+						full[axis] = true;
+					}
+				} else {
+					if (lo[axis] < 0) lo[axis] = 0;
+					if (hi[axis] > dims - 1) hi[axis] = dims - 1;
+					full[axis] = lo[axis] == 0 && hi[axis] == dims - 1;
+				}
+			}
+			grown = grown || lo[axis] != prev_lo[axis] || hi[axis] != prev_hi[axis];
+			if (!full[axis]) {
+				abl_float size = grid->cell_size[axis];
+				abl_float below = ps[axis] - (grid->min[axis] + lo[axis] * size);
+				abl_float above = grid->min[axis] + (hi[axis] + 1) * size - ps[axis];
+				if (grid->period[axis] > 0 || lo[axis] > 0) bound = fmin(bound, below);
+				if (grid->period[axis] > 0 || hi[axis] < dims - 1) bound = fmin(bound, above);
+			}
+		}
+		if (!grown) {
+			break;
+		}
+
+		/* Visit the cells of the box that were not part of the previous one */
+		for (int z = lo[2]; z <= hi[2]; z++) {
+			for (int y = lo[1]; y <= hi[1]; y++) {
+				bool inner = z >= prev_lo[2] && z <= prev_hi[2]
+					&& y >= prev_lo[1] && y <= prev_hi[1];
+				for (int x = lo[0]; x <= hi[0]; x++) {
+					if (inner && x == prev_lo[0]) {
+						x = prev_hi[0];
+						continue;
+					}
+					size_t cell = spatial_grid_cell(grid,
+						spatial_wrap_cell(x, grid->dims[0]), spatial_wrap_cell(y, grid->dims[1]),
+						spatial_wrap_cell(z, grid->dims[2]));
+					for (size_t slot = grid->cell_start[cell];
+							slot < grid->cell_start[cell + 1]; slot++) {
+						size_t id = grid->ids[slot];
+						spatial_neighbor c = {
+							spatial_dist2(grid, verlet_load_pos(pos, stride, id, is_3d), p), id
+						};
+						spatial_heap_offer(heap, &n, k, c);
+					}
+				}
+			}
+		}
+
+		if (n == k && bound * bound > heap[0].dist2) {
+			break;
+		}
+	}
+	return n;
+}
+
+static size_t spatial_tree_nearest(const spatial_grid *grid, float3 p, size_t k,
+		const void *pos, size_t stride, bool is_3d, spatial_neighbor *heap) {
+	/* Once the box reaches the farthest corner of the environment, it holds all agents */
+	abl_float ps[3] = { p.x, p.y, p.z };
+	abl_float extent = 0;
+	for (int axis = 0; axis < 3; axis++) {
+		abl_float size = grid->dims[axis] * grid->cell_size[axis];
+		extent = fmax(extent, fmax(fabs(ps[axis] - grid->min[axis]),
+			fabs(grid->min[axis] + size - ps[axis])));
+	}
+
+	abl_float radius = grid->cell_size[0];
+	for (;;) {
+		size_t n = 0;
+		spatial_grid_iter it = spatial_grid_query(grid, p, radius);
+		for (size_t id; spatial_grid_next(&it, &id);) {
+			spatial_neighbor c = {
+				spatial_dist2(grid, verlet_load_pos(pos, stride, id, is_3d), p), id
+			};
+			spatial_heap_offer(heap, &n, k, c);
+		}
+		/* Agents outside of the box are further away than radius */
+		if (radius >= extent || (n == k && heap[0].dist2 < radius * radius)) {
+			return n;
+		}
+		radius *= 2;
+	}
+}
+
+size_t spatial_grid_nearest(const spatial_grid *grid, float3 p, int k,
+		const void *pos, size_t len, size_t stride, bool is_3d, spatial_neighbor *heap) {
+	if (k <= 0 || len == 0) {
+		return 0;
+	}
+	size_t max = (size_t) k < len ? (size_t) k : len;
+	size_t n = grid->use_tree
+		? spatial_tree_nearest(grid, p, max, pos, stride, is_3d, heap)
+		: spatial_grid_nearest_rings(grid, p, max, pos, stride, is_3d, heap);
+
+	/* Heap sort, so that the closest agent comes first */
+	for (size_t end = n; end > 1; end--) {
+		spatial_neighbor tmp = heap[0];
+		heap[0] = heap[end - 1];
+		heap[end - 1] = tmp;
+		spatial_heap_sift_down(heap, end - 1, 0);
+	}
+	return n;
+}
+
+/* Heaps of the nearest() loops at each nesting depth, of type dyn_array */
+static dyn_array nearest_heaps;
+#pragma omp threadprivate(nearest_heaps)
+
+spatial_neighbor *spatial_nearest_heap(int depth, int k, size_t len) {
+	size_t num_heaps = nearest_heaps.len;
+	if ((size_t) depth >= num_heaps) {
+		DYN_ARRAY_ENSURE(&nearest_heaps, dyn_array, depth + 1);
+		memset(DYN_ARRAY_GET(&nearest_heaps, dyn_array, num_heaps), 0,
+			(depth + 1 - num_heaps) * sizeof(dyn_array));
+	}
+	dyn_array *heap = DYN_ARRAY_GET(&nearest_heaps, dyn_array, depth);
+	size_t max = k <= 0 ? 0 : (size_t) k < len ? (size_t) k : len;
+	DYN_ARRAY_ENSURE(heap, spatial_neighbor, max);
+	return heap->values;
+}
+
+typedef struct {
+	int from;
+	int to;
+} link_pair;
+
+void link_graph_add(link_graph *graph, int from, int to) {
+	*DYN_ARRAY_PLACE(&graph->pairs, link_pair) = (link_pair) { from, to };
+}
+
+void link_graph_build(link_graph *graph, size_t len) {
+	size_t num_links = graph->pairs.len;
+	graph->len = len;
+	graph->num_links = num_links;
+	graph->start = calloc(len + 1, sizeof(size_t));
+	graph->targets = malloc((num_links ? num_links : 1) * sizeof(size_t));
+	graph->next_targets = malloc((num_links ? num_links : 1) * sizeof(size_t));
+
+	// Counting sort by source, links of an agent stay in the order they were added
+	for (size_t i = 0; i < num_links; i++) {
+		const link_pair *pair = DYN_ARRAY_GET(&graph->pairs, link_pair, i);
+		int ends[2] = { pair->from, pair->to };
+		for (int j = 0; j < 2; j++) {
+			if (ends[j] < 0 || (size_t) ends[j] >= len) {
+				fprintf(stderr, "link(): There is no agent with index %d\n", ends[j]);
+				exit(1);
+			}
+		}
+		graph->start[pair->from + 1]++;
+	}
+	for (size_t i = 0; i < len; i++) {
+		graph->start[i + 1] += graph->start[i];
+	}
+	for (size_t i = 0; i < num_links; i++) {
+		const link_pair *pair = DYN_ARRAY_GET(&graph->pairs, link_pair, i);
+		graph->targets[graph->start[pair->from]++] = pair->to;
+	}
+	// The scatter advanced each start to the start of the next agent, shift back
+	memmove(graph->start + 1, graph->start, len * sizeof(size_t));
+	graph->start[0] = 0;
+
+	memcpy(graph->next_targets, graph->targets, num_links * sizeof(size_t));
+	dyn_array_clean(&graph->pairs);
+	graph->pairs.values = NULL;
+}
+
+void link_graph_commit(link_graph *graph) {
+	#pragma omp for schedule(static)
+	for (size_t i = 0; i < graph->num_links; i++) {
+		graph->targets[i] = graph->next_targets[i];
+	}
+}
+
+void link_graph_free(link_graph *graph) {
+	free(graph->start);
+	free(graph->targets);
+	free(graph->next_targets);
+	dyn_array_clean(&graph->pairs);
+	memset(graph, 0, sizeof(link_graph));
+}
+
+/* Buckets per thread, so that threads with many messages can be balanced */
+#define INBOX_BUCKETS_PER_THREAD 4
+
+void inbox_init(inbox *box, size_t value_size, size_t len) {
+	memset(box, 0, sizeof(inbox));
+	box->value_size = value_size;
+	// Keep the values of the records aligned like the recipients
+	box->record_size = sizeof(size_t)
+		+ (value_size + sizeof(size_t) - 1) / sizeof(size_t) * sizeof(size_t);
+	box->len = len;
+	box->start = calloc(len + 1, sizeof(size_t));
+	box->num_threads = omp_get_max_threads();
+	box->threads = calloc(box->num_threads, sizeof(dyn_array));
+	box->num_buckets = (size_t) box->num_threads * INBOX_BUCKETS_PER_THREAD;
+	box->hist = malloc(box->num_buckets * box->num_threads * sizeof(size_t));
+}
+
+void inbox_free(inbox *box) {
+	for (int t = 0; t < box->num_threads; t++) {
+		dyn_array_clean(&box->threads[t]);
+	}
+	free(box->threads);
+	free(box->start);
+	free(box->values);
+	free(box->tmp);
+	free(box->hist);
+	memset(box, 0, sizeof(inbox));
+}
+
+void *inbox_place(inbox *box, size_t recipient) {
+	char *record = dyn_array_place(&box->threads[omp_get_thread_num()], box->record_size);
+	*(size_t *) record = recipient;
+	return record + sizeof(size_t);
+}
+
+static inline size_t inbox_bucket(const inbox *box, size_t recipient) {
+	return recipient * box->num_buckets / box->len;
+}
+
+/* First recipient of a bucket, the inverse of inbox_bucket() */
+static inline size_t inbox_bucket_begin(const inbox *box, size_t bucket) {
+	return (bucket * box->len + box->num_buckets - 1) / box->num_buckets;
+}
+
+void inbox_deliver(inbox *box) {
+	size_t num_buckets = box->num_buckets;
+	size_t record_size = box->record_size;
+	size_t value_size = box->value_size;
+	// The offset of thread t in bucket b is at hist[b * num_threads + t]
+	size_t *hist = box->hist;
+	int num_threads = box->num_threads;
+
+	#pragma omp for schedule(static)
+	for (int t = 0; t < num_threads; t++) {
+		const dyn_array *staged = &box->threads[t];
+		for (size_t b = 0; b < num_buckets; b++) {
+			hist[b * num_threads + t] = 0;
+		}
+		for (size_t i = 0; i < staged->len; i++) {
+			size_t recipient = *(const size_t *) ((const char *) staged->values + record_size * i);
+			hist[inbox_bucket(box, recipient) * num_threads + t]++;
+		}
+	}
+
+	#pragma omp single
+	{
+		size_t offset = 0;
+		for (size_t i = 0; i < num_buckets * num_threads; i++) {
+			size_t count = hist[i];
+			hist[i] = offset;
+			offset += count;
+		}
+
+		box->num_messages = offset;
+		box->start[box->len] = offset;
+		if (offset > box->cap) {
+			box->cap = offset;
+			free(box->tmp);
+			free(box->values);
+			box->tmp = malloc(record_size * offset);
+			box->values = malloc(value_size * offset);
+		}
+	}
+
+	// Scatter into buckets, records of a thread stay in the order they were sent
+	#pragma omp for schedule(static)
+	for (int t = 0; t < num_threads; t++) {
+		dyn_array *staged = &box->threads[t];
+		for (size_t i = 0; i < staged->len; i++) {
+			const char *record = (const char *) staged->values + record_size * i;
+			size_t *pos = &hist[inbox_bucket(box, *(const size_t *) record) * num_threads + t];
+			memcpy(box->tmp + record_size * (*pos)++, record, record_size);
+		}
+		staged->len = 0;
+	}
+
+	// Each bucket owns the start offsets of its recipients. The scatter above
+	// advanced the offset of every thread to its end, so the records of bucket
+	// b begin where the last thread of bucket b - 1 ended
+	#pragma omp for schedule(dynamic, 1)
+	for (size_t b = 0; b < num_buckets; b++) {
+		size_t begin = b ? hist[b * num_threads - 1] : 0;
+		size_t end = hist[(b + 1) * num_threads - 1];
+		size_t first = inbox_bucket_begin(box, b);
+		size_t last = inbox_bucket_begin(box, b + 1);
+		size_t *start = box->start;
+
+		for (size_t r = first; r < last; r++) {
+			start[r] = 0;
+		}
+		for (size_t i = begin; i < end; i++) {
+			start[*(const size_t *) (box->tmp + record_size * i)]++;
+		}
+		size_t offset = begin;
+		for (size_t r = first; r < last; r++) {
+			size_t count = start[r];
+			start[r] = offset;
+			offset += count;
+		}
+
+		// Counting sort, which advances each start to the start of the next
+		// recipient, shift back afterwards
+		for (size_t i = begin; i < end; i++) {
+			const char *record = box->tmp + record_size * i;
+			memcpy((char *) box->values + value_size * start[*(const size_t *) record]++,
+				record + sizeof(size_t), value_size);
+		}
+		for (size_t r = last; r > first + 1; r--) {
+			start[r - 1] = start[r - 2];
+		}
+		if (first < last) {
+			start[first] = begin;
+		}
+	}
+}
+
+void field_init(field *f, float3 min, float3 size, bool wrap, bool is_3d) {
+	abl_float mins[3] = { min.x, min.y, min.z };
+	abl_float sizes[3] = { size.x, size.y, is_3d ? size.z : 1 };
+	for (int axis = 0; axis < 3; axis++) {
+		f->min[axis] = mins[axis];
+		f->dims[axis] = sizes[axis] > 1 ? (int) ceil(sizes[axis]) : 1;
+	}
+	f->tiles[0] = (f->dims[0] + FIELD_TILE - 1) / FIELD_TILE;
+	f->tiles[1] = (f->dims[1] + FIELD_TILE - 1) / FIELD_TILE;
+	f->wrap = wrap;
+	f->is_3d = is_3d;
+	f->len = (size_t) f->tiles[0] * f->tiles[1] * f->dims[2] * FIELD_TILE * FIELD_TILE;
+	f->values = calloc(f->len, sizeof(abl_float));
+	inbox_init(&f->deposits, sizeof(field_deposit), f->len);
+	f->raised = malloc(f->len * sizeof(abl_float));
+	for (size_t i = 0; i < f->len; i++) {
+		f->raised[i] = -INFINITY;
+	}
+	f->tmp = calloc(f->len, sizeof(abl_float));
 }
 
-abl_float random_float(abl_float min, abl_float max) {
-	uint64_t x = xorshift128plus();
-	// This is a horrible way of generating a random float.
-	// It will do for now.
-	return min + (abl_float) x / (abl_float) (UINT64_MAX / (max - min));
-}
+/* Agent whose deposits the thread makes */
+static size_t field_agent = 0;
+#pragma omp threadprivate(field_agent)
+
+void field_begin_agent(size_t index) {
+	field_agent = index;
+}
+
+void field_add(field *f, size_t cell, abl_float amount) {
+	field_deposit *deposit = inbox_place(&f->deposits, cell);
+	deposit->agent = field_agent;
+	deposit->amount = amount;
+}
+
+void field_flush(field *f) {
+	inbox_deliver(&f->deposits);
+
+	const size_t *start = f->deposits.start;
+	field_deposit *deposits = f->deposits.values;
+	#pragma omp for schedule(static)
+	for (size_t i = 0; i < f->len; i++) {
+		// The deposits of a cell are in thread order. Sort them by agent, the
+		// deposits of one agent come from one thread and keep their order
+		size_t begin = start[i], end = start[i + 1];
+		for (size_t j = begin + 1; j < end; j++) {
+			field_deposit deposit = deposits[j];
+			size_t k = j;
+			for (; k > begin && deposits[k - 1].agent > deposit.agent; k--) {
+				deposits[k] = deposits[k - 1];
+			}
+			deposits[k] = deposit;
+		}
+
+		abl_float pending = 0;
+		for (size_t j = begin; j < end; j++) {
+			pending += deposits[j].amount;
+		}
+		abl_float value = f->values[i] + pending;
+		f->values[i] = f->raised[i] > value ? f->raised[i] : value;
+		f->raised[i] = -INFINITY;
+	}
+}
+
+void field_decay(field *f, abl_float rate) {
+	abl_float keep = 1 - rate;
+	size_t tile_len = FIELD_TILE * FIELD_TILE;
+	#pragma omp taskloop
+	for (size_t t = 0; t < f->len / tile_len; t++) {
+		abl_float *values = f->values + t * tile_len;
+		for (size_t i = 0; i < tile_len; i++) {
+			values[i] *= keep;
+		}
+	}
+}
+
+/* Neighbor of a cell along one axis. Beyond the border the cell itself is used,
+ * so that nothing diffuses out of the environment, unless it wraps. */
+static inline abl_float field_neighbor(const field *f, int x, int y, int z, int axis, int d) {
+	int c[3] = { x, y, z };
+	c[axis] += d;
+	if (c[axis] < 0 || c[axis] >= f->dims[axis]) {
+		if (f->wrap) {
+			c[axis] = c[axis] < 0 ? f->dims[axis] - 1 : 0;
+		} else {
+			c[axis] -= d;
+		}
+	}
+	return f->values[field_index(f, c[0], c[1], c[2])];
+}
+
+void field_diffuse(field *f, abl_float rate) {
+	int num_axes = f->is_3d ? 3 : 2;
+	size_t tiles_per_layer = (size_t) f->tiles[0] * f->tiles[1];
+	#pragma omp taskloop
+	for (size_t t = 0; t < tiles_per_layer * f->dims[2]; t++) {
+		int z = t / tiles_per_layer;
+		int y0 = (t % tiles_per_layer) / f->tiles[0] * FIELD_TILE;
+		int x0 = (t % f->tiles[0]) * FIELD_TILE;
+		int y1 = y0 + FIELD_TILE < f->dims[1] ? y0 + FIELD_TILE : f->dims[1];
+		int x1 = x0 + FIELD_TILE < f->dims[0] ? x0 + FIELD_TILE : f->dims[0];
+		for (int y = y0; y < y1; y++) {
+			for (int x = x0; x < x1; x++) {
+				// Each cell passes rate of its value on, evenly split among its neighbors
+				abl_float sum = 0;
+				for (int axis = 0; axis < num_axes; axis++) {
+					sum += field_neighbor(f, x, y, z, axis, -1)
+						+ field_neighbor(f, x, y, z, axis, 1);
+				}
+				size_t i = field_index(f, x, y, z);
+				abl_float value = f->values[i];
+				f->tmp[i] = value + rate * (sum / (2 * num_axes) - value);
+			}
+		}
+	}
+
+	abl_float *values = f->values;
+	f->values = f->tmp;
+	f->tmp = values;
+}
+
+/* Number of neighbor candidates visited per chunk */
+#define SCHEDULE_CHUNK_WORK 16384
+/* Minimum number of chunks per thread, so that there is something to steal */
+#define SCHEDULE_CHUNKS_PER_THREAD 8
+
+size_t schedule_chunk_size(const spatial_grid *grid, size_t len) {
+	size_t max_chunk = len / ((size_t) omp_get_max_threads() * SCHEDULE_CHUNKS_PER_THREAD);
+	size_t chunk = max_chunk;
+	if (grid) {
+		// A query with a radius of one cell size visits 3^d cells
+		abl_float cells = grid->dims[2] > 1 ? 27 : 9;
+		abl_float cost = cells * grid->density;
+		if (cost >= 1 && SCHEDULE_CHUNK_WORK / cost < chunk) {
+			chunk = (size_t) (SCHEDULE_CHUNK_WORK / cost);
+		}
+	}
+	return chunk ? chunk : 1;
+}
+
+typedef struct {
+	pthread_mutex_t lock;
+	size_t begin;
+	size_t end;
+	/* Keep the ranges of different threads on separate cache lines */
+	char pad[64];
+} work_range;
+
+struct work_queue {
+	work_range *ranges;
+	int num_ranges;
+	int max_ranges;
+	size_t chunk_size;
+};
+
+work_queue *work_queue_create(void) {
+	work_queue *queue = calloc(1, sizeof(work_queue));
+	queue->max_ranges = omp_get_max_threads();
+	queue->ranges = calloc(queue->max_ranges, sizeof(work_range));
+	for (int t = 0; t < queue->max_ranges; t++) {
+		pthread_mutex_init(&queue->ranges[t].lock, NULL);
+	}
+	return queue;
+}
+
+void work_queue_reset(work_queue *queue, size_t len, size_t chunk_size) {
+	int n = omp_get_num_threads();
+	assert(n <= queue->max_ranges);
+	queue->num_ranges = n;
+	queue->chunk_size = chunk_size ? chunk_size : 1;
+	for (int t = 0; t < n; t++) {
+		queue->ranges[t].begin = len * t / n;
+		queue->ranges[t].end = len * (t + 1) / n;
+	}
+}
+
+bool work_queue_next(work_queue *queue, size_t *begin, size_t *end) {
+	int self = omp_get_thread_num();
+	work_range *own = &queue->ranges[self];
+	for (;;) {
+		pthread_mutex_lock(&own->lock);
+		if (own->begin < own->end) {
+			*begin = own->begin;
+			*end = own->end - own->begin > queue->chunk_size
+				? own->begin + queue->chunk_size : own->end;
+			own->begin = *end;
+			pthread_mutex_unlock(&own->lock);
+			return true;
+		}
+		pthread_mutex_unlock(&own->lock);
+
+		// Steal the back half of the first non-empty range of another thread
+		size_t stolen_begin = 0, stolen_end = 0;
+		for (int i = 1; i < queue->num_ranges && stolen_begin == stolen_end; i++) {
+			work_range *victim = &queue->ranges[(self + i) % queue->num_ranges];
+			pthread_mutex_lock(&victim->lock);
+			if (victim->begin < victim->end) {
+				size_t half = (victim->end - victim->begin + 1) / 2;
+				stolen_end = victim->end;
+				stolen_begin = victim->end - half;
+				victim->end = stolen_begin;
+			}
+			pthread_mutex_unlock(&victim->lock);
+		}
+		if (stolen_begin == stolen_end) {
+			return false;
+		}
 
-int random_int(int min, int max) {
-	unsigned n = max-min+1;
-	if ((n & (n-1)) == 0) {
-		return xorshift128plus() & (n - 1);
+		pthread_mutex_lock(&own->lock);
+		own->begin = stolen_begin;
+		own->end = stolen_end;
+		pthread_mutex_unlock(&own->lock);
 	}
+}
 
-	// Not the fastest way to do this
-	unsigned r = UINT_MAX % n;
-	unsigned x;
-	do {
-		x = xorshift128plus();
-	} while (x >= UINT_MAX - r);
-	return min + x % n;
+void work_queue_free(work_queue *queue) {
+	for (int t = 0; t < queue->max_ranges; t++) {
+		pthread_mutex_destroy(&queue->ranges[t].lock);
+	}
+	free(queue->ranges);
+	free(queue);
 }
 
 static size_t type_info_get_size(const type_info *info) {
@@ -43,6 +1266,435 @@ static size_t type_info_get_size(const type_info *info) {
 	return info->offset;
 }
 
+static size_t type_id_get_size(type_id type) {
+	switch (type) {
+		case TYPE_BOOL: return sizeof(bool);
+		case TYPE_INT: return sizeof(int);
+		case TYPE_FLOAT: return sizeof(abl_float);
+		case TYPE_FLOAT2: return sizeof(float2);
+		case TYPE_FLOAT3: return sizeof(float3);
+		default:
+			assert(0);
+			return 0;
+	}
+}
+
+static void soa_array_reserve(soa_array *ary, const type_info *info, size_t cap) {
+	if (cap <= ary->cap) {
+		return;
+	}
+
+	for (size_t i = 0; info[i].type != TYPE_END; i++) {
+		ary->members[i] = realloc(ary->members[i], type_id_get_size(info[i].type) * cap);
+	}
+	ary->cap = cap;
+}
+
+size_t soa_array_place(soa_array *ary, const type_info *info) {
+	if (ary->len == ary->cap) {
+		soa_array_reserve(ary, info, ary->cap ? ary->cap * 2 : DYN_ARRAY_INIT_CAPACITY);
+	}
+	return ary->len++;
+}
+
+void soa_array_ensure(soa_array *ary, const type_info *info, size_t len) {
+	soa_array_reserve(ary, info, len);
+	ary->len = len;
+}
+
+void soa_array_clean(soa_array *ary, const type_info *info) {
+	for (size_t i = 0; info[i].type != TYPE_END; i++) {
+		free(ary->members[i]);
+		ary->members[i] = NULL;
+	}
+	ary->len = ary->cap = 0;
+}
+
+void agent_staging_init(agent_staging *staging) {
+	staging->num_threads = omp_get_max_threads();
+	staging->threads = calloc(staging->num_threads, sizeof(dyn_array));
+}
+
+void agent_staging_free(agent_staging *staging) {
+	for (int t = 0; t < staging->num_threads; t++) {
+		dyn_array_clean(&staging->threads[t]);
+	}
+	free(staging->threads);
+	staging->threads = NULL;
+	staging->num_threads = 0;
+}
+
+void *agent_staging_place(agent_staging *staging, size_t elem_size) {
+	return dyn_array_place(&staging->threads[omp_get_thread_num()], elem_size);
+}
+
+void agent_staging_flush(
+		agent_staging *staging, void *arr, const type_info *info, agent_layout layout) {
+	size_t elem_size = type_info_get_size(info);
+	for (int t = 0; t < staging->num_threads; t++) {
+		dyn_array *staged = &staging->threads[t];
+		if (layout == LAYOUT_SOA) {
+			soa_array *ary = (soa_array *) arr;
+			for (size_t i = 0; i < staged->len; i++) {
+				const char *agent = (const char *) staged->values + elem_size * i;
+				size_t idx = soa_array_place(ary, info);
+				for (size_t m = 0; info[m].type != TYPE_END; m++) {
+					size_t size = type_id_get_size(info[m].type);
+					memcpy((char *) ary->members[m] + size * idx, agent + info[m].offset, size);
+				}
+			}
+		} else if (staged->len) {
+			dyn_array *ary = (dyn_array *) arr;
+			size_t start = ary->len;
+			if (start + staged->len > ary->cap) {
+				size_t cap = ary->cap ? ary->cap : DYN_ARRAY_INIT_CAPACITY;
+				while (cap < start + staged->len) cap *= 2;
+				ary->values = realloc(ary->values, elem_size * cap);
+				ary->cap = cap;
+			}
+			memcpy((char *) ary->values + elem_size * start, staged->values, elem_size * staged->len);
+			ary->len += staged->len;
+		}
+		staged->len = 0;
+	}
+}
+
+/* Output offsets of the compaction chunks, shared by the team */
+static size_t *compact_offsets_buf;
+
+/* Splits [0, n) into one chunk per thread and computes the output offset of
+ * each chunk, as the exclusive prefix sum of the agents it keeps. The chunks
+ * can then be copied independently. The total number of kept agents is
+ * stored in offsets[num_chunks]. */
+static const size_t *compact_offsets(const bool *removed, size_t n, int num_chunks) {
+	#pragma omp single
+	if (!compact_offsets_buf) {
+		compact_offsets_buf = malloc((num_chunks + 1) * sizeof(size_t));
+	}
+
+	size_t *offsets = compact_offsets_buf;
+	#pragma omp for
+	for (int c = 0; c < num_chunks; c++) {
+		size_t kept = 0;
+		for (size_t i = n * c / num_chunks; i < n * (c + 1) / num_chunks; i++) {
+			kept += !removed[i];
+		}
+		offsets[c + 1] = kept;
+	}
+
+	#pragma omp single
+	{
+		offsets[0] = 0;
+		for (int c = 0; c < num_chunks; c++) {
+			offsets[c + 1] += offsets[c];
+		}
+	}
+	return offsets;
+}
+
+static void compact_copy(
+		char *dst, const char *src, const bool *removed, size_t n, size_t elem_size,
+		int num_chunks, const size_t *offsets) {
+	#pragma omp for
+	for (int c = 0; c < num_chunks; c++) {
+		size_t out = offsets[c];
+		for (size_t i = n * c / num_chunks; i < n * (c + 1) / num_chunks; i++) {
+			if (!removed[i]) {
+				memcpy(dst + elem_size * out++, src + elem_size * i, elem_size);
+			}
+		}
+	}
+}
+
+bool dyn_array_compact(
+		dyn_array *dst, const dyn_array *src, const bool *removed, size_t elem_size) {
+	// The caller may modify src as soon as all threads returned, so only
+	// read it before the first barrier
+	size_t n = src->len;
+	int num_chunks = omp_get_max_threads();
+	const size_t *offsets = compact_offsets(removed, n, num_chunks);
+	size_t len = offsets[num_chunks];
+	if (len == n) {
+		return false;
+	}
+
+	#pragma omp single
+	dyn_array_ensure(dst, elem_size, len);
+	compact_copy(dst->values, src->values, removed, n, elem_size, num_chunks, offsets);
+	return true;
+}
+
+bool soa_array_compact(
+		soa_array *dst, const soa_array *src, const bool *removed, const type_info *info) {
+	size_t n = src->len;
+	int num_chunks = omp_get_max_threads();
+	const size_t *offsets = compact_offsets(removed, n, num_chunks);
+	size_t len = offsets[num_chunks];
+	if (len == n) {
+		return false;
+	}
+
+	#pragma omp single
+	soa_array_ensure(dst, info, len);
+	for (size_t m = 0; info[m].type != TYPE_END; m++) {
+		compact_copy(dst->members[m], src->members[m], removed, n,
+			type_id_get_size(info[m].type), num_chunks, offsets);
+	}
+	return true;
+}
+
+size_t dyn_array_compact_indices(dyn_array *dst, const bool *skipped, size_t n) {
+	int num_chunks = omp_get_max_threads();
+	const size_t *offsets = compact_offsets(skipped, n, num_chunks);
+	size_t len = offsets[num_chunks];
+
+	#pragma omp single
+	dyn_array_ensure(dst, sizeof(size_t), len);
+	size_t *indices = dst->values;
+	#pragma omp for
+	for (int c = 0; c < num_chunks; c++) {
+		size_t out = offsets[c];
+		for (size_t i = n * c / num_chunks; i < n * (c + 1) / num_chunks; i++) {
+			if (!skipped[i]) {
+				indices[out++] = i;
+			}
+		}
+	}
+	return len;
+}
+
+static size_t agent_array_len_of(const void *arr, agent_layout layout) {
+	return layout == LAYOUT_SOA ? ((const soa_array *) arr)->len : ((const dyn_array *) arr)->len;
+}
+
+static void agent_array_ensure(
+		void *arr, const type_info *info, agent_layout layout, size_t len) {
+	if (layout == LAYOUT_SOA) {
+		soa_array_ensure((soa_array *) arr, info, len);
+	} else {
+		dyn_array_ensure((dyn_array *) arr, type_info_get_size(info), len);
+	}
+}
+
+static void agent_array_swap(
+		void *arr1, void *arr2, const type_info *info, agent_layout layout) {
+	if (layout == LAYOUT_SOA) {
+		soa_array *a = (soa_array *) arr1, *b = (soa_array *) arr2;
+		size_t len = a->len, cap = a->cap;
+		a->len = b->len; a->cap = b->cap;
+		b->len = len; b->cap = cap;
+		for (size_t m = 0; info[m].type != TYPE_END; m++) {
+			void *members = a->members[m];
+			a->members[m] = b->members[m];
+			b->members[m] = members;
+		}
+	} else {
+		dyn_array tmp = *(dyn_array *) arr1;
+		*(dyn_array *) arr1 = *(dyn_array *) arr2;
+		*(dyn_array *) arr2 = tmp;
+	}
+}
+
+/* Copies agent src_idx of src to dst_idx of dst */
+static void agent_array_copy(
+		void *dst, size_t dst_idx, const void *src, size_t src_idx,
+		const type_info *info, agent_layout layout) {
+	if (layout == LAYOUT_SOA) {
+		soa_array *d = (soa_array *) dst;
+		const soa_array *s = (const soa_array *) src;
+		for (size_t m = 0; info[m].type != TYPE_END; m++) {
+			size_t size = type_id_get_size(info[m].type);
+			memcpy((char *) d->members[m] + size * dst_idx,
+				(const char *) s->members[m] + size * src_idx, size);
+		}
+	} else {
+		size_t size = type_info_get_size(info);
+		memcpy((char *) ((dyn_array *) dst)->values + size * dst_idx,
+			(const char *) ((const dyn_array *) src)->values + size * src_idx, size);
+	}
+}
+
+void agent_order_init(agent_order *order, size_t len) {
+	order->keys = (dyn_array) { NULL, 0, 0 };
+	order->tmp = (dyn_array) { NULL, 0, 0 };
+	order->next = 0;
+	agent_order_extend(order, len);
+}
+
+void agent_order_free(agent_order *order) {
+	dyn_array_clean(&order->keys);
+	dyn_array_clean(&order->tmp);
+}
+
+void agent_order_extend(agent_order *order, size_t len) {
+	size_t start = order->keys.len;
+	dyn_array_ensure(&order->keys, sizeof(size_t), len);
+	for (size_t i = start; i < len; i++) {
+		*DYN_ARRAY_GET(&order->keys, size_t, i) = order->next++;
+	}
+}
+
+void agent_order_compact(agent_order *order, const bool *removed) {
+	if (dyn_array_compact(&order->tmp, &order->keys, removed, sizeof(size_t))) {
+		#pragma omp single
+		{
+			dyn_array tmp = order->keys;
+			order->keys = order->tmp;
+			order->tmp = tmp;
+		}
+	}
+}
+
+void agent_order_sort_cells(
+		agent_order *order, spatial_grid *grid, void *arr, void *tmp,
+		const type_info *info, agent_layout layout) {
+	size_t n = agent_array_len_of(arr, layout);
+	#pragma omp single
+	{
+		agent_array_ensure(tmp, info, layout, n);
+		dyn_array_ensure(&order->tmp, sizeof(size_t), n);
+	}
+
+	// Agents within a cell keep their relative order, so the grid built on
+	// the sorted agents only differs in its ids, which become the identity
+	const size_t *keys = order->keys.values;
+	size_t *sorted_keys = order->tmp.values;
+	#pragma omp for
+	for (size_t k = 0; k < n; k++) {
+		size_t id = grid->ids[k];
+		agent_array_copy(tmp, k, arr, id, info, layout);
+		sorted_keys[k] = keys[id];
+		grid->ids[k] = k;
+	}
+	if (grid->kind == SPATIAL_INDEX_LATTICE) {
+		// The lattice still holds the old ids
+		spatial_lattice_fill(grid);
+	}
+
+	#pragma omp single
+	{
+		agent_array_swap(arr, tmp, info, layout);
+		dyn_array keys_tmp = order->keys;
+		order->keys = order->tmp;
+		order->tmp = keys_tmp;
+	}
+}
+
+typedef struct {
+	size_t key;
+	size_t index;
+} agent_order_entry;
+
+static int agent_order_entry_cmp(const void *a, const void *b) {
+	size_t key_a = ((const agent_order_entry *) a)->key;
+	size_t key_b = ((const agent_order_entry *) b)->key;
+	return key_a < key_b ? -1 : key_a > key_b;
+}
+
+void agent_order_restore(
+		agent_order *order, void *arr, void *tmp, const type_info *info, agent_layout layout) {
+	size_t n = agent_array_len_of(arr, layout);
+	agent_order_entry *entries = malloc(n * sizeof(agent_order_entry));
+	for (size_t i = 0; i < n; i++) {
+		entries[i].key = *DYN_ARRAY_GET(&order->keys, size_t, i);
+		entries[i].index = i;
+	}
+	qsort(entries, n, sizeof(agent_order_entry), agent_order_entry_cmp);
+
+	agent_array_ensure(tmp, info, layout, n);
+	for (size_t k = 0; k < n; k++) {
+		agent_array_copy(tmp, k, arr, entries[k].index, info, layout);
+		*DYN_ARRAY_GET(&order->keys, size_t, k) = entries[k].key;
+	}
+	agent_array_swap(arr, tmp, info, layout);
+	free(entries);
+}
+
+double time_now(void) {
+	return omp_get_wtime();
+}
+
+#define LOG_WRITER_CAPACITY (1 << 20)
+/* Upper bound for the length of one formatted column */
+#define LOG_WRITER_MAX_COLUMN 64
+
+void log_writer_open(log_writer *writer, const char *path) {
+	writer->file = fopen(path, "w");
+	if (!writer->file) {
+		fprintf(stderr, "Failed to open log file %s\n", path);
+		exit(1);
+	}
+	writer->buf = malloc(LOG_WRITER_CAPACITY);
+	writer->len = 0;
+	writer->cap = LOG_WRITER_CAPACITY;
+	writer->line_start = true;
+}
+
+static void log_writer_flush(log_writer *writer) {
+	fwrite(writer->buf, 1, writer->len, writer->file);
+	writer->len = 0;
+}
+
+void log_writer_close(log_writer *writer) {
+	log_writer_flush(writer);
+	fclose(writer->file);
+	free(writer->buf);
+	writer->buf = NULL;
+}
+
+static char *log_writer_column(log_writer *writer) {
+	if (writer->cap - writer->len < LOG_WRITER_MAX_COLUMN) {
+		log_writer_flush(writer);
+	}
+	if (!writer->line_start) {
+		writer->buf[writer->len++] = ',';
+	}
+	writer->line_start = false;
+	return writer->buf + writer->len;
+}
+
+void log_csv_int(log_writer *writer, int value) {
+	char *out = log_writer_column(writer);
+	writer->len += snprintf(out, writer->cap - writer->len, "%d", value);
+}
+
+void log_csv_float(log_writer *writer, abl_float value) {
+	char *out = log_writer_column(writer);
+	writer->len += snprintf(out, writer->cap - writer->len, "%.9g", value);
+}
+
+void log_csv_end(log_writer *writer) {
+	if (writer->len == writer->cap) {
+		log_writer_flush(writer);
+	}
+	writer->buf[writer->len++] = '\n';
+	writer->line_start = true;
+}
+
+static size_t agent_array_len(const void *arr, const agent_info *info) {
+	if (info->layout == LAYOUT_SOA) {
+		return ((const soa_array *) arr)->len;
+	}
+	return ((const dyn_array *) arr)->len;
+}
+
+/* Returns a pointer to agent i. For struct-of-arrays storage the
+ * agent is first gathered into buf, using the type_info offsets. */
+static const char *agent_array_get(
+		const void *arr, const agent_info *info, size_t i, char *buf) {
+	if (info->layout == LAYOUT_SOA) {
+		const soa_array *ary = (const soa_array *) arr;
+		for (size_t m = 0; info->info[m].type != TYPE_END; m++) {
+			size_t size = type_id_get_size(info->info[m].type);
+			memcpy(buf + info->info[m].offset, (const char *) ary->members[m] + size * i, size);
+		}
+		return buf;
+	}
+
+	size_t elem_size = type_info_get_size(info->info);
+	return ((const char *) ((const dyn_array *) arr)->values) + elem_size * i;
+}
+
 static void save_json_agent(FILE *file, const char *agent, const type_info *info) {
 	bool first = true;
 	fputs("{", file);
@@ -93,19 +1745,21 @@ static void save_json_agent(FILE *file, const char *agent, const type_info *info
 	fputs("}", file);
 }
 
-static void save_json_agents(FILE *file, dyn_array *arr, const type_info *info) {
-	size_t elem_size = type_info_get_size(info);
+static void save_json_agents(FILE *file, const void *arr, const agent_info *info) {
+	char *buf = malloc(type_info_get_size(info->info));
+	size_t len = agent_array_len(arr, info);
 	bool first = true;
 
 	fputs("[", file);
-	for (size_t i = 0; i < arr->len; i++) {
+	for (size_t i = 0; i < len; i++) {
 		if (!first) fputs(",\n", file);
 		first = false;
 
-		char *agent = ((char *) arr->values) + elem_size * i;
-		save_json_agent(file, agent, info);
+		const char *agent = agent_array_get(arr, info, i, buf);
+		save_json_agent(file, agent, info->info);
 	}
 	fputs("]", file);
+	free(buf);
 }
 
 void save_json(void *agents, const agent_info *info, FILE *file) {
@@ -115,9 +1769,9 @@ void save_json(void *agents, const agent_info *info, FILE *file) {
 		if (!first) fputs(",", file);
 		first = false;
 
-		dyn_array *arr = (dyn_array *) ((char *) agents + info->offset);
+		const void *arr = (char *) agents + info->offset;
 		fprintf(file, "\"%s\":", info->name);
-		save_json_agents(file, arr, info->info);
+		save_json_agents(file, arr, info);
 		info++;
 	}
 	fputs("}", file);
@@ -181,19 +1835,21 @@ static void save_flame_xml_member(
 }
 
 static void save_flame_xml_agents(
-		FILE *file, dyn_array *arr, const char *name, const type_info *info_start, bool for_gpu) {
-	size_t elem_size = type_info_get_size(info_start);
-	for (size_t i = 0; i < arr->len; i++) {
-		char *agent = ((char *) arr->values) + elem_size * i;
+		FILE *file, const void *arr, const agent_info *agent, bool for_gpu) {
+	char *buf = malloc(type_info_get_size(agent->info));
+	size_t len = agent_array_len(arr, agent);
+	for (size_t i = 0; i < len; i++) {
+		const char *values = agent_array_get(arr, agent, i, buf);
 		fputs("<xagent>\n", file);
-		fprintf(file, "<name>%s</name>\n", name);
+		fprintf(file, "<name>%s</name>\n", agent->name);
 
-		for (const type_info *info = info_start; info->type != TYPE_END; info++) {
-			save_flame_xml_member(file, agent, info, for_gpu);
+		for (const type_info *info = agent->info; info->type != TYPE_END; info++) {
+			save_flame_xml_member(file, values, info, for_gpu);
 		}
 
 		fputs("</xagent>\n", file);
 	}
+	free(buf);
 }
 
 void save_flame_xml(void *agents, const agent_info *info, FILE *file, bool for_gpu) {
@@ -204,18 +1860,237 @@ void save_flame_xml(void *agents, const agent_info *info, FILE *file, bool for_g
 	fputs("</environment>\n", file);*/
 
 	while (info->name) {
-		dyn_array *arr = (dyn_array *) ((char *) agents + info->offset);
-		save_flame_xml_agents(file, arr, info->name, info->info, for_gpu);
+		const void *arr = (char *) agents + info->offset;
+		save_flame_xml_agents(file, arr, info, for_gpu);
 		info++;
 	}
 
 	fputs("</states>\n", file);
 }
 
+/*
+ * Binary snapshots, in native byte order:
+ *
+ *   snapshot: "ABLSNAP\0", u32 version, u32 sizeof(abl_float), u32 num_agents, agents
+ *   agent:    name, u32 num_members, members (u32 type_id, name), u64 len, columns
+ *   name:     u32 length, chars (without terminating NUL)
+ *
+ * Each agent type is followed by one column of len values per member, so
+ * the format does not depend on the agent layout or struct padding.
+ */
+
+#define SNAPSHOT_MAGIC "ABLSNAP"
+#define SNAPSHOT_VERSION 1
+/* Number of AoS agents that are gathered into one column write */
+#define SNAPSHOT_CHUNK 65536
+
+static void snapshot_write_u32(FILE *file, uint32_t value) {
+	fwrite(&value, sizeof(value), 1, file);
+}
+
+static void snapshot_write_name(FILE *file, const char *name) {
+	uint32_t len = strlen(name);
+	snapshot_write_u32(file, len);
+	fwrite(name, 1, len, file);
+}
+
+static void snapshot_write_agents(FILE *file, const void *arr, const agent_info *agent) {
+	uint32_t num_members = 0;
+	while (agent->info[num_members].type != TYPE_END) num_members++;
+
+	snapshot_write_name(file, agent->name);
+	snapshot_write_u32(file, num_members);
+	for (uint32_t m = 0; m < num_members; m++) {
+		snapshot_write_u32(file, agent->info[m].type);
+		snapshot_write_name(file, agent->info[m].name);
+	}
+
+	uint64_t len = agent_array_len(arr, agent);
+	fwrite(&len, sizeof(len), 1, file);
+
+	if (agent->layout == LAYOUT_SOA) {
+		const soa_array *ary = (const soa_array *) arr;
+		for (uint32_t m = 0; m < num_members; m++) {
+			fwrite(ary->members[m], type_id_get_size(agent->info[m].type), len, file);
+		}
+		return;
+	}
+
+	// Gather each member into a column, one chunk of agents at a time
+	const char *values = ((const dyn_array *) arr)->values;
+	size_t elem_size = type_info_get_size(agent->info);
+	char *buf = malloc(SNAPSHOT_CHUNK * sizeof(float3));
+	for (uint32_t m = 0; m < num_members; m++) {
+		size_t size = type_id_get_size(agent->info[m].type);
+		for (size_t start = 0; start < len; start += SNAPSHOT_CHUNK) {
+			size_t n = len - start < SNAPSHOT_CHUNK ? len - start : SNAPSHOT_CHUNK;
+			for (size_t i = 0; i < n; i++) {
+				memcpy(buf + size * i, values + elem_size * (start + i) + agent->info[m].offset, size);
+			}
+			fwrite(buf, size, n, file);
+		}
+	}
+	free(buf);
+}
+
+void save_binary(void *agents, const agent_info *info, FILE *file) {
+	uint32_t num_agents = 0;
+	while (info[num_agents].name) num_agents++;
+
+	fwrite(SNAPSHOT_MAGIC, 1, sizeof(SNAPSHOT_MAGIC), file);
+	snapshot_write_u32(file, SNAPSHOT_VERSION);
+	snapshot_write_u32(file, sizeof(abl_float));
+	snapshot_write_u32(file, num_agents);
+	for (uint32_t a = 0; a < num_agents; a++) {
+		snapshot_write_agents(file, (char *) agents + info[a].offset, &info[a]);
+	}
+}
+
+typedef struct {
+	const char *path;
+	const char *data;
+	size_t size;
+	size_t pos;
+} snapshot_reader;
+
+static void snapshot_error(const snapshot_reader *reader, const char *msg) {
+	fprintf(stderr, "load(): \"%s\" is not a compatible snapshot: %s\n", reader->path, msg);
+	exit(1);
+}
+
+static const char *snapshot_read(snapshot_reader *reader, size_t size) {
+	if (reader->size - reader->pos < size) {
+		snapshot_error(reader, "unexpected end of file");
+	}
+	const char *data = reader->data + reader->pos;
+	reader->pos += size;
+	return data;
+}
+
+static uint32_t snapshot_read_u32(snapshot_reader *reader) {
+	uint32_t value;
+	memcpy(&value, snapshot_read(reader, sizeof(value)), sizeof(value));
+	return value;
+}
+
+static bool snapshot_read_name(snapshot_reader *reader, const char *expected) {
+	uint32_t len = snapshot_read_u32(reader);
+	const char *name = snapshot_read(reader, len);
+	return strlen(expected) == len && memcmp(name, expected, len) == 0;
+}
+
+static const agent_info *snapshot_find_agent(snapshot_reader *reader, const agent_info *info) {
+	uint32_t len = snapshot_read_u32(reader);
+	const char *name = snapshot_read(reader, len);
+	for (; info->name; info++) {
+		if (strlen(info->name) == len && memcmp(name, info->name, len) == 0) {
+			return info;
+		}
+	}
+	snapshot_error(reader, "unknown agent type");
+	return NULL;
+}
+
+static void snapshot_read_agents(snapshot_reader *reader, void *agents, const agent_info *info) {
+	const agent_info *agent = snapshot_find_agent(reader, info);
+	uint32_t num_members = snapshot_read_u32(reader);
+	for (uint32_t m = 0; m < num_members; m++) {
+		if (agent->info[m].type == TYPE_END
+				|| snapshot_read_u32(reader) != (uint32_t) agent->info[m].type
+				|| !snapshot_read_name(reader, agent->info[m].name)) {
+			snapshot_error(reader, "agent members do not match");
+		}
+	}
+	if (agent->info[num_members].type != TYPE_END) {
+		snapshot_error(reader, "agent members do not match");
+	}
+
+	uint64_t len;
+	memcpy(&len, snapshot_read(reader, sizeof(len)), sizeof(len));
+
+	void *arr = (char *) agents + agent->offset;
+	if (agent->layout == LAYOUT_SOA) {
+		soa_array *ary = (soa_array *) arr;
+		soa_array_ensure(ary, agent->info, len);
+		for (uint32_t m = 0; m < num_members; m++) {
+			size_t size = type_id_get_size(agent->info[m].type);
+			memcpy(ary->members[m], snapshot_read(reader, size * len), size * len);
+		}
+		return;
+	}
+
+	dyn_array *ary = (dyn_array *) arr;
+	size_t elem_size = type_info_get_size(agent->info);
+	dyn_array_ensure(ary, elem_size, len);
+	for (uint32_t m = 0; m < num_members; m++) {
+		size_t size = type_id_get_size(agent->info[m].type);
+		const char *column = snapshot_read(reader, size * len);
+		for (size_t i = 0; i < len; i++) {
+			memcpy((char *) ary->values + elem_size * i + agent->info[m].offset, column + size * i, size);
+		}
+	}
+}
+
+void load(void *agents, const agent_info *info, const char *path) {
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "load(): Could not open \"%s\" for reading\n", path);
+		exit(1);
+	}
+
+	snapshot_reader reader = { path, NULL, st.st_size, 0 };
+	if (reader.size) {
+		reader.data = mmap(NULL, reader.size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (reader.data == MAP_FAILED) {
+			fprintf(stderr, "load(): Could not map \"%s\"\n", path);
+			exit(1);
+		}
+	}
+	close(fd);
+
+	if (memcmp(snapshot_read(&reader, sizeof(SNAPSHOT_MAGIC)), SNAPSHOT_MAGIC,
+				sizeof(SNAPSHOT_MAGIC)) != 0) {
+		snapshot_error(&reader, "bad magic");
+	}
+	if (snapshot_read_u32(&reader) != SNAPSHOT_VERSION) {
+		snapshot_error(&reader, "unsupported version");
+	}
+	if (snapshot_read_u32(&reader) != sizeof(abl_float)) {
+		snapshot_error(&reader, "float precision does not match");
+	}
+
+	// Agent types that are not part of the snapshot end up empty
+	for (const agent_info *agent = info; agent->name; agent++) {
+		void *arr = (char *) agents + agent->offset;
+		if (agent->layout == LAYOUT_SOA) {
+			((soa_array *) arr)->len = 0;
+		} else {
+			((dyn_array *) arr)->len = 0;
+		}
+	}
+
+	uint32_t num_agents = snapshot_read_u32(&reader);
+	for (uint32_t a = 0; a < num_agents; a++) {
+		snapshot_read_agents(&reader, agents, info);
+	}
+
+	if (reader.size) {
+		munmap((void *) reader.data, reader.size);
+	}
+}
+
+static bool path_has_suffix(const char *path, const char *suffix) {
+	size_t path_len = strlen(path), suffix_len = strlen(suffix);
+	return path_len >= suffix_len && strcmp(path + path_len - suffix_len, suffix) == 0;
+}
+
 void save(void *agents, const agent_info *info, const char *path, save_type type) {
-	(void) type; // Ignored for now
+	if (type == SAVE_JSON && path_has_suffix(path, ".bin")) {
+		type = SAVE_BINARY;
+	}
 
-	FILE *file = fopen(path, "w");
+	FILE *file = fopen(path, type == SAVE_BINARY ? "wb" : "w");
 	if (!file) {
 		fprintf(stderr, "save(): Count not open \"%s\" for writing\n", path);
 		return;
@@ -225,7 +2100,136 @@ void save(void *agents, const agent_info *info, const char *path, save_type type
 		save_json(agents, info, file);
 	} else if (type == SAVE_FLAME_XML || type == SAVE_FLAMEGPU_XML) {
 		save_flame_xml(agents, info, file, type == SAVE_FLAMEGPU_XML);
+	} else if (type == SAVE_BINARY) {
+		// Large buffer, so that the columns are written in few large writes
+		setvbuf(file, NULL, _IOFBF, 1 << 22);
+		save_binary(agents, info, file);
 	}
 
 	fclose(file);
 }
+
+struct async_writer {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool pending;
+	bool quit;
+	const agent_info *info;
+	/* Copy of the agent structure, its arrays are reused between snapshots */
+	void *snapshot;
+	char path[1024];
+};
+
+static void *async_writer_run(void *arg) {
+	async_writer *writer = arg;
+	pthread_mutex_lock(&writer->lock);
+	for (;;) {
+		while (!writer->pending && !writer->quit) {
+			pthread_cond_wait(&writer->cond, &writer->lock);
+		}
+		if (!writer->pending) {
+			break;
+		}
+
+		pthread_mutex_unlock(&writer->lock);
+		save(writer->snapshot, writer->info, writer->path, SAVE_JSON);
+		pthread_mutex_lock(&writer->lock);
+
+		writer->pending = false;
+		pthread_cond_broadcast(&writer->cond);
+	}
+	pthread_mutex_unlock(&writer->lock);
+	return NULL;
+}
+
+async_writer *async_writer_create(const agent_info *info, size_t agents_size) {
+	async_writer *writer = calloc(1, sizeof(async_writer));
+	writer->info = info;
+	writer->snapshot = calloc(1, agents_size);
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->cond, NULL);
+	pthread_create(&writer->thread, NULL, async_writer_run, writer);
+	return writer;
+}
+
+static void async_writer_copy(async_writer *writer, const void *agents) {
+	for (const agent_info *agent = writer->info; agent->name; agent++) {
+		const void *src = (const char *) agents + agent->offset;
+		void *dst = (char *) writer->snapshot + agent->offset;
+		if (agent->layout == LAYOUT_SOA) {
+			const soa_array *from = src;
+			soa_array *to = dst;
+			soa_array_ensure(to, agent->info, from->len);
+			for (size_t m = 0; agent->info[m].type != TYPE_END; m++) {
+				memcpy(to->members[m], from->members[m],
+					type_id_get_size(agent->info[m].type) * from->len);
+			}
+		} else {
+			const dyn_array *from = src;
+			dyn_array *to = dst;
+			size_t elem_size = type_info_get_size(agent->info);
+			dyn_array_ensure(to, elem_size, from->len);
+			memcpy(to->values, from->values, elem_size * from->len);
+		}
+	}
+}
+
+/* Expands %d to the timestep and %% to %, without passing the user's string
+ * to printf */
+static void async_writer_format_path(char *path, size_t size, const char *path_fmt, int timestep) {
+	size_t len = 0;
+	for (const char *c = path_fmt; *c && len + 1 < size; c++) {
+		if (c[0] == '%' && c[1] == 'd') {
+			len += snprintf(path + len, size - len, "%d", timestep);
+			if (len >= size) {
+				len = size - 1;
+			}
+			c++;
+		} else {
+			if (c[0] == '%' && c[1] == '%') {
+				c++;
+			}
+			path[len++] = *c;
+		}
+	}
+	path[len] = '\0';
+}
+
+void async_writer_save(async_writer *writer, const void *agents, const char *path_fmt, int timestep) {
+	pthread_mutex_lock(&writer->lock);
+	while (writer->pending) {
+		pthread_cond_wait(&writer->cond, &writer->lock);
+	}
+	pthread_mutex_unlock(&writer->lock);
+
+	// The writer thread is idle, so the snapshot can be overwritten
+	async_writer_copy(writer, agents);
+	async_writer_format_path(writer->path, sizeof(writer->path), path_fmt, timestep);
+
+	pthread_mutex_lock(&writer->lock);
+	writer->pending = true;
+	pthread_cond_broadcast(&writer->cond);
+	pthread_mutex_unlock(&writer->lock);
+}
+
+void async_writer_free(async_writer *writer) {
+	pthread_mutex_lock(&writer->lock);
+	writer->quit = true;
+	pthread_cond_broadcast(&writer->cond);
+	pthread_mutex_unlock(&writer->lock);
+	pthread_join(writer->thread, NULL);
+
+	for (const agent_info *agent = writer->info; agent->name; agent++) {
+		void *arr = (char *) writer->snapshot + agent->offset;
+		if (agent->layout == LAYOUT_SOA) {
+			soa_array_clean(arr, agent->info);
+		} else {
+			dyn_array_clean(arr);
+		}
+	}
+	free(writer->snapshot);
+	pthread_mutex_destroy(&writer->lock);
+	pthread_cond_destroy(&writer->cond);
+	free(writer);
+}
@@ -1,8 +1,11 @@
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
 
 /*
  * Dynamic array
@@ -28,6 +31,9 @@ typedef struct {
 #define DYN_ARRAY_PLACE(ary, elem_type) \
 	((elem_type *) dyn_array_place(ary, sizeof(elem_type)))
 
+#define DYN_ARRAY_ENSURE(ary, elem_type, len) \
+	dyn_array_ensure(ary, sizeof(elem_type), len)
+
 static inline dyn_array dyn_array_create_fixed(size_t elem_size, size_t len) {
 	return (dyn_array) {
 		.values = calloc(elem_size, len),
@@ -51,6 +57,15 @@ static inline void *dyn_array_place(dyn_array *ary, size_t elem_size) {
 	return (char *) ary->values + elem_size * ary->len++;
 }
 
+/* Makes sure there is storage for len elements, and sets the length */
+static inline void dyn_array_ensure(dyn_array *ary, size_t elem_size, size_t len) {
+	if (len > ary->cap) {
+		ary->cap = len;
+		ary->values = realloc(ary->values, elem_size * len);
+	}
+	ary->len = len;
+}
+
 static inline void dyn_array_clean(dyn_array *ary) {
 	free(ary->values);
 	ary->len = ary->cap = 0;
@@ -73,6 +88,32 @@ static inline abl_float max(abl_float x, abl_float y) {
 	return fmax(x, y);
 }
 
+/* Floating-point sums over agents are computed per block of this many agents,
+ * and the partial sums of the blocks are added in order. Their results then
+ * do not depend on the number of threads. */
+#define REDUCTION_BLOCK_SIZE 1024
+
+static inline size_t reduction_num_blocks(size_t len) {
+	return (len + REDUCTION_BLOCK_SIZE - 1) / REDUCTION_BLOCK_SIZE;
+}
+static inline size_t reduction_block_end(size_t block, size_t len) {
+	size_t end = (block + 1) * REDUCTION_BLOCK_SIZE;
+	return end < len ? end : len;
+}
+
+/* Bin of value in a histogram with bins equally sized bins between lo and hi.
+ * Values outside of the range are counted in the first or last bin. */
+static inline int histogram_bin(abl_float value, abl_float lo, abl_float hi, int bins) {
+	abl_float bin = (value - lo) / (hi - lo) * bins;
+	if (!(bin >= 0)) {
+		return 0;
+	}
+	if (bin >= bins) {
+		return bins - 1;
+	}
+	return (int) bin;
+}
+
 /*
  * float2
  */
@@ -167,6 +208,39 @@ static inline abl_float dist_float3(float3 a, float3 b) {
 	return length_float3(float3_sub(a, b));
 }
 
+/* Vector from a to b */
+static inline float2 displacement_float2(float2 a, float2 b) {
+	return float2_sub(b, a);
+}
+static inline float3 displacement_float3(float3 a, float3 b) {
+	return float3_sub(b, a);
+}
+
+/* Distance and vector to the closest image of b in an environment that wraps
+ * around with the given period per axis, 0 for axes that don't wrap */
+static inline abl_float wrap_delta(abl_float d, abl_float period) {
+	abl_float half = period / 2;
+	return d > half ? d - period : d < -half ? d + period : d;
+}
+static inline abl_float dist_wrap_float2(float2 a, float2 b, float2 period) {
+	return length_float2(float2_create(
+		wrap_delta(a.x - b.x, period.x), wrap_delta(a.y - b.y, period.y)));
+}
+static inline abl_float dist_wrap_float3(float3 a, float3 b, float3 period) {
+	return length_float3(float3_create(
+		wrap_delta(a.x - b.x, period.x), wrap_delta(a.y - b.y, period.y),
+		wrap_delta(a.z - b.z, period.z)));
+}
+static inline float2 displacement_wrap_float2(float2 a, float2 b, float2 period) {
+	return float2_create(
+		wrap_delta(b.x - a.x, period.x), wrap_delta(b.y - a.y, period.y));
+}
+static inline float3 displacement_wrap_float3(float3 a, float3 b, float3 period) {
+	return float3_create(
+		wrap_delta(b.x - a.x, period.x), wrap_delta(b.y - a.y, period.y),
+		wrap_delta(b.z - a.z, period.z));
+}
+
 static inline float2 normalize_float2(float2 v) {
 	return float2_div_scalar(v, length_float2(v));
 }
@@ -174,10 +248,685 @@ static inline float3 normalize_float3(float3 v) {
 	return float3_div_scalar(v, length_float3(v));
 }
 
+/*
+ * Spatial index
+ *
+ * Agents are indexed either by a uniform grid or by an adaptive quadtree/octree.
+ * Both sort the agents into ids, so that the agents of a grid cell or a tree node
+ * are adjacent, and share the query interface below.
+ *
+ * In a lattice environment the grid has unit cells holding at most one agent,
+ * and additionally maps every cell directly to its agent. for-near loops then
+ * visit a fixed stencil of cells instead of querying the grid.
+ */
+
+typedef enum {
+	SPATIAL_INDEX_GRID,
+	SPATIAL_INDEX_TREE,
+	/* Choose the tree if the grid occupancy is too uneven, on every build */
+	SPATIAL_INDEX_AUTO,
+	/* Grid that also fills the lattice, see spatial_grid_init_lattice() */
+	SPATIAL_INDEX_LATTICE,
+} spatial_index_kind;
+
+/* Maximum number of agents in a tree leaf, unless the maximum depth is reached */
+#define SPATIAL_TREE_LEAF_SIZE 16
+#define SPATIAL_TREE_MAX_DEPTH 16
+
+typedef struct {
+	/* Covered box in tree coordinates, see spatial_tree_coord() */
+	int lo[3];
+	int hi[3];
+	/* Agents in the subtree are ids[begin] .. ids[end-1] */
+	size_t begin;
+	size_t end;
+	/* Nodes are stored in pre-order, this is the index of the node after the subtree */
+	size_t skip;
+	bool leaf;
+} spatial_tree_node;
+
+typedef struct {
+	abl_float min[3];
+	/* Along a wrapping axis, cells are stretched so that whole cells cover it */
+	abl_float cell_size[3];
+	int dims[3];
+	size_t num_cells;
+	/* Agents in cell c are ids[cell_start[c]] .. ids[cell_start[c+1]-1] */
+	size_t *cell_start;
+	size_t *ids;
+	/* Scratch space holding the cell of each agent during the build */
+	size_t *cells;
+	size_t cap;
+	/* Average number of agents sharing the cell (or tree leaf) of an agent */
+	abl_float density;
+	/* Cleared whenever the indexed agent array changes */
+	bool valid;
+	/* Size of the environment along axes whose borders are connected, 0 otherwise */
+	abl_float period[3];
+	bool wraps;
+
+	spatial_index_kind kind;
+	/* Whether the last build produced a tree rather than a grid */
+	bool use_tree;
+	/* Tree coordinates per unit of length */
+	abl_float tree_scale[3];
+	spatial_tree_node *nodes;
+	size_t num_nodes;
+	size_t nodes_cap;
+	/* Scratch space for sorting the agents by tree position */
+	void *keys;
+	void *keys_tmp;
+	size_t *hist;
+	size_t hist_cap;
+
+	/* Agent in each cell, or LATTICE_EMPTY. The lattice is padded by lattice_pad
+	 * cells on each side, so that stencils around any cell stay inside of it.
+	 * Padding cells are empty, or repeat the opposite border along wrapping axes. */
+	size_t *lattice;
+	int lattice_pad;
+	int lattice_dims[3];
+} spatial_grid;
+
+#define LATTICE_EMPTY SIZE_MAX
+
+typedef struct {
+	const spatial_grid *grid;
+	size_t pos;
+	size_t end;
+	int x, y, z;
+	/* Query box in grid cells, or in tree coordinates if the grid uses a tree */
+	int lo[3];
+	int hi[3];
+	/* Next tree node to visit */
+	size_t node;
+	/* A query box that extends across the border of a wrapping grid is split into
+	 * up to 8 parts. Bit i of the part selects the part beyond the border on axis i. */
+	int part;
+	int wrap_lo[3];
+	int wrap_hi[3];
+} spatial_grid_iter;
+
+void spatial_grid_init(spatial_grid *grid, float3 min, float3 size, abl_float cell_size,
+		spatial_index_kind kind, bool wrap);
+/* pos points to the position of the first agent, positions are stride bytes apart.
+ * Inside a parallel region this must be called by all threads of the team. */
+void spatial_grid_build(
+		spatial_grid *grid, const void *pos, size_t len, size_t stride, bool is_3d);
+void spatial_grid_free(spatial_grid *grid);
+/* Allocates the lattice of a SPATIAL_INDEX_LATTICE grid with unit cells. Stencils
+ * may reach pad cells beyond the border along x, y and, if is_3d, z. */
+void spatial_grid_init_lattice(spatial_grid *grid, int pad, bool is_3d);
+
+/* Out-of-bounds positions are wrapped around or mapped to the border */
+static inline int spatial_grid_outside_coord(abl_float c, int n, bool wrap) {
+	if (wrap) {
+		c -= floor(c / n) * n;
+		if (c >= 0 && c < n) return (int) c;
+	}
+	return !(c >= 0) ? 0 : n - 1;
+}
+
+static inline int spatial_grid_coord(const spatial_grid *grid, int axis, abl_float v) {
+	abl_float c = floor((v - grid->min[axis]) / grid->cell_size[axis]);
+	if (!(c >= 0) || c >= grid->dims[axis]) {
+		return spatial_grid_outside_coord(c, grid->dims[axis], grid->period[axis] > 0);
+	}
+	return (int) c;
+}
+
+static inline size_t spatial_grid_cell(const spatial_grid *grid, int x, int y, int z) {
+	return ((size_t) z * grid->dims[1] + y) * grid->dims[0] + x;
+}
+
+/* Index into the lattice of the cell containing p */
+static inline size_t spatial_lattice_cell_float2(const spatial_grid *grid, float2 p) {
+	int pad = grid->lattice_pad;
+	return (size_t) (spatial_grid_coord(grid, 1, p.y) + pad) * grid->lattice_dims[0]
+		+ spatial_grid_coord(grid, 0, p.x) + pad;
+}
+static inline size_t spatial_lattice_cell_float3(const spatial_grid *grid, float3 p) {
+	int pad = grid->lattice_pad;
+	size_t z = spatial_grid_coord(grid, 2, p.z) + pad;
+	size_t y = spatial_grid_coord(grid, 1, p.y) + pad;
+	return (z * grid->lattice_dims[1] + y) * grid->lattice_dims[0]
+		+ spatial_grid_coord(grid, 0, p.x) + pad;
+}
+
+/* Position on the finest tree level. Like for the grid, out-of-bounds positions
+ * are mapped to the border. */
+static inline int spatial_tree_coord(const spatial_grid *grid, int axis, abl_float v) {
+	abl_float c = floor((v - grid->min[axis]) * grid->tree_scale[axis]);
+	if (!(c >= 0) || c >= (1 << SPATIAL_TREE_MAX_DEPTH)) {
+		return spatial_grid_outside_coord(
+			c, 1 << SPATIAL_TREE_MAX_DEPTH, grid->period[axis] > 0);
+	}
+	return (int) c;
+}
+
+/* Moves on to the next part of a query box, returns false if there is none */
+static inline bool spatial_grid_next_part(spatial_grid_iter *it) {
+	const spatial_grid *grid = it->grid;
+	while (++it->part < 8) {
+		bool valid = true;
+		for (int axis = 0; axis < 3; axis++) {
+			int n = grid->use_tree ? 1 << SPATIAL_TREE_MAX_DEPTH : grid->dims[axis];
+			if ((it->part >> axis) & 1) {
+				// The part beyond the upper border, wrapped around to the lower one
+				valid = valid && it->wrap_hi[axis] >= n;
+				it->lo[axis] = 0;
+				it->hi[axis] = it->wrap_hi[axis] - n;
+			} else {
+				it->lo[axis] = it->wrap_lo[axis];
+				it->hi[axis] = it->wrap_hi[axis] < n ? it->wrap_hi[axis] : n - 1;
+			}
+		}
+		if (valid) {
+			it->x = it->lo[0] - 1;
+			it->y = it->lo[1];
+			it->z = it->lo[2];
+			it->node = 0;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Query of a wrapping grid. The box is shifted so that it starts inside the
+ * grid, and only split into parts if it extends across the upper border. */
+static inline spatial_grid_iter spatial_grid_query_wrapped(
+		const spatial_grid *grid, float3 p, abl_float radius) {
+	abl_float ps[3] = { p.x, p.y, p.z };
+	spatial_grid_iter it;
+	it.grid = grid;
+	it.pos = it.end = 0;
+	it.part = -1;
+	for (int axis = 0; axis < 3; axis++) {
+		if (!(grid->period[axis] > 0)) {
+			it.wrap_lo[axis] = grid->use_tree
+				? spatial_tree_coord(grid, axis, ps[axis] - radius)
+				: spatial_grid_coord(grid, axis, ps[axis] - radius);
+			it.wrap_hi[axis] = grid->use_tree
+				? spatial_tree_coord(grid, axis, ps[axis] + radius)
+				: spatial_grid_coord(grid, axis, ps[axis] + radius);
+			continue;
+		}
+
+		int n = grid->use_tree ? 1 << SPATIAL_TREE_MAX_DEPTH : grid->dims[axis];
+		abl_float lo, hi;
+		if (grid->use_tree) {
+			lo = floor((ps[axis] - radius - grid->min[axis]) * grid->tree_scale[axis]);
+			hi = floor((ps[axis] + radius - grid->min[axis]) * grid->tree_scale[axis]);
+		} else {
+			lo = floor((ps[axis] - radius - grid->min[axis]) / grid->cell_size[axis]);
+			hi = floor((ps[axis] + radius - grid->min[axis]) / grid->cell_size[axis]);
+		}
+		if (lo >= 0 && hi < n) {
+			it.wrap_lo[axis] = (int) lo;
+			it.wrap_hi[axis] = (int) hi;
+		} else if (!(hi - lo + 1 < n)) {
+			// The box covers the whole axis
+			it.wrap_lo[axis] = 0;
+			it.wrap_hi[axis] = n - 1;
+		} else {
+			abl_float shift = floor(lo / n) * n;
+			it.wrap_lo[axis] = (int) (lo - shift);
+			it.wrap_hi[axis] = (int) (hi - shift);
+		}
+	}
+	spatial_grid_next_part(&it);
+	return it;
+}
+
+/* Iterates over all agents in cells overlapping the box [p - radius, p + radius] */
+static inline spatial_grid_iter spatial_grid_query(
+		const spatial_grid *grid, float3 p, abl_float radius) {
+	if (grid->wraps) {
+		return spatial_grid_query_wrapped(grid, p, radius);
+	}
+
+	spatial_grid_iter it;
+	it.grid = grid;
+	it.pos = it.end = 0;
+	it.node = 0;
+	// There is only a single part
+	it.part = 7;
+	if (grid->use_tree) {
+		it.lo[0] = spatial_tree_coord(grid, 0, p.x - radius);
+		it.lo[1] = spatial_tree_coord(grid, 1, p.y - radius);
+		it.lo[2] = spatial_tree_coord(grid, 2, p.z - radius);
+		it.hi[0] = spatial_tree_coord(grid, 0, p.x + radius);
+		it.hi[1] = spatial_tree_coord(grid, 1, p.y + radius);
+		it.hi[2] = spatial_tree_coord(grid, 2, p.z + radius);
+		return it;
+	}
+	it.lo[0] = spatial_grid_coord(grid, 0, p.x - radius);
+	it.lo[1] = spatial_grid_coord(grid, 1, p.y - radius);
+	it.lo[2] = spatial_grid_coord(grid, 2, p.z - radius);
+	it.hi[0] = spatial_grid_coord(grid, 0, p.x + radius);
+	it.hi[1] = spatial_grid_coord(grid, 1, p.y + radius);
+	it.hi[2] = spatial_grid_coord(grid, 2, p.z + radius);
+	it.x = it.lo[0] - 1;
+	it.y = it.lo[1];
+	it.z = it.lo[2];
+	return it;
+}
+static inline spatial_grid_iter spatial_grid_query_float2(
+		const spatial_grid *grid, float2 p, abl_float radius) {
+	return spatial_grid_query(grid, float3_create(p.x, p.y, 0), radius);
+}
+static inline spatial_grid_iter spatial_grid_query_float3(
+		const spatial_grid *grid, float3 p, abl_float radius) {
+	return spatial_grid_query(grid, p, radius);
+}
+
+/* Returns the next range [*begin, *end) of slots in tree nodes overlapping the
+ * query box. Nodes that lie inside the box are returned as a whole. */
+static inline bool spatial_tree_next_range(
+		spatial_grid_iter *it, size_t *begin, size_t *end) {
+	const spatial_grid *grid = it->grid;
+	while (it->node < grid->num_nodes) {
+		const spatial_tree_node *node = &grid->nodes[it->node];
+		bool overlaps = true, inside = true;
+		for (int axis = 0; axis < 3; axis++) {
+			overlaps = overlaps
+				&& node->lo[axis] <= it->hi[axis] && node->hi[axis] >= it->lo[axis];
+			inside = inside
+				&& node->lo[axis] >= it->lo[axis] && node->hi[axis] <= it->hi[axis];
+		}
+		if (overlaps && !inside && !node->leaf) {
+			// Descend into the first child
+			it->node++;
+			continue;
+		}
+
+		it->node = node->skip;
+		if (overlaps && node->begin != node->end) {
+			*begin = node->begin;
+			*end = node->end;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Returns the position of the next agent in cell order, i.e. its index into ids */
+static inline bool spatial_grid_next_slot(spatial_grid_iter *it, size_t *slot) {
+	const spatial_grid *grid = it->grid;
+	while (it->pos == it->end) {
+		if (grid->use_tree) {
+			if (!spatial_tree_next_range(it, &it->pos, &it->end)
+					&& !spatial_grid_next_part(it)) {
+				return false;
+			}
+			continue;
+		}
+
+		if (++it->x > it->hi[0]) {
+			it->x = it->lo[0];
+			if (++it->y > it->hi[1]) {
+				it->y = it->lo[1];
+				if (++it->z > it->hi[2]) {
+					if (!spatial_grid_next_part(it)) {
+						return false;
+					}
+					continue;
+				}
+			}
+		}
+
+		size_t cell = spatial_grid_cell(grid, it->x, it->y, it->z);
+		it->pos = grid->cell_start[cell];
+		it->end = grid->cell_start[cell + 1];
+	}
+	*slot = it->pos++;
+	return true;
+}
+
+/* Returns the next row of the query box as a range [*begin, *end) of slots.
+ * The cells of a row are adjacent in cell order, so their agents are too.
+ * For a tree, the rows are the overlapping nodes. */
+static inline bool spatial_grid_next_row(
+		spatial_grid_iter *it, size_t *begin, size_t *end) {
+	const spatial_grid *grid = it->grid;
+	if (grid->use_tree) {
+		while (!spatial_tree_next_range(it, begin, end)) {
+			if (!spatial_grid_next_part(it)) {
+				return false;
+			}
+		}
+		return true;
+	}
+	if (it->z > it->hi[2] && !spatial_grid_next_part(it)) {
+		return false;
+	}
+
+	*begin = grid->cell_start[spatial_grid_cell(grid, it->lo[0], it->y, it->z)];
+	*end = grid->cell_start[spatial_grid_cell(grid, it->hi[0], it->y, it->z) + 1];
+	if (++it->y > it->hi[1]) {
+		it->y = it->lo[1];
+		it->z++;
+	}
+	return true;
+}
+
+static inline bool spatial_grid_next(spatial_grid_iter *it, size_t *id) {
+	size_t slot;
+	if (!spatial_grid_next_slot(it, &slot)) {
+		return false;
+	}
+	*id = it->grid->ids[slot];
+	return true;
+}
+
+/*
+ * Verlet neighbor lists
+ *
+ * The neighbors within radius + skin of every query agent are stored in a
+ * list, which is reused across timesteps. The list only has to be rebuilt once
+ * the largest displacement of a query agent plus the largest displacement of
+ * a neighbor since the last build exceeds the skin.
+ */
+
+typedef struct {
+	/* Neighbors of query agent i are ids[start[i]] to ids[start[i + 1] - 1] */
+	size_t *start;
+	size_t *ids;
+	size_t ids_cap;
+	/* Positions at the time of the last build */
+	float3 *query_pos;
+	float3 *pos;
+	size_t query_len;
+	size_t len;
+	size_t query_cap;
+	size_t cap;
+	bool valid;
+} verlet_list;
+
+/* Builds the list for query_len query agents and len neighbor agents, whose
+ * positions are located at query_pos and pos with the given strides. grid
+ * has to be valid for the neighbor agents. Inside a parallel region this must
+ * be called by all threads of the team. */
+void verlet_list_build(
+		verlet_list *list, const spatial_grid *grid, abl_float radius,
+		const void *query_pos, size_t query_len, size_t query_stride,
+		const void *pos, size_t len, size_t stride, bool is_3d);
+/* Whether the list is invalid, the number of agents changed, or the agents
+ * moved too far since the last build. Must be called by all threads. */
+bool verlet_list_stale(
+		const verlet_list *list, abl_float skin,
+		const void *query_pos, size_t query_len, size_t query_stride,
+		const void *pos, size_t len, size_t stride, bool is_3d);
+void verlet_list_free(verlet_list *list);
+
+/*
+ * Nearest neighbor queries
+ *
+ * The k agents closest to a position are collected in a max-heap of k entries
+ * provided by the caller, so that queries do not allocate. On a grid the search
+ * visits rings of cells around the cell of the position, until no unvisited cell
+ * can hold an agent closer than the current k-th one. On a tree it repeats box
+ * queries of doubling size instead.
+ */
+
+typedef struct {
+	abl_float dist2;
+	size_t id;
+} spatial_neighbor;
+
+/* Stores the min(k, len) agents closest to p in heap, ordered by distance and then
+ * by index, and returns their number. The positions are passed like for
+ * spatial_grid_build(). */
+size_t spatial_grid_nearest(const spatial_grid *grid, float3 p, int k,
+		const void *pos, size_t len, size_t stride, bool is_3d, spatial_neighbor *heap);
+static inline size_t spatial_grid_nearest_float2(const spatial_grid *grid, float2 p, int k,
+		const void *pos, size_t len, size_t stride, spatial_neighbor *heap) {
+	return spatial_grid_nearest(
+		grid, float3_create(p.x, p.y, 0), k, pos, len, stride, false, heap);
+}
+static inline size_t spatial_grid_nearest_float3(const spatial_grid *grid, float3 p, int k,
+		const void *pos, size_t len, size_t stride, spatial_neighbor *heap) {
+	return spatial_grid_nearest(grid, p, k, pos, len, stride, true, heap);
+}
+/* Heap for the nearest() loop at the given nesting depth, with room for the
+ * min(k, len) closest agents. The buffer belongs to the calling thread and is
+ * reused by the next query at the same depth. */
+spatial_neighbor *spatial_nearest_heap(int depth, int k, size_t len);
+
+/*
+ * Agent links
+ *
+ * The links of an agent type are stored in compressed sparse row form: the
+ * agents linked from agent i are targets[start[i]] .. targets[start[i+1]-1].
+ * The pairs added by link() in main() are sorted into this form once the
+ * simulation starts. From then on the number of links of an agent is fixed,
+ * but rewire() may change their targets. Rewired targets are written to
+ * next_targets and committed after the step, so that all agents of the step
+ * see the links of the previous one.
+ */
+
+typedef struct {
+	size_t *start;
+	size_t *targets;
+	size_t *next_targets;
+	size_t len;
+	size_t num_links;
+	/* (from, to) pairs added by link() */
+	dyn_array pairs;
+} link_graph;
+
+void link_graph_add(link_graph *graph, int from, int to);
+/* len is the number of agents of the linked type */
+void link_graph_build(link_graph *graph, size_t len);
+/* Inside a parallel region this must be called by all threads of the team */
+void link_graph_commit(link_graph *graph);
+void link_graph_free(link_graph *graph);
+
+static inline void link_graph_rewire(link_graph *graph, size_t slot, int to) {
+	if (to < 0 || (size_t) to >= graph->len) {
+		fprintf(stderr, "rewire(): There is no agent with index %d\n", to);
+		exit(1);
+	}
+	graph->next_targets[slot] = to;
+}
+
+/*
+ * Agent messages
+ *
+ * Messages send() during a parallel step are staged per thread as
+ * (recipient, value) records. After the step, they are delivered with a
+ * parallel bucket sort by recipient: the records are first scattered into
+ * buckets of consecutive recipients, and every bucket is then sorted by a
+ * single thread. The messages of agent i end up in
+ * values[start[i]] .. values[start[i+1]-1]. A delivery replaces the messages
+ * of the previous one.
+ */
+
+typedef struct {
+	size_t *start;
+	void *values;
+	size_t value_size;
+	/* Size of a staged record, the value follows the recipient */
+	size_t record_size;
+	size_t len;
+	size_t num_messages;
+	size_t cap;
+	/* Staged records of each thread */
+	dyn_array *threads;
+	int num_threads;
+	/* Records in bucket order, and the offsets of each thread in each bucket */
+	char *tmp;
+	size_t *hist;
+	size_t num_buckets;
+} inbox;
+
+/* len is the number of agents of the receiving type */
+void inbox_init(inbox *box, size_t value_size, size_t len);
+void inbox_free(inbox *box);
+/* Returns place for the value of a message sent by the calling thread */
+void *inbox_place(inbox *box, size_t recipient);
+/* Inside a parallel region this must be called by all threads of the team */
+void inbox_deliver(inbox *box);
+
+static inline void inbox_send_bool(inbox *box, size_t recipient, bool value) {
+	*(bool *) inbox_place(box, recipient) = value;
+}
+static inline void inbox_send_int(inbox *box, size_t recipient, int value) {
+	*(int *) inbox_place(box, recipient) = value;
+}
+static inline void inbox_send_float(inbox *box, size_t recipient, abl_float value) {
+	*(abl_float *) inbox_place(box, recipient) = value;
+}
+static inline void inbox_send_float2(inbox *box, size_t recipient, float2 value) {
+	*(float2 *) inbox_place(box, recipient) = value;
+}
+static inline void inbox_send_float3(inbox *box, size_t recipient, float3 value) {
+	*(float3 *) inbox_place(box, recipient) = value;
+}
+
+/*
+ * Environment fields
+ *
+ * A field holds one value per unit cell of the environment. The cells are
+ * stored in tiles of FIELD_TILE x FIELD_TILE cells (per z layer), so that the
+ * cells around a position and the stencil of diffuse() are close in memory.
+ *
+ * Deposits are accumulated in separate buffers and only applied to the values
+ * by field_flush(), so that samples taken during a step do not depend on the
+ * order in which the agents deposit. deposit() adds to a cell, deposit_max()
+ * raises it to at least the given value.
+ *
+ * The amounts of deposit() are staged like messages to the cells, together
+ * with the index of the depositing agent. field_flush() adds them in agent
+ * order, so the sums do not depend on the number of threads.
+ */
+
+#define FIELD_TILE_BITS 3
+#define FIELD_TILE (1 << FIELD_TILE_BITS)
+
+typedef struct {
+	abl_float min[3];
+	int dims[3];
+	int tiles[2];
+	bool wrap;
+	bool is_3d;
+	size_t len;
+	abl_float *values;
+	/* Staged deposit() records, of type field_deposit */
+	inbox deposits;
+	abl_float *raised;
+	/* Output buffer of diffuse() */
+	abl_float *tmp;
+} field;
+
+typedef struct {
+	size_t agent;
+	abl_float amount;
+} field_deposit;
+
+void field_init(field *f, float3 min, float3 size, bool wrap, bool is_3d);
+/* Applies the pending deposits to the values. Inside a parallel region this must
+ * be called by all threads of the team. */
+void field_flush(field *f);
+/* Kernels for sequential steps. Called by a single thread of a parallel
+ * region, the other threads of the team help out. */
+void field_decay(field *f, abl_float rate);
+void field_diffuse(field *f, abl_float rate);
+/* Sets the agent whose deposits the calling thread makes. Deposits made outside
+ * of parallel steps keep the last agent of the thread, and are summed in the
+ * order in which they are made. */
+void field_begin_agent(size_t index);
+void field_add(field *f, size_t cell, abl_float amount);
+
+static inline size_t field_index(const field *f, int x, int y, int z) {
+	size_t tile = ((size_t) z * f->tiles[1] + (y >> FIELD_TILE_BITS)) * f->tiles[0]
+		+ (x >> FIELD_TILE_BITS);
+	return (tile << (2 * FIELD_TILE_BITS))
+		| ((y & (FIELD_TILE - 1)) << FIELD_TILE_BITS) | (x & (FIELD_TILE - 1));
+}
+
+/* Out-of-bounds positions are wrapped around or mapped to the border */
+static inline int field_coord(const field *f, int axis, abl_float v) {
+	abl_float c = floor(v - f->min[axis]);
+	if (!(c >= 0) || c >= f->dims[axis]) {
+		return spatial_grid_outside_coord(c, f->dims[axis], f->wrap);
+	}
+	return (int) c;
+}
+
+static inline size_t field_cell_float2(const field *f, float2 p) {
+	return field_index(f, field_coord(f, 0, p.x), field_coord(f, 1, p.y), 0);
+}
+static inline size_t field_cell_float3(const field *f, float3 p) {
+	return field_index(f, field_coord(f, 0, p.x), field_coord(f, 1, p.y),
+		field_coord(f, 2, p.z));
+}
+
+static inline abl_float field_sample_float2(const field *f, float2 p) {
+	return f->values[field_cell_float2(f, p)];
+}
+static inline abl_float field_sample_float3(const field *f, float3 p) {
+	return f->values[field_cell_float3(f, p)];
+}
+
+static inline void field_deposit_float2(field *f, float2 p, abl_float amount) {
+	field_add(f, field_cell_float2(f, p), amount);
+}
+static inline void field_deposit_float3(field *f, float3 p, abl_float amount) {
+	field_add(f, field_cell_float3(f, p), amount);
+}
+
+static inline void field_raise(abl_float *cell, abl_float value) {
+	abl_float cur;
+	__atomic_load(cell, &cur, __ATOMIC_RELAXED);
+	while (value > cur && !__atomic_compare_exchange(
+			cell, &cur, &value, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+static inline void field_deposit_max_float2(field *f, float2 p, abl_float value) {
+	field_raise(&f->raised[field_cell_float2(f, p)], value);
+}
+static inline void field_deposit_max_float3(field *f, float3 p, abl_float value) {
+	field_raise(&f->raised[field_cell_float3(f, p)], value);
+}
+
+/*
+ * Loop scheduling
+ *
+ * Steps may be scheduled with a work-stealing queue. Every thread starts on an
+ * equal share of the agents and takes chunks from its front. Threads that run
+ * out of work steal the back half of the remaining range of another thread.
+ */
+
+typedef struct work_queue work_queue;
+
+/* Chunk size for a loop over len agents. If the loop performs neighbor
+ * queries on grid, the chunk size is derived from the cell occupancy. */
+size_t schedule_chunk_size(const spatial_grid *grid, size_t len);
+
+work_queue *work_queue_create(void);
+/* Distributes [0, len) over the threads of the team. Must be called by a
+ * single thread, before the other threads start taking chunks. */
+void work_queue_reset(work_queue *queue, size_t len, size_t chunk_size);
+/* Returns the next chunk [*begin, *end) for the calling thread, or false
+ * if no work is left */
+bool work_queue_next(work_queue *queue, size_t *begin, size_t *end);
+void work_queue_free(work_queue *queue);
+
 /*
  * Random numbers
+ *
+ * Inside a parallel step every agent draws from its own counter-based stream,
+ * keyed on the step, the timestep and the agent index. The calls made by one
+ * agent are numbered in order, so results do not depend on the thread count.
  */
 
+/* Selects the stream of the given agent for the calling thread */
+void random_begin_agent(unsigned step, unsigned timestep, size_t index);
+/* Switches the calling thread back to the stream used by main() */
+void random_end_agents(void);
+/* Agent indices are local to an MPI rank, so each rank keys the agent streams
+ * differently. Rank 0 uses the same streams as a single process. */
+void random_set_rank(unsigned rank);
+
 abl_float random_float(abl_float min, abl_float max);
 int random_int(int min, int max);
 
@@ -202,16 +951,154 @@ typedef struct {
 	bool is_pos;
 } type_info;
 
+typedef enum {
+	LAYOUT_AOS,
+	LAYOUT_SOA,
+} agent_layout;
+
 typedef struct {
 	const type_info *info;
 	unsigned offset;
 	const char *name;
+	agent_layout layout;
 } agent_info;
 
+/*
+ * Struct-of-arrays agent storage
+ */
+
+/* Generic view of the generated <Agent>_soa structures, which
+ * store one array per member, in the order of the type_info entries */
+typedef struct {
+	size_t len;
+	size_t cap;
+	void *members[];
+} soa_array;
+
+/* Appends an uninitialized agent and returns its index */
+size_t soa_array_place(soa_array *ary, const type_info *info);
+/* Makes sure there is storage for len agents, and sets the length */
+void soa_array_ensure(soa_array *ary, const type_info *info, size_t len);
+void soa_array_clean(soa_array *ary, const type_info *info);
+
+/*
+ * Runtime agent addition and removal
+ */
+
+/* Agents added during a parallel step are staged per thread and appended
+ * afterwards in thread order, which for a static schedule is agent order */
+typedef struct {
+	dyn_array *threads;
+	int num_threads;
+} agent_staging;
+
+#define AGENT_STAGING_PLACE(staging, elem_type) \
+	((elem_type *) agent_staging_place(staging, sizeof(elem_type)))
+
+void agent_staging_init(agent_staging *staging);
+void agent_staging_free(agent_staging *staging);
+/* Returns place for an agent added by the calling thread */
+void *agent_staging_place(agent_staging *staging, size_t elem_size);
+/* Appends all staged agents to the agent array and empties the staging buffers */
+void agent_staging_flush(
+		agent_staging *staging, void *arr, const type_info *info, agent_layout layout);
+
+/* Copies the agents of src that are not flagged as removed to dst,
+ * preserving their order. Returns false without touching dst if no agent was
+ * removed. Inside a parallel region this must be called by all threads of the
+ * team, which all get the same result. */
+bool dyn_array_compact(
+		dyn_array *dst, const dyn_array *src, const bool *removed, size_t elem_size);
+bool soa_array_compact(
+		soa_array *dst, const soa_array *src, const bool *removed, const type_info *info);
+/* Stores the indices of the first n elements that are not flagged as skipped
+ * to dst, in ascending order, and returns their number. Used to iterate only
+ * over the agents a step applies to. Like dyn_array_compact(), this must be
+ * called by all threads of the team inside a parallel region. */
+size_t dyn_array_compact_indices(dyn_array *dst, const bool *skipped, size_t n);
+
+/*
+ * Spatial reordering
+ *
+ * Agent arrays may periodically be sorted into grid cell order, so that
+ * spatial neighbors are adjacent in memory. The creation order of the agents
+ * is tracked in a separate key array, and restored before output.
+ */
+
+typedef struct {
+	/* Creation number of every agent, in agent array order */
+	dyn_array keys;
+	dyn_array tmp;
+	size_t next;
+} agent_order;
+
+/* Numbers the len agents of an array in their current order */
+void agent_order_init(agent_order *order, size_t len);
+void agent_order_free(agent_order *order);
+/* Numbers the agents that were appended since the last call */
+void agent_order_extend(agent_order *order, size_t len);
+/* Drops the keys of removed agents. Like dyn_array_compact(), this must be
+ * called by all threads of the team inside a parallel region. */
+void agent_order_compact(agent_order *order, const bool *removed);
+/* Sorts the agents of arr into the cell order of grid, which must be valid.
+ * The agents are moved to tmp, which is then swapped with arr. The grid stays
+ * valid. Must be called by all threads of the team. */
+void agent_order_sort_cells(
+		agent_order *order, spatial_grid *grid, void *arr, void *tmp,
+		const type_info *info, agent_layout layout);
+/* Sorts the agents of arr back into creation order, using tmp like above.
+ * Must be called by a single thread. The grid has to be rebuilt afterwards. */
+void agent_order_restore(
+		agent_order *order, void *arr, void *tmp, const type_info *info, agent_layout layout);
+
+/*
+ * Timing and CSV logging
+ */
+
+/* Wall-clock time in seconds */
+double time_now(void);
+
+/* Lines are formatted into a large buffer, which is only written out when full */
+typedef struct {
+	FILE *file;
+	char *buf;
+	size_t len;
+	size_t cap;
+	bool line_start;
+} log_writer;
+
+void log_writer_open(log_writer *writer, const char *path);
+void log_writer_close(log_writer *writer);
+/* Append one column to the current line */
+void log_csv_int(log_writer *writer, int value);
+void log_csv_float(log_writer *writer, abl_float value);
+void log_csv_end(log_writer *writer);
+
 typedef enum {
 	SAVE_JSON,
 	SAVE_FLAME_XML,
 	SAVE_FLAMEGPU_XML,
+	SAVE_BINARY,
 } save_type;
 
+/* SAVE_JSON writes a binary snapshot instead if the path ends in ".bin" */
 void save(void *agents, const agent_info *info, const char *path, save_type type);
+/* Replaces all agents with the ones stored in a binary snapshot */
+void load(void *agents, const agent_info *info, const char *path);
+
+/*
+ * Periodic output
+ *
+ * The agents are copied into a snapshot, which a background thread saves
+ * while the simulation continues. A new snapshot waits for the previous
+ * one to be written.
+ */
+
+typedef struct async_writer async_writer;
+
+async_writer *async_writer_create(const agent_info *info, size_t agents_size);
+/* Saves the agents to path_fmt, where %d is replaced by the timestep and %%
+ * by % */
+void async_writer_save(async_writer *writer, const void *agents, const char *path_fmt, int timestep);
+/* Waits for pending output */
+void async_writer_free(async_writer *writer);
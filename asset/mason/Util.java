@@ -1,4 +1,6 @@
 import sim.util.*;
+import sim.field.grid.*;
+import sim.field.continuous.*;
 import ec.util.*;
 import java.util.*;
 import java.io.*;
@@ -13,6 +15,112 @@ public class Util {
     return min + rng.nextInt(max - min + 1);
   }
 
+	/* The k objects of class cls closest to pos, ordered by distance. The search
+	 * radius is doubled until it holds k of them, or all objects. */
+	public static Bag nearest(final Continuous2D env, final Double2D pos, int k, Class<?> cls) {
+		Bag bag = new Bag();
+		for (double radius = env.discretization; k > 0; radius *= 2) {
+			bag = env.getNeighborsExactlyWithinDistance(pos, radius);
+			boolean all = bag.size() == env.getAllObjects().size();
+			keepInstances(bag, cls);
+			if (bag.size() >= k || all) break;
+		}
+		bag.sort(new Comparator<Object>() {
+			public int compare(Object a, Object b) {
+				return Double.compare(env.getObjectLocation(a).distanceSq(pos),
+					env.getObjectLocation(b).distanceSq(pos));
+			}
+		});
+		bag.numObjs = Math.min(bag.numObjs, Math.max(k, 0));
+		return bag;
+	}
+
+	public static Bag nearest(final Continuous3D env, final Double3D pos, int k, Class<?> cls) {
+		Bag bag = new Bag();
+		for (double radius = env.discretization; k > 0; radius *= 2) {
+			bag = env.getNeighborsExactlyWithinDistance(pos, radius);
+			boolean all = bag.size() == env.getAllObjects().size();
+			keepInstances(bag, cls);
+			if (bag.size() >= k || all) break;
+		}
+		bag.sort(new Comparator<Object>() {
+			public int compare(Object a, Object b) {
+				return Double.compare(env.getObjectLocation(a).distanceSq(pos),
+					env.getObjectLocation(b).distanceSq(pos));
+			}
+		});
+		bag.numObjs = Math.min(bag.numObjs, Math.max(k, 0));
+		return bag;
+	}
+
+	private static void keepInstances(Bag bag, Class<?> cls) {
+		for (int i = bag.size() - 1; i >= 0; i--) {
+			if (!cls.isInstance(bag.get(i))) {
+				bag.remove(i);
+			}
+		}
+	}
+
+	/* Environment fields have one cell per unit of length, positions beyond the
+	 * border are mapped to the border cell */
+	private static int fieldCoord(double v, int n) {
+		int c = (int) Math.floor(v);
+		return c < 0 ? 0 : c >= n ? n - 1 : c;
+	}
+
+	public static double sampleField(DoubleGrid2D grid, Double2D pos, double minX, double minY) {
+		return grid.field[fieldCoord(pos.x - minX, grid.getWidth())]
+			[fieldCoord(pos.y - minY, grid.getHeight())];
+	}
+
+	public static void depositField(
+			DoubleGrid2D grid, Double2D pos, double minX, double minY, double amount) {
+		grid.field[fieldCoord(pos.x - minX, grid.getWidth())]
+			[fieldCoord(pos.y - minY, grid.getHeight())] += amount;
+	}
+
+	public static void depositMaxField(
+			DoubleGrid2D grid, Double2D pos, double minX, double minY, double value) {
+		double[] column = grid.field[fieldCoord(pos.x - minX, grid.getWidth())];
+		int y = fieldCoord(pos.y - minY, grid.getHeight());
+		column[y] = Math.max(column[y], value);
+	}
+
+	/* Applies the deposits of a step and resets the deposit grids */
+	public static void flushField(DoubleGrid2D grid, DoubleGrid2D pending, DoubleGrid2D raised) {
+		for (int x = 0; x < grid.getWidth(); x++) {
+			for (int y = 0; y < grid.getHeight(); y++) {
+				grid.field[x][y] = Math.max(grid.field[x][y] + pending.field[x][y], raised.field[x][y]);
+			}
+		}
+		pending.setTo(0.0);
+		raised.setTo(Double.NEGATIVE_INFINITY);
+	}
+
+	/* Each cell passes rate of its value on, evenly split among its neighbors.
+	 * Beyond the border the cell itself is used, so nothing diffuses out. */
+	public static void diffuseField(DoubleGrid2D grid, double rate) {
+		double[][] old = new DoubleGrid2D(grid).field;
+		int w = grid.getWidth();
+		int h = grid.getHeight();
+		for (int x = 0; x < w; x++) {
+			for (int y = 0; y < h; y++) {
+				double sum = old[x > 0 ? x - 1 : x][y] + old[x < w - 1 ? x + 1 : x][y]
+					+ old[x][y > 0 ? y - 1 : y] + old[x][y < h - 1 ? y + 1 : y];
+				grid.field[x][y] = old[x][y] + rate * (sum / 4 - old[x][y]);
+			}
+		}
+	}
+
+	/* Bin of value in a histogram with bins equally sized bins between lo and hi.
+	 * Values outside of the range are counted in the first or last bin. */
+	public static int histogramBin(double value, double lo, double hi, int bins) {
+		double bin = (value - lo) / (hi - lo) * bins;
+		if (!(bin >= 0)) return 0;
+		if (bin >= bins) return bins - 1;
+		return (int) bin;
+	}
+
 	private static void saveAgent(PrintWriter writer, Object agent, Class<?> cls)
 			throws IllegalAccessException {
 		writer.print("{");
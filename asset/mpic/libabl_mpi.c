@@ -0,0 +1,231 @@
+#include "libabl_mpi.h"
+#include <mpi.h>
+
+#ifdef LIBABL_USE_FLOAT
+#define MPI_ABL_FLOAT MPI_FLOAT
+#else
+#define MPI_ABL_FLOAT MPI_DOUBLE
+#endif
+
+static int mpi_rank = 0;
+
+void mpi_init(void) {
+	// Communication happens in omp single blocks, which may run on any thread
+	int provided;
+	MPI_Init_thread(NULL, NULL, MPI_THREAD_SERIALIZED, &provided);
+	if (provided < MPI_THREAD_SERIALIZED) {
+		fprintf(stderr, "The MPI implementation does not support MPI_THREAD_SERIALIZED\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+	random_set_rank(mpi_rank);
+	if (mpi_rank != 0) {
+		// print() output of the other ranks would duplicate the one of the root
+		if (!freopen("/dev/null", "w", stdout)) {
+			perror("freopen");
+		}
+	}
+}
+
+void mpi_finalize(void) {
+	MPI_Finalize();
+}
+
+bool mpi_is_root(void) {
+	return mpi_rank == 0;
+}
+
+void mpi_domain_init(mpi_domain *domain, abl_float min, abl_float size, abl_float halo) {
+	MPI_Comm_rank(MPI_COMM_WORLD, &domain->rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &domain->size);
+	domain->min = min;
+	domain->width = size / domain->size;
+	domain->halo = halo;
+}
+
+int mpi_domain_owner(const mpi_domain *domain, abl_float x) {
+	abl_float slab = floor((x - domain->min) / domain->width);
+	if (!(slab >= 0)) return 0;
+	if (slab >= domain->size) return domain->size - 1;
+	return (int) slab;
+}
+
+static inline abl_float agent_x(
+		const dyn_array *agents, size_t elem_size, size_t pos_offset, size_t i) {
+	return *(const abl_float *) ((const char *) agents->values + elem_size * i + pos_offset);
+}
+
+void mpi_keep_owned(const mpi_domain *domain, dyn_array *agents, size_t elem_size, size_t pos_offset) {
+	size_t kept = 0;
+	for (size_t i = 0; i < agents->len; i++) {
+		if (mpi_domain_owner(domain, agent_x(agents, elem_size, pos_offset, i)) == domain->rank) {
+			char *values = agents->values;
+			memmove(values + elem_size * kept++, values + elem_size * i, elem_size);
+		}
+	}
+	agents->len = kept;
+}
+
+/* Sends agent i to the ranks [*first, *last], excluding the own rank.
+ * Returns whether the agent stays on this rank. */
+static bool agent_destinations(
+		const mpi_domain *domain, abl_float x, bool halo, int *first, int *last) {
+	if (halo) {
+		*first = mpi_domain_owner(domain, x - domain->halo);
+		*last = mpi_domain_owner(domain, x + domain->halo);
+		return true;
+	}
+
+	*first = *last = mpi_domain_owner(domain, x);
+	return *first == domain->rank;
+}
+
+/* Sends agents to other ranks, and appends the received ones in rank order.
+ * Returns the number of received agents. */
+static size_t exchange_agents(
+		const mpi_domain *domain, dyn_array *agents, size_t elem_size, size_t pos_offset,
+		bool halo) {
+	int n = domain->size;
+	int *send_counts = calloc(n, sizeof(int));
+	int *send_displs = calloc(n, sizeof(int));
+	int *recv_counts = calloc(n, sizeof(int));
+	int *recv_displs = calloc(n, sizeof(int));
+	int first, last;
+
+	for (size_t i = 0; i < agents->len; i++) {
+		abl_float x = agent_x(agents, elem_size, pos_offset, i);
+		agent_destinations(domain, x, halo, &first, &last);
+		for (int q = first; q <= last; q++) {
+			send_counts[q] += q != domain->rank;
+		}
+	}
+
+	int num_send = 0;
+	for (int q = 0; q < n; q++) {
+		send_displs[q] = num_send;
+		num_send += send_counts[q];
+	}
+
+	// Copy outgoing agents into the send buffer. Migrated agents are removed
+	// by compacting the remaining ones in place.
+	char *send_buf = malloc(elem_size * (num_send ? num_send : 1));
+	int *cursor = calloc(n, sizeof(int));
+	char *values = agents->values;
+	size_t kept = 0;
+	for (size_t i = 0; i < agents->len; i++) {
+		abl_float x = agent_x(agents, elem_size, pos_offset, i);
+		bool stays = agent_destinations(domain, x, halo, &first, &last);
+		for (int q = first; q <= last; q++) {
+			if (q != domain->rank) {
+				memcpy(send_buf + elem_size * (send_displs[q] + cursor[q]++),
+					values + elem_size * i, elem_size);
+			}
+		}
+		if (stays) {
+			memmove(values + elem_size * kept++, values + elem_size * i, elem_size);
+		}
+	}
+	agents->len = kept;
+
+	MPI_Alltoall(send_counts, 1, MPI_INT, recv_counts, 1, MPI_INT, MPI_COMM_WORLD);
+	int num_recv = 0;
+	for (int q = 0; q < n; q++) {
+		recv_displs[q] = num_recv;
+		num_recv += recv_counts[q];
+	}
+
+	MPI_Datatype agent_type;
+	MPI_Type_contiguous((int) elem_size, MPI_BYTE, &agent_type);
+	MPI_Type_commit(&agent_type);
+
+	size_t start = agents->len;
+	dyn_array_ensure(agents, elem_size, start + num_recv);
+	MPI_Alltoallv(send_buf, send_counts, send_displs, agent_type,
+		(char *) agents->values + elem_size * start, recv_counts, recv_displs, agent_type,
+		MPI_COMM_WORLD);
+
+	MPI_Type_free(&agent_type);
+	free(send_buf);
+	free(cursor);
+	free(send_counts);
+	free(send_displs);
+	free(recv_counts);
+	free(recv_displs);
+	return num_recv;
+}
+
+void mpi_migrate(const mpi_domain *domain, dyn_array *agents, size_t elem_size, size_t pos_offset) {
+	exchange_agents(domain, agents, elem_size, pos_offset, false);
+}
+
+size_t mpi_exchange_halo(
+		const mpi_domain *domain, dyn_array *agents, size_t elem_size, size_t pos_offset) {
+	return exchange_agents(domain, agents, elem_size, pos_offset, true);
+}
+
+void mpi_gather(const mpi_domain *domain, dyn_array *agents, size_t elem_size) {
+	int len = (int) agents->len;
+	int *counts = NULL, *displs = NULL;
+	int total = 0;
+	if (domain->rank == 0) {
+		counts = calloc(domain->size, sizeof(int));
+		displs = calloc(domain->size, sizeof(int));
+	}
+	MPI_Gather(&len, 1, MPI_INT, counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+	MPI_Datatype agent_type;
+	MPI_Type_contiguous((int) elem_size, MPI_BYTE, &agent_type);
+	MPI_Type_commit(&agent_type);
+
+	if (domain->rank == 0) {
+		for (int q = 0; q < domain->size; q++) {
+			displs[q] = total;
+			total += counts[q];
+		}
+		// The agents of the root are already in place
+		dyn_array_ensure(agents, elem_size, total);
+		MPI_Gatherv(MPI_IN_PLACE, len, agent_type, agents->values, counts, displs, agent_type,
+			0, MPI_COMM_WORLD);
+		free(counts);
+		free(displs);
+	} else {
+		MPI_Gatherv(agents->values, len, agent_type, NULL, NULL, NULL, agent_type,
+			0, MPI_COMM_WORLD);
+		agents->len = 0;
+	}
+
+	MPI_Type_free(&agent_type);
+}
+
+void mpi_sum_int(int *value) {
+	MPI_Allreduce(MPI_IN_PLACE, value, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+}
+
+void mpi_sum_float(abl_float *value) {
+	MPI_Allreduce(MPI_IN_PLACE, value, 1, MPI_ABL_FLOAT, MPI_SUM, MPI_COMM_WORLD);
+}
+
+void mpi_sum_int_array(int *values, int len) {
+	MPI_Allreduce(MPI_IN_PLACE, values, len, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+}
+
+void mpi_min_int(int *value) {
+	MPI_Allreduce(MPI_IN_PLACE, value, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+}
+
+void mpi_min_float(abl_float *value) {
+	MPI_Allreduce(MPI_IN_PLACE, value, 1, MPI_ABL_FLOAT, MPI_MIN, MPI_COMM_WORLD);
+}
+
+void mpi_max_int(int *value) {
+	MPI_Allreduce(MPI_IN_PLACE, value, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+}
+
+void mpi_max_float(abl_float *value) {
+	MPI_Allreduce(MPI_IN_PLACE, value, 1, MPI_ABL_FLOAT, MPI_MAX, MPI_COMM_WORLD);
+}
+
+const char *mpi_output_path(const char *path) {
+	return mpi_rank == 0 ? path : "/dev/null";
+}
@@ -0,0 +1,54 @@
+#include "libabl.h"
+
+/*
+ * Domain decomposition
+ *
+ * The environment is split into slabs of equal width along the x axis, one
+ * per rank. Outside of simulate() every rank holds all agents. Inside of it
+ * each rank only holds the agents whose position lies in its slab, agents
+ * outside of the environment belong to the border slabs.
+ */
+
+typedef struct {
+	int rank;
+	int size;
+	abl_float min;
+	abl_float width;
+	/* Width of the halo region, the largest near() radius */
+	abl_float halo;
+} mpi_domain;
+
+void mpi_init(void);
+void mpi_finalize(void);
+bool mpi_is_root(void);
+
+void mpi_domain_init(mpi_domain *domain, abl_float min, abl_float size, abl_float halo);
+int mpi_domain_owner(const mpi_domain *domain, abl_float x);
+
+/* The functions below operate on arrays of AoS agents, where the x coordinate
+ * of an agent is stored pos_offset bytes from its start. */
+
+/* Drops all agents that do not belong to this rank */
+void mpi_keep_owned(const mpi_domain *domain, dyn_array *agents, size_t elem_size, size_t pos_offset);
+/* Sends agents that left the slab of this rank to their new owners */
+void mpi_migrate(const mpi_domain *domain, dyn_array *agents, size_t elem_size, size_t pos_offset);
+/* Appends copies of all agents of other ranks that lie within the halo of
+ * this slab, and returns their number */
+size_t mpi_exchange_halo(
+		const mpi_domain *domain, dyn_array *agents, size_t elem_size, size_t pos_offset);
+/* Moves all agents to the root rank */
+void mpi_gather(const mpi_domain *domain, dyn_array *agents, size_t elem_size);
+
+/* Sums a value over all ranks */
+void mpi_sum_int(int *value);
+void mpi_sum_float(abl_float *value);
+/* Sums len values element-wise over all ranks */
+void mpi_sum_int_array(int *values, int len);
+/* Minimum and maximum of a value over all ranks */
+void mpi_min_int(int *value);
+void mpi_min_float(abl_float *value);
+void mpi_max_int(int *value);
+void mpi_max_float(abl_float *value);
+
+/* Only the root rank writes output, the other ranks write to /dev/null */
+const char *mpi_output_path(const char *path);
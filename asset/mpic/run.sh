@@ -0,0 +1 @@
+mpirun -np ${OPENABL_MPI_PROCS:-4} ./main
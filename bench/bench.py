@@ -28,7 +28,7 @@ default_models = [
 ]
 
 default_agent_ranges = {
-    'c': (250, 32000),
+    'c': (250, 1024000),
     'mason': (250, 128000),
     'mason2': (250, 128000),
     'dmason': (250, 128000),
@@ -46,7 +46,7 @@ Default models:
     * predator_prey
 
 Default agent ranges:
-    * c:        250-32000
+    * c:        250-1024000
     * mason:    250-128000
     * mason2:   250-128000
     * flame:    250-4000
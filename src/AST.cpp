@@ -189,6 +189,15 @@ void ForStatement::accept(Visitor &visitor) {
 void SimulateStatement::accept(Visitor &visitor) {
   visitor.enter(*this);
   VISIT_EXPR(timestepsExpr);
+  for (SimulateStep &step : *steps) {
+    if (step.intervalExpr) {
+      VISIT_EXPR(step.intervalExpr);
+    }
+  }
+  if (outputExpr) {
+    VISIT_EXPR(outputIntervalExpr);
+    VISIT_EXPR(outputExpr);
+  }
   visitor.leave(*this);
 }
 
@@ -267,6 +276,13 @@ void EnvironmentDeclaration::accept(Visitor &visitor) {
   visitor.leave(*this);
 }
 
+void FieldDeclaration::accept(Visitor &visitor) {
+  visitor.enter(*this);
+  type->accept(visitor);
+  var->accept(visitor);
+  visitor.leave(*this);
+}
+
 void Script::accept(Visitor &visitor) {
   visitor.enter(*this);
   for (DeclarationPtr &decl : *decls) {
@@ -308,6 +324,7 @@ void AgentMember::print(Printer &printer) const { printer.print(*this); }
 void AgentDeclaration::print(Printer &printer) const { printer.print(*this); }
 void ConstDeclaration::print(Printer &printer) const { printer.print(*this); }
 void EnvironmentDeclaration::print(Printer &printer) const { printer.print(*this); }
+void FieldDeclaration::print(Printer &printer) const { printer.print(*this); }
 void Script::print(Printer &printer) const { printer.print(*this); }
 
 }
@@ -399,6 +399,9 @@ struct ForStatement : public Statement {
     NORMAL, // For loop over an array          for (Agent agent : agents)
     RANGE,  // For loop over an integer range  for (int t : 0 .. t_max)
     NEAR,   // For loop over nearby agents     for (Agent nx : near(agent, radius))
+    NEAREST,// For loop over the closest agents for (Agent nx : nearest(agent, k))
+    LINKS,  // For loop over linked agents     for (Agent nx : links(in))
+    INBOX,  // For loop over received messages for (float msg : inbox(in))
   };
 
   TypePtr type;
@@ -408,6 +411,8 @@ struct ForStatement : public Statement {
 
   // Populated during analysis
   Kind kind;
+  // Radius of a for-near loop, invalid if it is not known at compile time
+  Value nearRadius;
 
   ForStatement(Type *type, Var *var, Expression *expr, Statement *stmt, Location loc)
     : Statement{loc}, type{type}, var{var}, expr{expr}, stmt{stmt}, kind{Kind::NORMAL} {}
@@ -423,27 +428,74 @@ struct ForStatement : public Statement {
   }
 
   bool isNear() const { return kind == Kind::NEAR; }
+  bool isNearest() const { return kind == Kind::NEAREST; }
+  bool isLinks() const { return kind == Kind::LINKS; }
   CallExpression &getNearCall() const {
-    assert(isNear());
+    assert(isNear() || isNearest() || isLinks());
     return *dynamic_cast<CallExpression *>(&*expr);
   }
   const Expression &getNearAgent() const { return getNearCall().getArg(0); }
-  const Expression &getNearRadius() const { return getNearCall().getArg(1); }
+  const Expression &getNearRadius() const {
+    assert(isNear());
+    return getNearCall().getArg(1);
+  }
+  const Expression &getNearestCount() const {
+    assert(isNearest());
+    return getNearCall().getArg(1);
+  }
+  const Expression &getLinksAgent() const {
+    assert(isLinks());
+    return getNearCall().getArg(0);
+  }
+
+  bool isInbox() const { return kind == Kind::INBOX; }
+  const Expression &getInboxAgent() const {
+    assert(isInbox());
+    return dynamic_cast<CallExpression *>(&*expr)->getArg(0);
+  }
+};
+
+// Step function of a simulate statement, as in "evaporate every 10"
+struct SimulateStep {
+  std::string name;
+  // Step runs only in timesteps that are a multiple of the interval. May be null.
+  ExpressionPtr intervalExpr;
+  Location loc;
+
+  SimulateStep(std::string name, Expression *intervalExpr, Location loc)
+    : name{name}, intervalExpr{intervalExpr}, loc{loc} {}
 };
 
-using IdentList = std::vector<std::string>;
-using IdentListPtr = std::unique_ptr<IdentList>;
+using SimulateStepList = std::vector<SimulateStep>;
+using SimulateStepListPtr = std::unique_ptr<SimulateStepList>;
 
 struct SimulateStatement : public Statement {
   ExpressionPtr timestepsExpr;
-  IdentListPtr stepFuncs;
+  SimulateStepListPtr steps;
+  // Periodic output, as in "every 10 save(...)". May be null.
+  ExpressionPtr outputIntervalExpr;
+  ExpressionPtr outputExpr;
 
   // Populated during analysis
   std::vector<FunctionDeclaration *> stepFuncDecls;
   FunctionDeclaration *seqStepDecl = nullptr;
-
-  SimulateStatement(Expression *timestepsExpr, IdentList *stepFuncs, Location loc)
-    : Statement{loc}, timestepsExpr{timestepsExpr}, stepFuncs{stepFuncs} {}
+  // Aligned with stepFuncDecls, null entries run in every timestep
+  std::vector<const Expression *> stepIntervalExprs;
+  const Expression *seqStepIntervalExpr = nullptr;
+
+  SimulateStatement(Expression *timestepsExpr, SimulateStepList *steps,
+                    Expression *outputIntervalExpr, Expression *outputExpr, Location loc)
+    : Statement{loc}, timestepsExpr{timestepsExpr}, steps{steps},
+      outputIntervalExpr{outputIntervalExpr}, outputExpr{outputExpr} {}
+
+  bool hasStepIntervals() const {
+    for (const SimulateStep &step : *steps) {
+      if (step.intervalExpr) {
+        return true;
+      }
+    }
+    return false;
+  }
 
   void accept(Visitor &);
   void print(Printer &) const;
@@ -542,6 +594,21 @@ struct FunctionDeclaration : public Declaration {
   const AgentDeclaration *runtimeAddedAgent = nullptr;
   // FlameGPU needs to know whether an RNG is used
   bool usesRng = false;
+  // The count() and sum() calls in a step function. In parallel steps they are
+  // evaluated on the state at the start of the timestep
+  std::vector<CallExpression *> reductionCalls;
+  // Environment fields deposit()ed into, directly or through called functions
+  std::set<std::string> depositedFields;
+  // Whether the step function has a for-links loop, or rewire()s links
+  bool usesLinks = false;
+  bool rewiresLinks = false;
+  // (Recipient, message type) of the messages send() in this step function
+  std::vector<std::pair<const AgentDeclaration *, OpenABL::Type>> sentMessages;
+  // Whether the step function has a for-inbox loop
+  bool usesInbox = false;
+  // Condition of a step function whose body is a single if statement without
+  // else. Agents for which it is false are left unchanged by the step.
+  const Expression *activeGuard = nullptr;
 
   FunctionDeclaration(Type *returnType, std::string name,
                       ParamList *params, StatementList *stmts, Kind kind, Location loc)
@@ -620,6 +687,10 @@ struct AgentDeclaration : public Declaration {
   AgentMemberListPtr members;
 
   bool usesRuntimeRemoval = false;
+  // Whether agents of this type are link()ed, which refers to them by index
+  bool hasLinks = false;
+  // Types of the messages read from the inbox of this agent type
+  std::vector<OpenABL::Type> inboxTypes;
 
   AgentDeclaration(std::string name, AgentMemberList *members, Location loc)
     : Declaration{loc}, name{name}, members{members} {}
@@ -659,7 +730,15 @@ struct EnvironmentDeclaration : public Declaration {
   Value envMax;
   Value envSize;
   Value envGranularity;
+  // Opposite borders are connected (wrap: true)
+  bool envWrap = false;
+  // Agents sit on a lattice of unit cells, at most one per cell (lattice: true).
+  // near() then matches agents by cell, which is the same as a radius search
+  // as long as they sit at the cell centers.
+  bool envLattice = false;
   int envDimension = -1;
+  // Largest near() radius, invalid if some radius is not known at compile time
+  Value maxNearRadius;
 
   EnvironmentDeclaration(MemberInitList *members, Location loc)
     : Declaration{loc}, members{members} {}
@@ -675,6 +754,19 @@ struct EnvironmentDeclaration : public Declaration {
   void print(Printer &) const;
 };
 
+/* Scalar field on the environment, as in "environment float food;". It holds
+ * one value per unit cell and is accessed through environment.food */
+struct FieldDeclaration : public Declaration {
+  TypePtr type;
+  VarPtr var;
+
+  FieldDeclaration(Type *type, Var *var, Location loc)
+    : Declaration{loc}, type{type}, var{var} {}
+
+  void accept(Visitor &);
+  void print(Printer &) const;
+};
+
 /* AST root node */
 struct Script : public Node {
   DeclarationListPtr decls;
@@ -684,6 +776,7 @@ struct Script : public Node {
   std::vector<AgentDeclaration *> agents;
   std::vector<ConstDeclaration *> consts;
   std::vector<FunctionDeclaration *> funcs;
+  std::vector<FieldDeclaration *> fields;
   std::unordered_set<ReductionInfo> reductions;
   std::set<std::string> params;
   SimulateStatement *simStmt = nullptr;
@@ -693,7 +786,14 @@ struct Script : public Node {
   bool usesRuntimeAddition = false;
   bool usesLogging = false;
   bool usesTiming = false;
+  bool usesSave = false;
+  bool usesLoad = false;
   bool usesRuntimeAdditionAtDifferentPos = false;
+  bool usesNearest = false;
+  bool usesLinks = false;
+  bool usesMessages = false;
+  // count(), sum() or getLastExecTime() used in a parallel step
+  bool usesParallelReductions = false;
 
   Script(DeclarationList *decls, Location loc)
     : Node{loc}, decls{decls} {}
@@ -53,6 +53,7 @@ struct Visitor {
   virtual void enter(AgentDeclaration &) {};
   virtual void enter(ConstDeclaration &) {};
   virtual void enter(EnvironmentDeclaration &) {};
+  virtual void enter(FieldDeclaration &) {};
   virtual void enter(Script &) {};
 
   virtual void leave(Var &) {};
@@ -88,6 +89,7 @@ struct Visitor {
   virtual void leave(AgentDeclaration &) {};
   virtual void leave(ConstDeclaration &) {};
   virtual void leave(EnvironmentDeclaration &) {};
+  virtual void leave(FieldDeclaration &) {};
   virtual void leave(Script &) {};
 
   void replaceExpr(Expression *expr) {
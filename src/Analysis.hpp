@@ -197,6 +197,10 @@ enum class ReductionKind {
   COUNT_TYPE,
   COUNT_MEMBER,
   SUM_MEMBER,
+  MIN_MEMBER,
+  MAX_MEMBER,
+  MEAN_MEMBER,
+  HISTOGRAM_MEMBER,
 };
 
 using ReductionInfo = std::pair<ReductionKind, Type>;
@@ -12,6 +12,8 @@
  * See the License for the specific language governing permissions and
  * limitations under the License. */
 
+#include <algorithm>
+#include <cmath>
 #include "AnalysisVisitor.hpp"
 #include "ErrorHandling.hpp"
 
@@ -138,6 +140,7 @@ void AnalysisVisitor::enter(AST::VarExpression &) {}
 void AnalysisVisitor::enter(AST::VarDeclarationStatement &) {}
 void AnalysisVisitor::enter(AST::Param &) {}
 void AnalysisVisitor::enter(AST::EnvironmentDeclaration &) {}
+void AnalysisVisitor::enter(AST::FieldDeclaration &) {}
 void AnalysisVisitor::leave(AST::Var &) {}
 void AnalysisVisitor::leave(AST::MemberInitEntry &) {}
 void AnalysisVisitor::leave(AST::ArrayInitExpression &) {}
@@ -236,11 +239,60 @@ void AnalysisVisitor::enter(AST::FunctionDeclaration &decl) {
     script.mainFunc = &decl;
   }
 };
+
+// Checks that a condition only reads the input agent and globals, so it can be
+// evaluated ahead of the step function
+struct GuardChecker : public AST::Visitor {
+  GuardChecker(const Scope &scope, VarId inId) : scope(scope), inId(inId) {}
+
+  void enter(AST::VarExpression &expr) {
+    VarId id = expr.var->id;
+    if (id != inId && !scope.get(id).isGlobal) {
+      valid = false;
+    }
+  }
+  void enter(AST::CallExpression &expr) {
+    bool usesRng = expr.calledFunc
+      ? expr.calledFunc->usesRng
+      : expr.name == "random" || expr.name == "randomInt";
+    if (usesRng) {
+      valid = false;
+    }
+  }
+
+  const Scope &scope;
+  VarId inId;
+  bool valid = true;
+};
+
+// Returns the condition of a step function that consists of a single if
+// statement, as agents for which it is false are left unchanged
+static const AST::Expression *getActiveGuard(
+    const Scope &scope, const AST::FunctionDeclaration &decl) {
+  if (decl.stmts->size() != 1) {
+    return nullptr;
+  }
+
+  auto *ifStmt = dynamic_cast<const AST::IfStatement *>(&*(*decl.stmts)[0]);
+  if (!ifStmt || ifStmt->elseStmt) {
+    return nullptr;
+  }
+
+  GuardChecker checker(scope, decl.stepParam().var->id);
+  ifStmt->condExpr->accept(checker);
+  return checker.valid ? &*ifStmt->condExpr : nullptr;
+}
+
 void AnalysisVisitor::leave(AST::FunctionDeclaration &decl) {
   popVarScope();
 
   if (decl.isParallelStep() && !isValidStepFunctionSignature(decl)) {
     err << "Step function " << decl.name << " does not have a valid signature" << decl.loc;
+    return;
+  }
+
+  if (decl.isParallelStep()) {
+    decl.activeGuard = getActiveGuard(scope, decl);
   }
 };
 void AnalysisVisitor::enter(AST::BlockStatement &) {
@@ -504,6 +556,18 @@ void AnalysisVisitor::leave(AST::EnvironmentDeclaration &decl) {
         return;
       }
       decl.envGranularity = v;
+    } else if (member->name == "wrap") {
+      if (!expr.type.isBool()) {
+        err << "Environment wrap must be a boolean" << expr.loc;
+        return;
+      }
+      decl.envWrap = v.getBool();
+    } else if (member->name == "lattice") {
+      if (!expr.type.isBool()) {
+        err << "Environment lattice must be a boolean" << expr.loc;
+        return;
+      }
+      decl.envLattice = v.getBool();
     } else {
       err << "Unknown environment member \"" << member->name << "\"" << member->loc;
       return;
@@ -537,9 +601,58 @@ void AnalysisVisitor::leave(AST::EnvironmentDeclaration &decl) {
     }
   }
 
+  if (decl.envWrap && decl.envMax.isInvalid()) {
+    err << "Environment wrap requires a max bound" << decl.loc;
+    return;
+  }
+
+  if (decl.envLattice) {
+    if (decl.envMax.isInvalid()) {
+      err << "Environment lattice requires a max bound" << decl.loc;
+      return;
+    }
+    for (double coord : decl.envSize.getVec()) {
+      if (coord < 1 || coord != std::floor(coord)) {
+        err << "Lattice environment size must be a whole number of cells" << decl.loc;
+        return;
+      }
+    }
+  }
+
   script.envDecl = &decl;
 };
 
+static AST::FieldDeclaration *findField(const AST::Script &script, const std::string &name) {
+  for (AST::FieldDeclaration *field : script.fields) {
+    if (field->var->name == name) {
+      return field;
+    }
+  }
+  return nullptr;
+}
+
+void AnalysisVisitor::leave(AST::FieldDeclaration &decl) {
+  if (!script.envDecl || script.envDecl->envMax.isInvalid()) {
+    err << "Environment fields require a preceding environment with a max bound" << decl.loc;
+    return;
+  }
+
+  Type type = decl.type->resolved;
+  SKIP_INVALID(type);
+  if (!type.isFloat()) {
+    err << "Environment field must be of type float, " << type << " given" << decl.type->loc;
+    return;
+  }
+
+  const std::string &name = decl.var->name;
+  if (name == "min" || name == "max" || findField(script, name)) {
+    err << "Redeclaration of environment member \"" << name << "\"" << decl.var->loc;
+    return;
+  }
+
+  script.fields.push_back(&decl);
+};
+
 void AnalysisVisitor::leave(AST::VarDeclarationStatement &decl) {
   declareVar(*decl.var, decl.type->resolved, false, false, {});
   if (!decl.initializer) {
@@ -578,9 +691,28 @@ void AnalysisVisitor::enter(AST::ForStatement &stmt) {
 
   // Handle for-near loops early, as we want to collect member accesses
   if (AST::CallExpression *call = dynamic_cast<AST::CallExpression *>(&*stmt.expr)) {
-    if (call->name == "near") {
+    if (call->name == "links") {
+      if (!declType.isAgent()) {
+        err << "Type specified in for-links loop is not an agent" << stmt.type->loc;
+        return;
+      }
+
+      stmt.kind = AST::ForStatement::Kind::LINKS;
+      linksLoopVars.insert(stmt.var->id);
+      neighborLoopVars.insert(stmt.var->id);
+      return;
+    }
+
+    if (call->name == "inbox") {
+      // The message type is given by the loop variable, checked in leave()
+      stmt.kind = AST::ForStatement::Kind::INBOX;
+      return;
+    }
+
+    if (call->name == "near" || call->name == "nearest") {
       if (!declType.isAgent()) {
-        err << "Type specified in for-near loop is not an agent" << stmt.type->loc;
+        err << "Type specified in for-" << call->name << " loop is not an agent"
+            << stmt.type->loc;
         return;
       }
 
@@ -592,12 +724,19 @@ void AnalysisVisitor::enter(AST::ForStatement &stmt) {
 
       AST::AgentDeclaration *agent = declType.getAgentDecl();
       if (!agent->getPositionMember()) {
-        err << "Cannot use for-near loop on agent without position member" << stmt.loc;
+        err << "Cannot use for-" << call->name << " loop on agent without position member"
+            << stmt.loc;
         return;
       }
 
       currentFunc->accessedAgent = agent;
-      stmt.kind = AST::ForStatement::Kind::NEAR;
+      if (call->name == "nearest") {
+        stmt.kind = AST::ForStatement::Kind::NEAREST;
+        script.usesNearest = true;
+      } else {
+        stmt.kind = AST::ForStatement::Kind::NEAR;
+      }
+      neighborLoopVars.insert(stmt.var->id);
 
       // Collect member accesses on this variable
       collectAccessVar = stmt.var->id;
@@ -608,6 +747,64 @@ void AnalysisVisitor::enter(AST::ForStatement &stmt) {
 void AnalysisVisitor::leave(AST::ForStatement &stmt) {
   loopNestingLevel--;
   popVarScope();
+  neighborLoopVars.erase(stmt.var->id);
+
+  if (stmt.isInbox()) {
+    // Like links, messages are stored per agent
+    const auto *varExpr = dynamic_cast<const AST::VarExpression *>(&stmt.getInboxAgent());
+    if (!currentFunc->isParallelStep() || !varExpr
+        || varExpr->var->id != (*currentFunc->params)[0]->var->id) {
+      err << "inbox() can only be used on the agent of the current step function"
+          << stmt.expr->loc;
+      return;
+    }
+
+    Type msgType = stmt.type->resolved;
+    if (!msgType.isBool() && !msgType.isNumOrVec()) {
+      err << "Type specified in for-inbox loop must be bool, int, float, float2 or float3"
+          << stmt.type->loc;
+      return;
+    }
+
+    std::vector<Type> &inboxTypes = currentFunc->stepAgent().inboxTypes;
+    if (std::find(inboxTypes.begin(), inboxTypes.end(), msgType) == inboxTypes.end()) {
+      inboxTypes.push_back(msgType);
+    }
+    currentFunc->usesInbox = true;
+    script.usesMessages = true;
+    return;
+  }
+
+  if (stmt.isLinks()) {
+    linksLoopVars.erase(stmt.var->id);
+
+    // Links are stored per agent, so only those of the current agent are at hand
+    const auto *varExpr = dynamic_cast<const AST::VarExpression *>(&stmt.getLinksAgent());
+    if (!currentFunc->isParallelStep() || !varExpr
+        || varExpr->var->id != (*currentFunc->params)[0]->var->id) {
+      err << "links() can only be used on the agent of the current step function"
+          << stmt.expr->loc;
+      return;
+    }
+
+    AST::AgentDeclaration &agent = currentFunc->stepAgent();
+    if (stmt.type->resolved.getAgentDecl() != &agent) {
+      err << "Type specified in for-links loop must be the type of the linked agent"
+          << stmt.type->loc;
+      return;
+    }
+
+    agent.hasLinks = true;
+    currentFunc->usesLinks = true;
+    script.usesLinks = true;
+    return;
+  }
+
+  if (stmt.isNearest()) {
+    // Nearest loops have no radius
+    collectAccessVar.reset();
+    return;
+  }
 
   if (stmt.isNear()) {
     // Disable member collection
@@ -616,7 +813,8 @@ void AnalysisVisitor::leave(AST::ForStatement &stmt) {
     // Collect radius
     AST::CallExpression *call = dynamic_cast<AST::CallExpression *>(&*stmt.expr);
     assert(call);
-    radiuses.push_back(evalExpression(call->getArg(1)));
+    stmt.nearRadius = evalExpression(call->getArg(1));
+    radiuses.push_back(stmt.nearRadius);
     return;
   }
 
@@ -679,19 +877,56 @@ void AnalysisVisitor::leave(AST::SimulateStatement &stmt) {
     return;
   }
 
-  for (const std::string &name : *stmt.stepFuncs) {
+  if (stmt.outputExpr) {
+    if (!stmt.outputIntervalExpr->type.isInt()) {
+      err << "Output interval must be an integer, "
+          << stmt.outputIntervalExpr->type << " given" << stmt.outputIntervalExpr->loc;
+      return;
+    }
+
+    Value interval = evalExpression(*stmt.outputIntervalExpr);
+    if (!interval.isInvalid() && interval.getInt() <= 0) {
+      err << "Output interval must be positive" << stmt.outputIntervalExpr->loc;
+      return;
+    }
+
+    auto *call = dynamic_cast<const AST::CallExpression *>(&*stmt.outputExpr);
+    if (!call || call->name != "save") {
+      err << "Only save() can be used as periodic output of a simulation"
+          << stmt.outputExpr->loc;
+      return;
+    }
+  }
+
+  for (const AST::SimulateStep &step : *stmt.steps) {
+    const std::string &name = step.name;
     auto it = funcDecls.find(name);
     if (it == funcDecls.end()) {
-      err << "Unknown step function \"" << name << "\"" << stmt.loc;
+      err << "Unknown step function \"" << name << "\"" << step.loc;
       return;
     }
 
     AST::FunctionDeclaration &fn = *it->second;
     if (!fn.isAnyStep()) {
-      err << "Function \"" << name << "\" is not a step function" << stmt.loc;
+      err << "Function \"" << name << "\" is not a step function" << step.loc;
       return;
     }
 
+    const AST::Expression *intervalExpr = step.intervalExpr.get();
+    if (intervalExpr) {
+      if (!intervalExpr->type.isInt()) {
+        err << "Step interval must be an integer, "
+            << intervalExpr->type << " given" << intervalExpr->loc;
+        return;
+      }
+
+      Value interval = evalExpression(*intervalExpr);
+      if (!interval.isInvalid() && interval.getInt() <= 0) {
+        err << "Step interval must be positive" << intervalExpr->loc;
+        return;
+      }
+    }
+
     if (fn.isSequentialStep()) {
       if (stmt.seqStepDecl) {
         err << "Can only use single sequential step function" << stmt.loc;
@@ -699,6 +934,7 @@ void AnalysisVisitor::leave(AST::SimulateStatement &stmt) {
       }
 
       stmt.seqStepDecl = &fn;
+      stmt.seqStepIntervalExpr = intervalExpr;
     } else {
       if (stmt.seqStepDecl) {
         err << "Sequential step function must be last" << stmt.loc;
@@ -706,6 +942,7 @@ void AnalysisVisitor::leave(AST::SimulateStatement &stmt) {
       }
 
       stmt.stepFuncDecls.push_back(&fn);
+      stmt.stepIntervalExprs.push_back(intervalExpr);
     }
   }
 
@@ -746,6 +983,31 @@ void AnalysisVisitor::leave(AST::ContinueStatement &stmt) {
   }
 }
 
+// Finds uses of local variables in an expression
+struct LocalVarFinder : public AST::Visitor {
+  LocalVarFinder(const Scope &scope) : scope(scope) {}
+
+  void enter(AST::VarExpression &expr) {
+    if (!scope.get(expr.var->id).isGlobal) {
+      found = true;
+    }
+  }
+
+  const Scope &scope;
+  bool found = false;
+};
+
+// Reductions by the name of the builtin that computes them
+static const std::map<std::string, ReductionKind> reductionKinds = {
+  { "count", ReductionKind::COUNT_TYPE },
+  { "count_member", ReductionKind::COUNT_MEMBER },
+  { "sum", ReductionKind::SUM_MEMBER },
+  { "min_member", ReductionKind::MIN_MEMBER },
+  { "max_member", ReductionKind::MAX_MEMBER },
+  { "mean_member", ReductionKind::MEAN_MEMBER },
+  { "histogram", ReductionKind::HISTOGRAM_MEMBER },
+};
+
 static bool isConst(const Scope &scope, AST::Expression &expr) {
   if (auto var = dynamic_cast<AST::VarExpression *>(&expr)) {
     const ScopeEntry &entry = scope.get(var->var->id);
@@ -1115,6 +1377,8 @@ void AnalysisVisitor::leave(AST::EnvironmentAccessExpression &expr) {
     replaceExpr(script.envDecl->envMax.toExpression());
   } else if (expr.member == "min") {
     replaceExpr(script.envDecl->envMin.toExpression());
+  } else if (findField(script, expr.member)) {
+    expr.type = Type::FIELD;
   } else {
     err << "Unknown environment member \"" << expr.member << "\"" << expr.loc;
   }
@@ -1264,6 +1528,30 @@ void AnalysisVisitor::leave(AST::CallExpression &expr) {
     }
   }
 
+  bool isReduction = !sig->decl && reductionKinds.count(sig->name);
+  if (isReduction || expr.name == "getLastExecTime") {
+    if (!currentFunc->isAnyStep()) {
+      err << expr.name << "() can only be used inside a step function" << expr.loc;
+      return;
+    }
+
+    // Reductions are computed upfront, in one pass per agent type. In parallel
+    // steps they are a snapshot taken at the start of the timestep
+    for (const AST::ExpressionPtr &arg : *expr.args) {
+      LocalVarFinder finder(scope);
+      arg->accept(finder);
+      if (finder.found) {
+        err << "Arguments of " << expr.name << "() can not depend on local variables"
+            << arg->loc;
+        return;
+      }
+    }
+
+    if (currentFunc->isParallelStep()) {
+      script.usesParallelReductions = true;
+    }
+  }
+
   if (expr.name == "removeCurrent") {
     if (!currentFunc->isParallelStep()) {
       err << "removeCurrent() can only be used inside a step function" << expr.loc;
@@ -1317,6 +1605,53 @@ void AnalysisVisitor::leave(AST::CallExpression &expr) {
     }
   }
 
+  if (expr.name == "link") {
+    if (!currentFunc || !currentFunc->isMain()) {
+      err << "link() can only be used in main()" << expr.loc;
+      return;
+    }
+
+    expr.getArg(0).type.getAgentDecl()->hasLinks = true;
+    script.usesLinks = true;
+  }
+
+  if (expr.name == "rewire") {
+    const auto *varExpr = dynamic_cast<const AST::VarExpression *>(&expr.getArg(0));
+    if (!varExpr || !linksLoopVars.count(varExpr->var->id)) {
+      err << "rewire() can only be used on the variable of an enclosing for-links loop"
+          << expr.getArg(0).loc;
+      return;
+    }
+
+    currentFunc->rewiresLinks = true;
+  }
+
+  if (expr.name == "send") {
+    if (!currentFunc || !currentFunc->isParallelStep()) {
+      err << "send() can only be used inside a step function" << expr.loc;
+      return;
+    }
+
+    // The recipient is addressed by its index, which is only known for these
+    const auto *varExpr = dynamic_cast<const AST::VarExpression *>(&expr.getArg(0));
+    if (!varExpr || (varExpr->var->id != currentFunc->stepParam().var->id
+                     && !neighborLoopVars.count(varExpr->var->id))) {
+      err << "send() can only be used on the agent of the current step function "
+             "or the variable of an enclosing for-near, for-nearest or for-links loop"
+          << expr.getArg(0).loc;
+      return;
+    }
+
+    std::pair<const AST::AgentDeclaration *, Type> message(
+      argTypes[0].getAgentDecl(), argTypes[1]);
+    auto &sentMessages = currentFunc->sentMessages;
+    if (std::find(sentMessages.begin(), sentMessages.end(), message) == sentMessages.end()) {
+      sentMessages.push_back(message);
+    }
+    sendCalls.push_back(&expr);
+    script.usesMessages = true;
+  }
+
   expr.kind = sig->decl
     ? AST::CallExpression::Kind::USER
     : AST::CallExpression::Kind::BUILTIN;
@@ -1324,12 +1659,40 @@ void AnalysisVisitor::leave(AST::CallExpression &expr) {
   expr.type = expr.calledSig.returnType;
   expr.calledFunc = sig->decl;
 
-  if (expr.name == "count" || expr.name == "sum") {
-    ReductionKind kind =
-      expr.calledSig.name == "count" ? ReductionKind::COUNT_TYPE :
-      expr.calledSig.name == "count_member" ? ReductionKind::COUNT_MEMBER :
-      ReductionKind::SUM_MEMBER;
+  if (isReduction) {
+    ReductionKind kind = reductionKinds.at(expr.calledSig.name);
     script.reductions.insert({ kind, expr.calledSig.paramTypes[0] });
+    currentFunc->reductionCalls.push_back(&expr);
+  }
+
+  if (!sig->decl && !sig->paramTypes.empty() && sig->paramTypes[0].isField()) {
+    const auto *fieldExpr =
+      dynamic_cast<const AST::EnvironmentAccessExpression *>(&expr.getArg(0));
+    if (!fieldExpr) {
+      err << "First argument of " << expr.name << "() must be an environment field"
+          << expr.getArg(0).loc;
+      return;
+    }
+
+    bool isDeposit = expr.name == "deposit" || expr.name == "deposit_max";
+    if (expr.name == "sample" || isDeposit) {
+      const AST::Expression &posExpr = expr.getArg(1);
+      if (posExpr.type.getVecLen() != script.envDecl->getEnvDimension()) {
+        err << "Position passed to " << expr.name << "() must match the environment dimension"
+            << posExpr.loc;
+        return;
+      }
+    }
+
+    if (isDeposit) {
+      currentFunc->depositedFields.insert(fieldExpr->member);
+    }
+  }
+
+  // Deposits made by called functions become visible after the caller
+  if (sig->decl && currentFunc) {
+    currentFunc->depositedFields.insert(
+      sig->decl->depositedFields.begin(), sig->decl->depositedFields.end());
   }
 
   if (expr.name == "log_csv") {
@@ -1340,6 +1703,14 @@ void AnalysisVisitor::leave(AST::CallExpression &expr) {
     script.usesTiming = true;
   }
 
+  if (expr.name == "save") {
+    script.usesSave = true;
+  }
+
+  if (expr.name == "load") {
+    script.usesLoad = true;
+  }
+
   // FlameGPU needs to know
   if (expr.name == "random" || expr.name == "randomInt") {
     currentFunc->usesRng = true;
@@ -1375,6 +1746,53 @@ void AnalysisVisitor::leave(AST::Script &script) {
     }
   }
 
+  if (envDecl) {
+    envDecl->maxNearRadius = Value(0.0);
+    for (const Value &radius : radiuses) {
+      if (radius.isInvalid()) {
+        envDecl->maxNearRadius = Value();
+        break;
+      }
+      if (radius.asFloat() > envDecl->maxNearRadius.asFloat()) {
+        envDecl->maxNearRadius = radius;
+      }
+    }
+  }
+
+  for (const AST::CallExpression *call : sendCalls) {
+    const AST::AgentDeclaration *agent = call->getArg(0).type.getAgentDecl();
+    Type msgType = call->getArg(1).type;
+    const std::vector<Type> &inboxTypes = agent->inboxTypes;
+    if (std::find(inboxTypes.begin(), inboxTypes.end(), msgType) == inboxTypes.end()) {
+      err << "Messages of type " << msgType << " sent to " << agent->name
+          << " are never read by a for-inbox loop" << call->loc;
+    }
+  }
+
+  for (const AST::AgentDeclaration *agent : script.agents) {
+    if (!agent->hasLinks && agent->inboxTypes.empty()) {
+      continue;
+    }
+
+    // Links and messages refer to agents by their index
+    bool addedAtRuntime = false;
+    for (const AST::FunctionDeclaration *func : script.funcs) {
+      addedAtRuntime = addedAtRuntime || func->runtimeAddedAgent == agent;
+    }
+    if (agent->usesRuntimeRemoval || addedAtRuntime) {
+      err << (agent->hasLinks ? "Linked agents" : "Agents receiving messages")
+          << " can not be added or removed in step functions" << agent->loc;
+      return;
+    }
+  }
+
+  if (envDecl && envDecl->envLattice && envDecl->maxNearRadius.isInvalid()) {
+    // The stencils are computed at compile time
+    err << "Lattice environments require near() radiuses known at compile time"
+        << envDecl->loc;
+    return;
+  }
+
   if (envDecl && envDecl->envGranularity.isInvalid()) {
     // TODO: What is the proper way to automatically determine the radius?
     // Lets use the maximum known radius for now
@@ -62,6 +62,7 @@ struct AnalysisVisitor : public AST::Visitor {
   void enter(AST::AgentDeclaration &);
   void enter(AST::ConstDeclaration &);
   void enter(AST::EnvironmentDeclaration &);
+  void enter(AST::FieldDeclaration &);
   void enter(AST::Script &);
   void leave(AST::Var &);
   void leave(AST::Literal &);
@@ -96,6 +97,7 @@ struct AnalysisVisitor : public AST::Visitor {
   void leave(AST::AgentDeclaration &);
   void leave(AST::ConstDeclaration &);
   void leave(AST::EnvironmentDeclaration &);
+  void leave(AST::FieldDeclaration &);
   void leave(AST::Script &);
 
   void handleLibScript(AST::Script &script) {
@@ -148,6 +150,12 @@ private:
   VarId collectAccessVar;
   // Radiuses used in near() loops
   std::vector<Value> radiuses;
+  // Variables of the enclosing for-links loops, which may be rewire()d
+  std::set<VarId> linksLoopVars;
+  // Variables of the enclosing for-near, for-nearest and for-links loops
+  std::set<VarId> neighborLoopVars;
+  // The send() calls, checked against the inboxes once all functions are known
+  std::vector<AST::CallExpression *> sendCalls;
   // In how many loops we are right now
   int loopNestingLevel = 0;
 };
@@ -47,4 +47,29 @@ long Config::getInt(
   return v.getInt();
 }
 
+double Config::getFloat(
+    const std::string &name, double defaultValue) const {
+  auto it = config.find(name);
+  if (it == config.end()) {
+    return defaultValue;
+  }
+
+  Value v = Value::fromString(it->second);
+  if (!v.isNum()) {
+    throw ConfigError("Value of " + name + " must be a number");
+  }
+
+  return v.asFloat();
+}
+
+std::string Config::getString(
+    const std::string &name, const std::string &defaultValue) const {
+  auto it = config.find(name);
+  if (it == config.end()) {
+    return defaultValue;
+  }
+
+  return it->second;
+}
+
 }
@@ -27,6 +27,8 @@ struct Config {
 
   bool getBool(const std::string &name, bool defaultValue) const;
   long getInt(const std::string &name, long defaultValue) const;
+  double getFloat(const std::string &name, double defaultValue) const;
+  std::string getString(const std::string &name, const std::string &defaultValue) const;
 };
 
 }
@@ -50,6 +50,7 @@ OpenABL::Parser::symbol_type yylex(OpenABL::ParserContext &ctx);
   CONTINUE
   ELSE
   ENVIRONMENT
+  EVERY
   IF
   FOR
   NEW
@@ -149,9 +150,9 @@ OpenABL::Parser::symbol_type yylex(OpenABL::ParserContext &ctx);
 %type <OpenABL::AST::StatementList *> statement_list;
 %type <OpenABL::AST::MemberInitEntry *> member_init_entry;
 %type <OpenABL::AST::MemberInitList *> member_init_list non_empty_member_init_list;
-%type <OpenABL::AST::Declaration *> declaration func_decl agent_decl const_decl env_decl;
+%type <OpenABL::AST::Declaration *> declaration func_decl agent_decl const_decl env_decl field_decl;
 %type <OpenABL::AST::DeclarationList *> declaration_list;
-%type <OpenABL::AST::IdentList *> ident_list;
+%type <OpenABL::AST::SimulateStepList *> simulate_step_list;
 %type <OpenABL::AST::Expression *> expression array_initializer initializer;
 %type <OpenABL::AST::ExpressionList *> expression_list arg_list;
 %type <OpenABL::AST::Statement *> statement;
@@ -168,6 +169,7 @@ declaration: agent_decl { $$ = $1; }
            | func_decl { $$ = $1; }
            | const_decl { $$ = $1; }
            | env_decl { $$ = $1; }
+           | field_decl { $$ = $1; }
            ;
 
 agent_decl: AGENT IDENTIFIER LBRACE agent_member_list RBRACE
@@ -226,6 +228,8 @@ const_decl: type var is_array ASSIGN initializer SEMI
 env_decl: ENVIRONMENT LBRACE member_init_list RBRACE
             { $$ = new EnvironmentDeclaration($3, @$); };
 
+field_decl: ENVIRONMENT type var SEMI { $$ = new FieldDeclaration($2, $3, @$); };
+
 literal: BOOL { $$ = new BoolLiteral($1, @$); }
        | INT { $$ = new IntLiteral($1, @$); }
        | FLOAT { $$ = new FloatLiteral($1, @$); }
@@ -237,8 +241,14 @@ type: IDENTIFIER { $$ = new SimpleType($1, @$); };
 statement_list: %empty { $$ = new StatementList(); }
               | statement_list statement { $1->emplace_back($2); $$ = $1; };
 
-ident_list: IDENTIFIER { $$ = new IdentList(); $$->push_back($1); }
-          | ident_list COMMA IDENTIFIER { $1->push_back($3); $$ = $1; };
+simulate_step_list: IDENTIFIER
+                      { $$ = new SimulateStepList(); $$->emplace_back($1, nullptr, @1); }
+                  | IDENTIFIER EVERY expression
+                      { $$ = new SimulateStepList(); $$->emplace_back($1, $3, @1); }
+                  | simulate_step_list COMMA IDENTIFIER
+                      { $1->emplace_back($3, nullptr, @3); $$ = $1; }
+                  | simulate_step_list COMMA IDENTIFIER EVERY expression
+                      { $1->emplace_back($3, $5, @3); $$ = $1; };
 
 statement: expression SEMI { $$ = new ExpressionStatement($1, @$); }
          | LBRACE statement_list RBRACE { $$ = new BlockStatement($2, @$); }
@@ -262,8 +272,11 @@ statement: expression SEMI { $$ = new ExpressionStatement($1, @$); }
              { $$ = new BreakStatement(@$); }
          | CONTINUE SEMI
              { $$ = new ContinueStatement(@$); }
-         | SIMULATE LPAREN expression RPAREN LBRACE ident_list optional_comma RBRACE
-             { $$ = new SimulateStatement($3, $6, @$); }
+         | SIMULATE LPAREN expression RPAREN LBRACE simulate_step_list optional_comma RBRACE
+             { $$ = new SimulateStatement($3, $6, nullptr, nullptr, @$); }
+         | SIMULATE LPAREN expression RPAREN LBRACE simulate_step_list optional_comma RBRACE
+           EVERY expression IDENTIFIER LPAREN arg_list RPAREN
+             { $$ = new SimulateStatement($3, $6, $10, new CallExpression($11, $13, @11), @$); }
 
          | expression ASSIGN expression SEMI
              { $$ = new AssignStatement($1, $3, @$); }
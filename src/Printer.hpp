@@ -61,6 +61,7 @@ struct Printer {
   virtual void print(const AST::AgentDeclaration &) = 0;
   virtual void print(const AST::ConstDeclaration &) = 0;
   virtual void print(const AST::EnvironmentDeclaration &) = 0;
+  virtual void print(const AST::FieldDeclaration &) = 0;
   virtual void print(const AST::Script &) = 0;
 
   template<typename T, typename Fn>
@@ -31,6 +31,9 @@ static const char *getTypeIdStr(Type::TypeId t) {
     case Type::STRING: return "string";
     case Type::VEC2: return "float2";
     case Type::VEC3: return "float3";
+    case Type::FIELD: return "field";
+    // Parameter of a builtin whose type depends on the other arguments
+    case Type::UNRESOLVED: return "any";
     default: return nullptr;
   }
 }
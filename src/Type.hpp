@@ -39,6 +39,7 @@ struct Type {
     ARRAY,
     AGENT_TYPE,   // Reference to the agent type itself
     AGENT_MEMBER, // Reference to a member of an agent type
+    FIELD,        // Reference to an environment field
     UNRESOLVED,   // Unresolved return type, computed from args
   };
 
@@ -118,6 +119,7 @@ struct Type {
   bool isAgent() const { return type == AGENT; }
   bool isAgentType() const { return type == AGENT_TYPE; }
   bool isAgentMember() const { return type == AGENT_MEMBER; }
+  bool isField() const { return type == FIELD; }
   bool isVec() const { return type == VEC2 || type == VEC3; }
   bool isVec2() const { return type == VEC2; }
   bool isVec3() const { return type == VEC3; }
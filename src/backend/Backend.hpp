@@ -39,6 +39,10 @@ struct CBackend : public Backend {
   void generate(AST::Script &script, const BackendContext &ctx);
 };
 
+struct MpiCBackend : public Backend {
+  void generate(AST::Script &script, const BackendContext &ctx);
+};
+
 struct FlameBackend : public Backend {
   void generate(AST::Script &script, const BackendContext &ctx);
   void initEnv(const BackendContext &ctx);
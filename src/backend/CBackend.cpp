@@ -20,20 +20,88 @@ namespace OpenABL {
 
 static std::string generateBuildScript(bool useFloat) {
   if (useFloat) {
-    return "gcc -O2 -std=c99 -DLIBABL_USE_FLOAT=1 main.c libabl.c -lm -fopenmp -o main";
+    return "gcc -O2 -march=native -fno-math-errno -fno-trapping-math -std=c99 -DLIBABL_USE_FLOAT=1 main.c libabl.c -lm -fopenmp -pthread -o main";
   } else {
-    return "gcc -O2 -std=c99 main.c libabl.c -lm -fopenmp -o main";
+    return "gcc -O2 -march=native -fno-math-errno -fno-trapping-math -std=c99 main.c libabl.c -lm -fopenmp -pthread -o main";
   }
 }
 
-void CBackend::generate(AST::Script &script, const BackendContext &ctx) {
-  if (script.usesRuntimeRemoval || script.usesRuntimeAddition) {
-    throw BackendError("The C backend does not support dynamic add/remove yet");
+static CPrinter::Params::Schedule getSchedule(const Config &config) {
+  std::string schedule = config.getString("c.schedule", "static");
+  if (schedule == "dynamic") {
+    return CPrinter::Params::Schedule::DYNAMIC;
+  } else if (schedule == "steal") {
+    return CPrinter::Params::Schedule::STEAL;
+  } else if (schedule != "static") {
+    throw ConfigError(
+        "Value of c.schedule must be either \"static\", \"dynamic\" or \"steal\"");
+  }
+  return CPrinter::Params::Schedule::STATIC;
+}
+
+static CPrinter::Params::SpatialIndex parseSpatialIndex(
+    const Config &config, const std::string &name, const std::string &defaultValue) {
+  std::string index = config.getString(name, defaultValue);
+  if (index == "tree") {
+    return CPrinter::Params::SpatialIndex::TREE;
+  } else if (index == "auto") {
+    return CPrinter::Params::SpatialIndex::AUTO;
+  } else if (index != "grid") {
+    throw ConfigError(
+        "Value of " + name + " must be either \"grid\", \"tree\" or \"auto\"");
   }
+  return CPrinter::Params::SpatialIndex::GRID;
+}
+
+// c.spatial_index applies to all agent types, c.spatial_index.<Agent> overrides it
+static std::map<std::string, CPrinter::Params::SpatialIndex> getSpatialIndex(
+    const AST::Script &script, const Config &config) {
+  std::string defaultIndex = config.getString("c.spatial_index", "grid");
+  // Validate the default even if all agent types override it
+  parseSpatialIndex(config, "c.spatial_index", "grid");
 
+  std::map<std::string, CPrinter::Params::SpatialIndex> result;
+  for (const AST::AgentDeclaration *agent : script.agents) {
+    result[agent->name] = parseSpatialIndex(
+        config, "c.spatial_index." + agent->name, defaultIndex);
+  }
+  return result;
+}
+
+void CBackend::generate(AST::Script &script, const BackendContext &ctx) {
   bool useFloat = ctx.config.getBool("use_float", false);
 
-  CPrinter printer(script, useFloat);
+  CPrinter::Params params;
+  std::string layout = ctx.config.getString("c.layout", "aos");
+  if (layout == "soa") {
+    params.soaLayout = true;
+  } else if (layout != "aos") {
+    throw ConfigError("Value of c.layout must be either \"aos\" or \"soa\"");
+  }
+  params.schedule = getSchedule(ctx.config);
+  params.spatialIndex = getSpatialIndex(script, ctx.config);
+  params.reorderInterval = ctx.config.getInt("c.reorder", 0);
+  if (params.reorderInterval < 0) {
+    throw ConfigError("Value of c.reorder must not be negative");
+  }
+  params.verletSkin = ctx.config.getFloat("c.verlet_skin", 0);
+  if (params.verletSkin < 0) {
+    throw ConfigError("Value of c.verlet_skin must not be negative");
+  }
+  if (params.reorderInterval > 0 && script.usesLinks) {
+    // Link targets refer to agents by their index in the buffer
+    throw BackendError("c.reorder is not supported together with agent links");
+  }
+  if (params.reorderInterval > 0 && script.usesMessages) {
+    // Like links, messages are addressed by index
+    throw BackendError("c.reorder is not supported together with send()");
+  }
+  if (params.verletSkin > 0 && script.envDecl && script.envDecl->maxNearRadius.isInvalid()) {
+    // The lists are built for the largest radius
+    throw BackendError("c.verlet_skin requires near() radiuses known at compile time");
+  }
+
+  CPrinter printer(script, useFloat, params);
   printer.print(script);
   writeToFile(ctx.outputDir + "/main.c", printer.extractStr());
   copyFile(ctx.assetDir + "/c/libabl.h", ctx.outputDir + "/libabl.h");
@@ -44,4 +112,77 @@ void CBackend::generate(AST::Script &script, const BackendContext &ctx) {
   makeFileExecutable(ctx.outputDir + "/run.sh");
 }
 
+static std::string generateMpiBuildScript(bool useFloat) {
+  return std::string("mpicc -O2 -march=native -fno-math-errno -fno-trapping-math -std=c99 ")
+    + (useFloat ? "-DLIBABL_USE_FLOAT=1 " : "")
+    + "main.c libabl.c libabl_mpi.c -lm -fopenmp -pthread -o main";
+}
+
+void MpiCBackend::generate(AST::Script &script, const BackendContext &ctx) {
+  // Agents are assigned to ranks by their position
+  for (const AST::AgentDeclaration *agent : script.agents) {
+    if (!agent->getPositionMember()) {
+      throw BackendError("The mpic backend requires all agents to have a position member");
+    }
+  }
+  if (!script.envDecl || script.envDecl->maxNearRadius.isInvalid()) {
+    throw BackendError("The mpic backend requires near() radiuses known at compile time");
+  }
+  if (script.simStmt && script.simStmt->outputExpr) {
+    throw BackendError("The mpic backend does not support periodic output");
+  }
+  if (script.envDecl->envWrap) {
+    // Ghosts are only exchanged between neighboring slabs, not across the border
+    throw BackendError("The mpic backend does not support wrapping environments");
+  }
+  if (script.envDecl->envLattice) {
+    throw BackendError("The mpic backend does not support lattice environments");
+  }
+  if (!script.fields.empty()) {
+    throw BackendError("The mpic backend does not support environment fields");
+  }
+  if (script.usesNearest) {
+    // Ghosts only extend as far as the largest near() radius
+    throw BackendError("The mpic backend does not support nearest()");
+  }
+  if (script.usesLinks) {
+    // Linked agents may live on any rank
+    throw BackendError("The mpic backend does not support agent links");
+  }
+  if (script.usesMessages) {
+    throw BackendError("The mpic backend does not support send()");
+  }
+  if (ctx.config.getInt("c.reorder", 0)) {
+    // Agents migrate between ranks, so their creation order is not tracked
+    throw BackendError("The mpic backend does not support c.reorder");
+  }
+  if (ctx.config.getFloat("c.verlet_skin", 0)) {
+    // Ghosts are exchanged in every step, so neighbor lists can't be reused
+    throw BackendError("The mpic backend does not support c.verlet_skin");
+  }
+  if (ctx.config.getString("c.layout", "aos") != "aos") {
+    // Agents are packed into MPI messages as whole structs
+    throw BackendError("The mpic backend does not support c.layout=soa");
+  }
+
+  bool useFloat = ctx.config.getBool("use_float", false);
+
+  CPrinter::Params params;
+  params.mpi = true;
+  params.schedule = getSchedule(ctx.config);
+  params.spatialIndex = getSpatialIndex(script, ctx.config);
+
+  CPrinter printer(script, useFloat, params);
+  printer.print(script);
+  writeToFile(ctx.outputDir + "/main.c", printer.extractStr());
+  copyFile(ctx.assetDir + "/c/libabl.h", ctx.outputDir + "/libabl.h");
+  copyFile(ctx.assetDir + "/c/libabl.c", ctx.outputDir + "/libabl.c");
+  copyFile(ctx.assetDir + "/mpic/libabl_mpi.h", ctx.outputDir + "/libabl_mpi.h");
+  copyFile(ctx.assetDir + "/mpic/libabl_mpi.c", ctx.outputDir + "/libabl_mpi.c");
+  writeToFile(ctx.outputDir + "/build.sh", generateMpiBuildScript(useFloat));
+  copyFile(ctx.assetDir + "/mpic/run.sh", ctx.outputDir + "/run.sh");
+  makeFileExecutable(ctx.outputDir + "/build.sh");
+  makeFileExecutable(ctx.outputDir + "/run.sh");
+}
+
 }
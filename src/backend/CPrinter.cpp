@@ -12,7 +12,11 @@
  * See the License for the specific language governing permissions and
  * limitations under the License. */
 
+#include <algorithm>
+#include <cmath>
+#include <sstream>
 #include <string>
+#include "ASTVisitor.hpp"
 #include "CPrinter.hpp"
 
 namespace OpenABL {
@@ -44,6 +48,18 @@ static void printStorageType(CPrinter &s, Type type) {
   }
 }
 
+// Message type as spelled in ABL, float instead of the C float type
+static std::string getMessageTypeName(Type msgType) {
+  std::ostringstream s;
+  s << msgType;
+  return s.str();
+}
+
+// Name of the inbox holding the messages of a type sent to an agent type
+static std::string getInboxName(const AST::AgentDeclaration &agent, Type msgType) {
+  return "agents_" + agent.name + "_inbox_" + getMessageTypeName(msgType);
+}
+
 static bool typeRequiresStorage(Type type) {
   return type.isArray() || type.isAgent();
 }
@@ -68,12 +84,85 @@ void CPrinter::print(const AST::CallExpression &expr) {
     const FunctionSignature &sig = expr.calledSig;
     if (sig.name == "add") {
       AST::AgentDeclaration *agent = sig.paramTypes[0].getAgentDecl();
+      const AST::Expression &arg = *(*expr.args)[0];
+      if (currentFunc && currentFunc->isParallelStep()) {
+        // Staged per thread, appended once the step finished
+        *this << "*AGENT_STAGING_PLACE(&agents_" << agent->name << "_added, "
+              << agent->name << ") = " << arg;
+        return;
+      }
+
+      if (params.soaLayout) {
+        *this << agent->name << "_soa_store(&agents.agents_" << agent->name
+              << ", soa_array_place((soa_array *) &agents.agents_" << agent->name
+              << ", " << agent->name << "_info), ";
+        if (dynamic_cast<const AST::AgentCreationExpression *>(&arg)) {
+          // Agent variables are pointers already, new agents are not
+          *this << "&";
+        }
+        *this << arg << ")";
+        return;
+      }
+
       *this << "*DYN_ARRAY_PLACE(&agents.agents_" << agent->name
-            << ", " << agent->name << ") = " << *(*expr.args)[0];
+            << ", " << agent->name << ") = " << arg;
       return;
     } else if (sig.name == "save") {
+      if (params.mpi) {
+        *this << "save(&agents, agents_info, mpi_output_path(" << *(*expr.args)[0]
+              << "), SAVE_JSON)";
+        return;
+      }
       *this << "save(&agents, agents_info, " << *(*expr.args)[0] << ", SAVE_JSON)";
       return;
+    } else if (sig.name == "load") {
+      *this << "load(&agents, agents_info, " << *(*expr.args)[0] << ")";
+      return;
+    } else if (sig.name == "removeCurrent") {
+      *this << "*_removed = true";
+      return;
+    } else if (reductionLabels.count(&expr)) {
+      // Computed upfront in one pass per agent type, see printReductions()
+      *this << reductionLabels.at(&expr);
+      return;
+    } else if (sig.name == "log_csv") {
+      for (const AST::ExpressionPtr &arg : *expr.args) {
+        *this << (arg->type.isInt() ? "log_csv_int" : "log_csv_float")
+              << "(&openabl_log_file, " << *arg << "), ";
+      }
+      *this << "log_csv_end(&openabl_log_file)";
+      return;
+    } else if (sig.name == "getLastExecTime") {
+      *this << "openabl_last_exec_time";
+      return;
+    } else if (sig.name == "link") {
+      *this << "link_graph_add(&agents_" << expr.getArg(0).type.getAgentDecl()->name
+            << "_links, " << expr.getArg(1) << ", " << expr.getArg(2) << ")";
+      return;
+    } else if (sig.name == "send") {
+      // Messages are addressed by the index of the recipient in the input buffer
+      const auto &varExpr = dynamic_cast<const AST::VarExpression &>(expr.getArg(0));
+      const AST::AgentDeclaration &agent = *expr.getArg(0).type.getAgentDecl();
+      Type msgType = expr.getArg(1).type;
+      *this << "inbox_send_" << getMessageTypeName(msgType) << "(&" << getInboxName(agent, msgType) << ", ";
+      if (varExpr.var->id == currentFunc->stepParam().var->id) {
+        *this << "_index";
+      } else {
+        *this << neighborIndices.at(varExpr.var->id);
+      }
+      *this << ", " << expr.getArg(1) << ")";
+      return;
+    } else if ((expr.name == "dist" || expr.name == "displacement")
+        && script.envDecl && script.envDecl->envWrap) {
+      printWrapCallStart(expr.name, sig.paramTypes[0]);
+      printArgs(expr);
+      printWrapCallEnd(sig.paramTypes[0]);
+      return;
+    } else if (sig.name == "rewire") {
+      const auto &varExpr = dynamic_cast<const AST::VarExpression &>(expr.getArg(0));
+      *this << "link_graph_rewire(&agents_" << expr.getArg(0).type.getAgentDecl()->name
+            << "_links, " << linkSlots.at(varExpr.var->id) << ", " << expr.getArg(1) << ")";
+      return;
     }
 
     *this << sig.name << "(";
@@ -94,14 +183,38 @@ void CPrinter::print(const AST::NewArrayExpression &expr) {
   *this << ", " << *expr.sizeExpr << ")";
 }
 
+void CPrinter::print(const AST::VarExpression &expr) {
+  auto it = soaNeighbors.find(expr.var->id);
+  if (it != soaNeighbors.end()) {
+    // Gather the whole neighbor from struct-of-arrays storage
+    const std::string &name = it->second.agent->name;
+    *this << name << "_soa_load(&(" << name << ") {0}, &agents.agents_"
+          << name << ", " << it->second.index << ")";
+    return;
+  }
+
+  GenericPrinter::print(expr);
+}
+
 void CPrinter::print(const AST::MemberAccessExpression &expr) {
-  if (expr.expr->type.isAgent()) {
+  const auto *varExpr = dynamic_cast<const AST::VarExpression *>(&*expr.expr);
+  auto it = varExpr ? soaNeighbors.find(varExpr->var->id) : soaNeighbors.end();
+  if (it != soaNeighbors.end()) {
+    // Read the neighbor member directly from its member array
+    *this << "agents.agents_" << it->second.agent->name << "."
+          << expr.member << "[" << it->second.index << "]";
+  } else if (expr.expr->type.isAgent()) {
     *this << *expr.expr << "->" << expr.member;
   } else {
     GenericPrinter::print(expr);
   }
 }
 
+// Only environment fields remain after analysis
+void CPrinter::print(const AST::EnvironmentAccessExpression &expr) {
+  *this << "&openabl_field_" << expr.member;
+}
+
 void CPrinter::print(const AST::AssignStatement &expr) {
   if (expr.right->type.isAgent()) {
     // Agent assignments are interpreted as copies, not reference assignments
@@ -110,6 +223,24 @@ void CPrinter::print(const AST::AssignStatement &expr) {
     GenericPrinter::print(expr);
   }
 }
+void CPrinter::print(const AST::AssignOpStatement &stmt) {
+  const auto *varExpr = dynamic_cast<const AST::VarExpression *>(&*stmt.left);
+  auto it = varExpr ? simdVecSums.find(varExpr->var->id) : simdVecSums.end();
+  if (it == simdVecSums.end()) {
+    GenericPrinter::print(stmt);
+    return;
+  }
+
+  // Vector sums in SIMD loops are accumulated per component
+  static const char *components[] = { "x", "y", "z" };
+  std::string tLabel = makeAnonLabel();
+  *this << "{" << indent << nl;
+  *this << stmt.right->type << " " << tLabel << " = " << *stmt.right << ";";
+  for (size_t i = 0; i < it->second.size(); i++) {
+    *this << nl << it->second[i] << " += " << tLabel << "." << components[i] << ";";
+  }
+  *this << outdent << nl << "}";
+}
 void CPrinter::print(const AST::VarDeclarationStatement &stmt) {
   Type type = stmt.type->resolved;
   if (typeRequiresStorage(type)) {
@@ -133,6 +264,34 @@ void CPrinter::print(const AST::VarDeclarationStatement &stmt) {
   }
 }
 
+// Checks whether the neighbor of a for-links loop is used, apart from
+// rewiring its link
+struct VarUseChecker : public AST::Visitor {
+  VarUseChecker(VarId id) : id{id} {}
+
+  void enter(AST::VarExpression &expr) {
+    if (expr.var->id == id) {
+      uses++;
+    }
+  }
+  void enter(AST::CallExpression &expr) {
+    // rewire() only uses the slot of the link
+    if (expr.name == "rewire") {
+      const auto *varExpr = dynamic_cast<const AST::VarExpression *>(&*(*expr.args)[0]);
+      if (varExpr && varExpr->var->id == id) {
+        rewireUses++;
+      }
+    }
+  }
+  bool isUsed() const {
+    return uses > rewireUses;
+  }
+
+  VarId id;
+  unsigned uses = 0;
+  unsigned rewireUses = 0;
+};
+
 static void printRangeFor(CPrinter &p, const AST::ForStatement &stmt) {
   std::string eLabel = p.makeAnonLabel();
   auto range = stmt.getRange();
@@ -145,30 +304,85 @@ void CPrinter::print(const AST::ForStatement &stmt) {
   if (stmt.isRange()) {
     printRangeFor(*this, stmt);
     return;
+  } else if (stmt.isNearest()) {
+    printNearestLoop(stmt);
+    return;
+  } else if (stmt.isInbox()) {
+    // Messages delivered to the current agent
+    std::string inboxName = getInboxName(currentFunc->stepAgent(), stmt.type->resolved);
+    std::string kLabel = makeAnonLabel();
+    *this << "for (size_t " << kLabel << " = " << inboxName << ".start[_index]; "
+          << kLabel << " < " << inboxName << ".start[_index + 1]; " << kLabel << "++) {"
+          << indent << nl
+          << *stmt.type << " " << *stmt.var << " = ((" << *stmt.type << " *) "
+          << inboxName << ".values)[" << kLabel << "];" << nl
+          << *stmt.stmt << outdent << nl << "}";
+    return;
+  } else if (stmt.isLinks()) {
+    // Links of the current agent, the linked agents are read from the input buffer
+    const std::string &agentName = stmt.type->resolved.getAgentDecl()->name;
+    std::string kLabel = makeAnonLabel();
+    std::string iLabel = makeAnonLabel();
+    *this << "for (size_t " << kLabel << " = agents_" << agentName << "_links.start[_index]; "
+          << kLabel << " < agents_" << agentName << "_links.start[_index + 1]; "
+          << kLabel << "++) {" << indent << nl;
+    linkSlots[stmt.var->id] = kLabel;
+    VarUseChecker useChecker(stmt.var->id);
+    stmt.stmt->accept(useChecker);
+    if (useChecker.isUsed()) {
+      *this << "size_t " << iLabel << " = agents_" << agentName << "_links.targets["
+            << kLabel << "];" << nl;
+      printNearNeighbor(stmt, iLabel, "");
+    } else {
+      *this << *stmt.stmt;
+    }
+    linkSlots.erase(stmt.var->id);
+    *this << outdent << nl << "}";
+    return;
   } else if (stmt.isNear()) {
+    if (script.envDecl->envLattice) {
+      printLatticeLoop(stmt);
+      return;
+    }
+
     const AST::Expression &agentExpr = stmt.getNearAgent();
     const AST::Expression &radiusExpr = stmt.getNearRadius();
 
     AST::AgentDeclaration *agentDecl = stmt.type->resolved.getAgentDecl();
     AST::AgentMember *posMember = agentDecl->getPositionMember();
-    const char *dist_fn = posMember->type->resolved == Type::VEC2
-      ? "dist_float2" : "dist_float3";
 
-    std::string eLabel = makeAnonLabel();
+    std::string rLabel = makeAnonLabel();
+    std::string itLabel = makeAnonLabel();
+    bool useView = currentFunc && neighborViewFuncs.count(currentFunc);
+    bool useVerlet = currentFunc && verletFuncs.count(currentFunc);
+
+    *this << "{" << indent << nl;
+    *this << Type(Type::FLOAT) << " " << rLabel << " = " << radiusExpr << ";" << nl;
     std::string iLabel = makeAnonLabel();
+    if (useVerlet) {
+      // Only visit the agents in the Verlet list of the current agent
+      const std::string &listName = currentFunc->name + "_verlet";
+      std::string kLabel = makeAnonLabel();
+      *this << "for (size_t " << kLabel << " = " << listName << ".start[_index]; "
+            << kLabel << " < " << listName << ".start[_index + 1]; " << kLabel << "++) {"
+            << indent << nl
+            << "size_t " << iLabel << " = " << listName << ".ids[" << kLabel << "];" << nl;
+    } else {
+      // Only visit agents in grid cells that overlap the query radius
+      *this << "spatial_grid_iter " << itLabel << " = spatial_grid_query_"
+            << posMember->type->resolved << "(&agents_" << agentDecl->name << "_grid, "
+            << agentExpr << "->" << posMember->name << ", " << rLabel << ");" << nl;
+      if (useView) {
+        printNeighborViewLoop(stmt, itLabel, rLabel);
+        *this << outdent << nl << "}";
+        return;
+      }
 
-    // For now: Print normal loop with radius check
-    *this << "for (size_t " << iLabel << " = 0; "
-          << iLabel << " < agents.agents_" << agentDecl->name << ".len; "
-          << iLabel << "++) {"
-          << indent << nl << *stmt.type << " " << *stmt.var
-          << " = DYN_ARRAY_GET(&agents.agents_" << agentDecl->name << ", ";
-    printStorageType(*this, stmt.type->resolved);
-    *this << ", " << iLabel << ");" << nl
-          << "if (" << dist_fn << "(" << *stmt.var << "->" << posMember->name << ", "
-          << agentExpr << "->" << posMember->name << ") > " << radiusExpr
-          << ") continue;" << nl
-          << *stmt.stmt << outdent << nl << "}";
+      *this << "for (size_t " << iLabel << "; spatial_grid_next(&" << itLabel
+            << ", &" << iLabel << ");) {" << indent << nl;
+    }
+    printNearNeighbor(stmt, iLabel, rLabel);
+    *this << outdent << nl << "}" << outdent << nl << "}";
     return;
   }
 
@@ -186,49 +400,1244 @@ void CPrinter::print(const AST::ForStatement &stmt) {
   *this << ", " << iLabel << ");" << nl
         << *stmt.stmt << outdent << nl << "}";
 }
-void CPrinter::print(const AST::SimulateStatement &stmt) {
-  std::string tLabel = makeAnonLabel();
-  *this << "for (int " << tLabel << " = 0; "
-        << tLabel << " < " << *stmt.timestepsExpr << "; "
-        << tLabel << "++) {" << indent << nl
-        << "dyn_array tmp;";
 
-  for (AST::FunctionDeclaration *stepFunc : stmt.stepFuncDecls) {
-    const AST::Param &param = *(*stepFunc->params)[0];
-    Type type = param.type->resolved;
+// Agent types that are iterated by a for-near loop and thus need a spatial index
+static std::vector<const AST::AgentDeclaration *> getIndexedAgents(const AST::Script &script) {
+  std::vector<const AST::AgentDeclaration *> result;
+  for (const AST::AgentDeclaration *agent : script.agents) {
+    for (const AST::FunctionDeclaration *func : script.funcs) {
+      if (func->accessedAgent == agent) {
+        result.push_back(agent);
+        break;
+      }
+    }
+  }
+  return result;
+}
 
-    std::ostringstream s;
-    s << "agents.agents_" << type;
-    std::string bufName = s.str();
-    s << "_dbuf";
-    std::string dbufName = s.str();
+static bool isIndexedAgent(const AST::Script &script, const AST::AgentDeclaration &agent) {
+  auto agents = getIndexedAgents(script);
+  return std::find(agents.begin(), agents.end(), &agent) != agents.end();
+}
 
-    std::string iLabel = makeAnonLabel();
-    std::string inLabel = makeAnonLabel();
-    std::string outLabel = makeAnonLabel();
+static const char *getSpatialIndexKind(
+    const AST::Script &script, const CPrinter::Params &params,
+    const AST::AgentDeclaration &agent) {
+  if (script.envDecl->envLattice) {
+    return "SPATIAL_INDEX_LATTICE";
+  }
+
+  auto it = params.spatialIndex.find(agent.name);
+  if (it == params.spatialIndex.end()) {
+    return "SPATIAL_INDEX_GRID";
+  }
+  switch (it->second) {
+    case CPrinter::Params::SpatialIndex::GRID: return "SPATIAL_INDEX_GRID";
+    case CPrinter::Params::SpatialIndex::TREE: return "SPATIAL_INDEX_TREE";
+    case CPrinter::Params::SpatialIndex::AUTO: return "SPATIAL_INDEX_AUTO";
+  }
+  assert(0);
+  return nullptr;
+}
+
+// The count() and sum() calls in parallel step functions
+static std::vector<AST::CallExpression *> getSnapshotCalls(const AST::Script &script) {
+  std::vector<AST::CallExpression *> result;
+  for (const AST::FunctionDeclaration *func : script.funcs) {
+    if (func->isParallelStep()) {
+      result.insert(result.end(), func->reductionCalls.begin(), func->reductionCalls.end());
+    }
+  }
+  return result;
+}
+
+// Agent types that are added by step functions and thus need staging buffers
+static std::vector<const AST::AgentDeclaration *> getRuntimeAddedAgents(
+    const AST::Script &script) {
+  std::vector<const AST::AgentDeclaration *> result;
+  for (const AST::AgentDeclaration *agent : script.agents) {
+    for (const AST::FunctionDeclaration *func : script.funcs) {
+      if (func->runtimeAddedAgent == agent) {
+        result.push_back(agent);
+        break;
+      }
+    }
+  }
+  return result;
+}
+
+// Checks whether the neighbors of for-near loops are only read member-wise,
+// so that they can be replaced by a view holding the accessed members only
+struct NeighborAccessChecker : public AST::Visitor {
+  void enter(AST::ForStatement &stmt) {
+    if (stmt.isNear()) {
+      nearVars.insert(stmt.var->id);
+    }
+  }
+  void enter(AST::MemberAccessExpression &expr) {
+    if (isNearVar(*expr.expr)) {
+      memberAccesses++;
+    }
+  }
+  void enter(AST::VarExpression &expr) {
+    if (isNearVar(expr)) {
+      varUses++;
+    }
+  }
+  void enter(AST::AssignStatement &stmt) {
+    checkAssign(*stmt.left);
+  }
+  void enter(AST::AssignOpStatement &stmt) {
+    checkAssign(*stmt.left);
+  }
+
+  bool isNearVar(const AST::Expression &expr) const {
+    const auto *varExpr = dynamic_cast<const AST::VarExpression *>(&expr);
+    return varExpr && nearVars.count(varExpr->var->id);
+  }
+  void checkAssign(const AST::Expression &left) {
+    const auto *access = dynamic_cast<const AST::MemberAccessExpression *>(&left);
+    if (access && isNearVar(*access->expr)) {
+      assigned = true;
+    }
+  }
+  bool onlyMemberReads() const {
+    return !assigned && varUses == memberAccesses;
+  }
+
+  std::set<VarId> nearVars;
+  unsigned memberAccesses = 0;
+  unsigned varUses = 0;
+  bool assigned = false;
+};
+
+// Checks whether the body of a for-near loop can run as a SIMD loop: it may only
+// call pure builtins, assign to its own locals and add to outer variables that
+// are not otherwise used in the loop, which then become SIMD reductions
+struct SimdBodyChecker : public AST::Visitor {
+  void enter(AST::VarDeclarationStatement &stmt) {
+    locals.insert(stmt.var->id);
+  }
+  void enter(AST::VarExpression &expr) {
+    uses[expr.var->id]++;
+  }
+  void enter(AST::AssignStatement &stmt) {
+    const auto *varExpr = dynamic_cast<const AST::VarExpression *>(&*stmt.left);
+    if (!varExpr || !locals.count(varExpr->var->id)) {
+      simd = false;
+    }
+  }
+  void enter(AST::AssignOpStatement &stmt) {
+    const auto *varExpr = dynamic_cast<const AST::VarExpression *>(&*stmt.left);
+    if (!varExpr) {
+      simd = false;
+      return;
+    }
+
+    VarId id = varExpr->var->id;
+    if (locals.count(id)) {
+      return;
+    }
+    if (stmt.op != AST::BinaryOp::ADD || !varExpr->type.isNumOrVec()
+        || varExpr->type.isVec() != stmt.right->type.isVec()) {
+      simd = false;
+      return;
+    }
+    if (!sumUses[id]++) {
+      sums.push_back(varExpr);
+    }
+  }
+  void enter(AST::CallExpression &expr) {
+    static const std::set<std::string> pureBuiltins = {
+      "dot", "length", "dist", "displacement", "normalize", "sin", "cos", "tan",
+      "sinh", "cosh", "tanh", "asin", "acos", "atan", "exp", "log", "sqrt",
+      "cbrt", "round", "pow", "min", "max",
+    };
+    if (!expr.isCtor() && !(expr.isBuiltin() && pureBuiltins.count(expr.name))) {
+      simd = false;
+    }
+  }
+  void enter(AST::ArrayAccessExpression &) { simd = false; }
+  void enter(AST::NewArrayExpression &) { simd = false; }
+  void enter(AST::AgentCreationExpression &) { simd = false; }
+  void enter(AST::ExpressionStatement &) { simd = false; }
+  void enter(AST::WhileStatement &) { simd = false; }
+  void enter(AST::ForStatement &) { simd = false; }
+  void enter(AST::BreakStatement &) { simd = false; }
+  void enter(AST::ReturnStatement &) { simd = false; }
+
+  bool isVectorizable() const {
+    if (!simd) {
+      return false;
+    }
+    for (const AST::VarExpression *sum : sums) {
+      if (uses.at(sum->var->id) != sumUses.at(sum->var->id)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  std::set<VarId> locals;
+  std::map<VarId, unsigned> uses;
+  std::map<VarId, unsigned> sumUses;
+  std::vector<const AST::VarExpression *> sums;
+  bool simd = true;
+};
+
+struct NearLoopCollector : public AST::Visitor {
+  void enter(AST::ForStatement &stmt) {
+    if (stmt.isNear()) {
+      loops.push_back(&stmt);
+    } else if (stmt.isNearest()) {
+      nearestLoops.push_back(&stmt);
+    }
+  }
+
+  std::vector<AST::ForStatement *> loops;
+  std::vector<AST::ForStatement *> nearestLoops;
+};
+
+// The neighbors of for-nearest loops are not bounded by a radius, so they
+// are always found through the spatial index
+static bool hasNearestLoop(AST::FunctionDeclaration &stepFunc) {
+  NearLoopCollector collector;
+  stepFunc.accept(collector);
+  return !collector.nearestLoops.empty();
+}
+
+// Declares the neighbor with index iLabel of a for-near loop and prints the loop
+// body. Neighbors further away than rLabel are skipped, unless it is empty.
+void CPrinter::printNearNeighbor(
+    const AST::ForStatement &stmt, const std::string &iLabel, const std::string &rLabel) {
+  const AST::Expression &agentExpr = stmt.getNearAgent();
+  AST::AgentDeclaration *agentDecl = stmt.type->resolved.getAgentDecl();
+  // Agents without position can only be reached through links
+  AST::AgentMember *posMember = agentDecl->getPositionMember();
+  Type posType = posMember ? posMember->type->resolved : Type();
+  if (params.soaLayout) {
+    // The neighbor is not materialized, members are read from the member arrays
+    if (!rLabel.empty()) {
+      *this << "if (";
+      printWrapCallStart("dist", posType);
+      *this << "agents.agents_" << agentDecl->name << "."
+            << posMember->name << "[" << iLabel << "], "
+            << agentExpr << "->" << posMember->name;
+      printWrapCallEnd(posType);
+      *this << " > " << rLabel << ") continue;" << nl;
+    }
+
+    soaNeighbors[stmt.var->id] = { iLabel, agentDecl };
+    neighborIndices[stmt.var->id] = iLabel;
+    *this << *stmt.stmt;
+    soaNeighbors.erase(stmt.var->id);
+    neighborIndices.erase(stmt.var->id);
+  } else {
+    *this << *stmt.type << " " << *stmt.var
+          << " = DYN_ARRAY_GET(&agents.agents_" << agentDecl->name << ", ";
+    printStorageType(*this, stmt.type->resolved);
+    *this << ", " << iLabel << ");" << nl;
+    if (!rLabel.empty()) {
+      *this << "if (";
+      printWrapCallStart("dist", posType);
+      *this << *stmt.var << "->" << posMember->name << ", "
+            << agentExpr << "->" << posMember->name;
+      printWrapCallEnd(posType);
+      *this << " > " << rLabel << ") continue;" << nl;
+    }
+    neighborIndices[stmt.var->id] = iLabel;
+    *this << *stmt.stmt;
+    neighborIndices.erase(stmt.var->id);
+  }
+}
+
+// Vector sums of a SIMD for-near loop are split into scalar sums, which
+// compilers can vectorize. Returns whether the loop is a SIMD loop.
+bool CPrinter::printSimdSumsStart(const AST::ForStatement &stmt) {
+  auto simdIt = simdNearLoops.find(&stmt);
+  if (simdIt == simdNearLoops.end()) {
+    return false;
+  }
+
+  for (const AST::VarExpression *sum : simdIt->second) {
+    if (!sum->type.isVec()) {
+      continue;
+    }
+
+    std::vector<std::string> &labels = simdVecSums[sum->var->id];
+    for (int i = 0; i < (sum->type.isVec2() ? 2 : 3); i++) {
+      labels.push_back(makeAnonLabel());
+      *this << Type(Type::FLOAT) << " " << labels.back() << " = 0;" << nl;
+    }
+  }
+  return true;
+}
+
+void CPrinter::printSimdPragma(const AST::ForStatement &stmt) {
+  const std::vector<const AST::VarExpression *> &sums = simdNearLoops.at(&stmt);
+  *this << "#pragma omp simd";
+  const char *sep = " reduction(+:";
+  for (const AST::VarExpression *sum : sums) {
+    if (sum->type.isVec()) {
+      for (const std::string &label : simdVecSums[sum->var->id]) {
+        *this << sep << label;
+        sep = ",";
+      }
+    } else {
+      *this << sep << *sum;
+      sep = ",";
+    }
+  }
+  *this << (sums.empty() ? "" : ")") << nl;
+}
+
+void CPrinter::printSimdSumsEnd(const AST::ForStatement &stmt) {
+  static const char *components[] = { "x", "y", "z" };
+  for (const AST::VarExpression *sum : simdNearLoops.at(&stmt)) {
+    auto labels = simdVecSums.find(sum->var->id);
+    if (labels == simdVecSums.end()) {
+      continue;
+    }
+    for (size_t i = 0; i < labels->second.size(); i++) {
+      *this << nl << *sum << "." << components[i] << " += " << labels->second[i] << ";";
+    }
+  }
+  simdVecSums.clear();
+}
+
+// The neighbor view is in cell order, so every row of cells of the query box is
+// one contiguous range of neighbors, which is processed as a SIMD loop if possible
+void CPrinter::printNeighborViewLoop(
+    const AST::ForStatement &stmt, const std::string &itLabel, const std::string &rLabel) {
+  const AST::Expression &agentExpr = stmt.getNearAgent();
+  const AST::AgentMember *posMember =
+    stmt.type->resolved.getAgentDecl()->getPositionMember();
+  const std::string &viewName = currentFunc->name;
+  std::string iLabel = makeAnonLabel();
+  std::string bLabel = makeAnonLabel();
+  std::string eLabel = makeAnonLabel();
+
+  bool useSimd = printSimdSumsStart(stmt);
+  *this << "size_t " << bLabel << ", " << eLabel << ";" << nl
+        << "while (spatial_grid_next_row(&" << itLabel << ", &" << bLabel
+        << ", &" << eLabel << ")) {" << indent << nl;
+  if (useSimd) {
+    printSimdPragma(stmt);
+  }
+  *this << "for (size_t " << iLabel << " = " << bLabel << "; " << iLabel
+        << " < " << eLabel << "; " << iLabel << "++) {" << indent << nl
+        << "const " << viewName << "_neighbor *" << *stmt.var
+        << " = DYN_ARRAY_GET(&" << viewName << "_neighbors, " << viewName
+        << "_neighbor, " << iLabel << ");" << nl << "if (";
+  printWrapCallStart("dist", posMember->type->resolved);
+  *this << *stmt.var << "->" << posMember->name << ", "
+        << agentExpr << "->" << posMember->name;
+  printWrapCallEnd(posMember->type->resolved);
+  *this << " > " << rLabel << ") continue;" << nl
+        << *stmt.stmt << outdent << nl << "}" << outdent << nl << "}";
+
+  if (useSimd) {
+    printSimdSumsEnd(stmt);
+  }
+}
+
+// Number of cells that stencils reach beyond the current one along each axis
+static long getLatticePad(const AST::Script &script) {
+  return (long) std::floor(script.envDecl->maxNearRadius.asFloat());
+}
+
+// In a lattice environment the neighbors are the agents in a fixed stencil of
+// cells around the current agent. The stencil only depends on the radius, so
+// its offsets into the padded lattice are computed at compile time.
+void CPrinter::printLatticeLoop(const AST::ForStatement &stmt) {
+  const AST::Expression &agentExpr = stmt.getNearAgent();
+  const AST::AgentDeclaration *agentDecl = stmt.type->resolved.getAgentDecl();
+  const AST::AgentMember *posMember = agentDecl->getPositionMember();
+  const Type &posType = posMember->type->resolved;
+
+  Value::Vec3 size = script.envDecl->envSize.extendToVec3().getVec3();
+  long pad = getLatticePad(script);
+  long strideY = (long) size.x + 2 * pad;
+  long strideZ = strideY * ((long) size.y + 2 * pad);
+  double radius = stmt.nearRadius.asFloat();
+  long reach = (long) std::floor(radius);
+  long reachZ = posType.isVec3() ? reach : 0;
+  std::vector<long> offsets;
+  for (long dz = -reachZ; dz <= reachZ; dz++) {
+    for (long dy = -reach; dy <= reach; dy++) {
+      for (long dx = -reach; dx <= reach; dx++) {
+        if (std::sqrt((double) (dx * dx + dy * dy + dz * dz)) <= radius) {
+          offsets.push_back(dx + dy * strideY + dz * strideZ);
+        }
+      }
+    }
+  }
+  if (offsets.empty()) {
+    // Negative radius
+    *this << "{}";
+    return;
+  }
+
+  std::string gridName = "agents_" + agentDecl->name + "_grid";
+  std::string cLabel = makeAnonLabel();
+  std::string offLabel = makeAnonLabel();
+  std::string kLabel = makeAnonLabel();
+  std::string iLabel = makeAnonLabel();
+  *this << "{" << indent << nl
+        << "size_t " << cLabel << " = spatial_lattice_cell_" << posType << "(&"
+        << gridName << ", " << agentExpr << "->" << posMember->name << ");" << nl
+        << "static const ptrdiff_t " << offLabel << "[] = { ";
+  printCommaSeparated(offsets, [&](long offset) {
+    *this << offset;
+  });
+  *this << " };" << nl;
+
+  bool useSimd = printSimdSumsStart(stmt);
+  if (useSimd) {
+    printSimdPragma(stmt);
+  }
+  *this << "for (size_t " << kLabel << " = 0; " << kLabel << " < " << offsets.size()
+        << "; " << kLabel << "++) {" << indent << nl
+        << "size_t " << iLabel << " = " << gridName << ".lattice[" << cLabel << " + "
+        << offLabel << "[" << kLabel << "]];" << nl
+        << "if (" << iLabel << " == LATTICE_EMPTY) continue;" << nl;
+  printNearNeighbor(stmt, iLabel, "");
+  *this << outdent << nl << "}";
+  if (useSimd) {
+    printSimdSumsEnd(stmt);
+  }
+  *this << outdent << nl << "}";
+}
+
+// The closest agents are collected into a heap, which is sorted by distance,
+// and then visited nearest first. Nested loops use the per-thread heap of
+// their depth, as k may be large.
+void CPrinter::printNearestLoop(const AST::ForStatement &stmt) {
+  const AST::Expression &agentExpr = stmt.getNearAgent();
+  const AST::AgentDeclaration *agentDecl = stmt.type->resolved.getAgentDecl();
+  const AST::AgentMember *posMember = agentDecl->getPositionMember();
+
+  std::string kLabel = makeAnonLabel();
+  std::string heapLabel = makeAnonLabel();
+  std::string nLabel = makeAnonLabel();
+  std::string jLabel = makeAnonLabel();
+  std::string iLabel = makeAnonLabel();
+  *this << "{" << indent << nl
+        << "int " << kLabel << " = " << stmt.getNearestCount() << ";" << nl
+        << "spatial_neighbor *" << heapLabel << " = spatial_nearest_heap("
+        << nearestDepth << ", " << kLabel << ", agents.agents_" << agentDecl->name
+        << ".len);" << nl
+        << "size_t " << nLabel << " = spatial_grid_nearest_" << posMember->type->resolved
+        << "(&agents_" << agentDecl->name << "_grid, " << agentExpr << "->"
+        << posMember->name << ", " << kLabel << ", ";
+  printPositionArgs(*agentDecl);
+  *this << ", " << heapLabel << ");" << nl
+        << "for (size_t " << jLabel << " = 0; " << jLabel << " < " << nLabel << "; "
+        << jLabel << "++) {" << indent << nl
+        << "size_t " << iLabel << " = " << heapLabel << "[" << jLabel << "].id;" << nl;
+  nearestDepth++;
+  printNearNeighbor(stmt, iLabel, "");
+  nearestDepth--;
+  *this << outdent << nl << "}" << outdent << nl << "}";
+}
+
+void CPrinter::collectSimdNearLoops(AST::FunctionDeclaration &stepFunc) {
+  NearLoopCollector collector;
+  stepFunc.accept(collector);
+  for (AST::ForStatement *loop : collector.loops) {
+    SimdBodyChecker simdChecker;
+    loop->stmt->accept(simdChecker);
+    if (simdChecker.isVectorizable()) {
+      simdNearLoops[loop] = simdChecker.sums;
+    }
+  }
+}
+
+// Whether all for-near loops of a step function query the neighbors of the
+// current agent, which can then be taken from a per-agent list
+static bool queriesOwnNeighbors(AST::FunctionDeclaration &stepFunc) {
+  NearLoopCollector collector;
+  stepFunc.accept(collector);
+  VarId inVar = (*stepFunc.params)[0]->var->id;
+  for (const AST::ForStatement *loop : collector.loops) {
+    const auto *varExpr = dynamic_cast<const AST::VarExpression *>(&loop->getNearAgent());
+    if (!varExpr || varExpr->var->id != inVar) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void CPrinter::printNeighborView(const AST::FunctionDeclaration &stepFunc) {
+  const AST::AgentDeclaration &agent = *stepFunc.accessedAgent;
+  *this << "typedef struct {" << indent;
+  for (const AST::AgentMemberPtr &member : *agent.members) {
+    if (member->isPosition || stepFunc.accessedMembers.count(member->name)) {
+      *this << nl << *member;
+    }
+  }
+  *this << outdent << nl << "} " << stepFunc.name << "_neighbor;" << nl
+        << "dyn_array " << stepFunc.name << "_neighbors;" << nl;
+}
+
+void CPrinter::printNeighborViewPack(const AST::FunctionDeclaration &stepFunc) {
+  const AST::AgentDeclaration &agent = *stepFunc.accessedAgent;
+  std::string kLabel = makeAnonLabel();
+  std::string idLabel = makeAnonLabel();
+  std::string viewLabel = makeAnonLabel();
+  *this << nl << "#pragma omp for" << nl
+        << "for (size_t " << kLabel << " = 0; " << kLabel << " < agents.agents_"
+        << agent.name << ".len; " << kLabel << "++) {" << indent << nl
+        << "size_t " << idLabel << " = agents_" << agent.name << "_grid.ids["
+        << kLabel << "];" << nl
+        << stepFunc.name << "_neighbor *" << viewLabel << " = DYN_ARRAY_GET(&"
+        << stepFunc.name << "_neighbors, " << stepFunc.name << "_neighbor, "
+        << kLabel << ");";
+  for (const AST::AgentMemberPtr &member : *agent.members) {
+    if (!member->isPosition && !stepFunc.accessedMembers.count(member->name)) {
+      continue;
+    }
+    *this << nl << viewLabel << "->" << member->name << " = ";
+    if (params.soaLayout) {
+      *this << "agents.agents_" << agent.name << "." << member->name
+            << "[" << idLabel << "];";
+    } else {
+      *this << "DYN_ARRAY_GET(&agents.agents_" << agent.name << ", " << agent.name
+            << ", " << idLabel << ")->" << member->name << ";";
+    }
+  }
+  *this << outdent << nl << "}";
+}
+
+// Start, number and stride of the positions of an agent type
+void CPrinter::printPositionArgs(const AST::AgentDeclaration &agent) {
+  AST::AgentMember *posMember = agent.getPositionMember();
+  if (params.soaLayout) {
+    *this << "agents.agents_" << agent.name << "." << posMember->name << ", "
+          << "agents.agents_" << agent.name << ".len, "
+          << "sizeof(" << posMember->type->resolved << ")";
+  } else {
+    *this << "(char *) agents.agents_" << agent.name << ".values + "
+          << "offsetof(" << agent.name << ", " << posMember->name << "), "
+          << "agents.agents_" << agent.name << ".len, "
+          << "sizeof(" << agent.name << ")";
+  }
+}
+
+// Calls a dist() or displacement() helper on two positions. In a wrapping
+// environment these are measured to the closest image of the second position.
+void CPrinter::printWrapCallStart(const std::string &name, const Type &posType) {
+  bool wrap = script.envDecl && script.envDecl->envWrap;
+  *this << name << (wrap ? "_wrap_" : "_") << posType << "(";
+}
+
+void CPrinter::printWrapCallEnd(const Type &posType) {
+  if (script.envDecl && script.envDecl->envWrap) {
+    Value::Vec3 size = script.envDecl->envSize.extendToVec3().getVec3();
+    if (posType.isVec2()) {
+      *this << ", float2_create(" << size.x << ", " << size.y << ")";
+    } else {
+      *this << ", float3_create(" << size.x << ", " << size.y << ", " << size.z << ")";
+    }
+  }
+  *this << ")";
+}
+
+// Rebuilds the spatial grid of an agent type if it is out of date
+void CPrinter::printGridBuild(const AST::AgentDeclaration &agent) {
+  *this << nl << "if (!agents_" << agent.name << "_grid.valid) {" << indent << nl
+        << "spatial_grid_build(&agents_" << agent.name << "_grid, ";
+  printPositionArgs(agent);
+  *this << ", " << (agent.getPositionMember()->type->resolved.isVec3() ? "true" : "false")
+        << ");" << outdent << nl << "}";
+}
+
+// Rebuilds the Verlet list of a step function once the agents moved too far.
+// The grid is only needed for the rebuild.
+void CPrinter::printVerletUpdate(const AST::FunctionDeclaration &stepFunc) {
+  const AST::AgentDeclaration &agent = *(*stepFunc.params)[0]->type->resolved.getAgentDecl();
+  const AST::AgentDeclaration &nearAgent = *stepFunc.accessedAgent;
+  const char *is3d = nearAgent.getPositionMember()->type->resolved.isVec3() ? "true" : "false";
+  *this << nl << "if (verlet_list_stale(&" << stepFunc.name << "_verlet, "
+        << params.verletSkin << ", ";
+  printPositionArgs(agent);
+  *this << ", ";
+  printPositionArgs(nearAgent);
+  *this << ", " << is3d << ")) {" << indent;
+  printGridBuild(nearAgent);
+  *this << nl << "verlet_list_build(&" << stepFunc.name << "_verlet, &agents_"
+        << nearAgent.name << "_grid, "
+        << script.envDecl->maxNearRadius.asFloat() + params.verletSkin << ", ";
+  printPositionArgs(agent);
+  *this << ", ";
+  printPositionArgs(nearAgent);
+  *this << ", " << is3d << ");" << outdent << nl << "}";
+}
+
+static bool isVerletListOf(
+    const AST::FunctionDeclaration &func, const AST::AgentDeclaration &agent) {
+  return (*func.params)[0]->type->resolved.getAgentDecl() == &agent
+      || func.accessedAgent == &agent;
+}
+
+// Whether the step function gets the index of its agent as the _index parameter
+bool CPrinter::usesAgentIndex(const AST::FunctionDeclaration &stepFunc) const {
+  return verletFuncs.count(&stepFunc) || stepFunc.usesLinks || stepFunc.usesInbox
+    || !stepFunc.sentMessages.empty();
+}
+
+bool CPrinter::usesVerletList(const AST::AgentDeclaration &agent) const {
+  for (const AST::FunctionDeclaration *func : verletFuncs) {
+    if (isVerletListOf(*func, agent)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Verlet lists refer to agents by index, so they are rebuilt once the
+// agents of the given type were removed or reordered
+void CPrinter::printVerletInvalidation(const AST::AgentDeclaration &agent) {
+  for (const AST::FunctionDeclaration *func : verletFuncs) {
+    if (isVerletListOf(*func, agent)) {
+      *this << nl << func->name << "_verlet.valid = false;";
+    }
+  }
+}
+
+// Steps with an activity guard only run on the agents for which it holds. The
+// others keep their state, so the output buffer is copied back for the active
+// agents instead of swapping the buffers. Compaction on removal needs the
+// output of every agent, so such steps always visit all agents.
+bool CPrinter::isSparseStep(const AST::FunctionDeclaration &stepFunc) const {
+  return stepFunc.activeGuard && !stepFunc.usesRuntimeRemoval;
+}
+
+// Agent types that are periodically sorted into grid cell order
+std::vector<const AST::AgentDeclaration *> CPrinter::getReorderedAgents() const {
+  if (params.reorderInterval <= 0) {
+    return {};
+  }
+  return getIndexedAgents(script);
+}
+
+// The runtime type information is only printed if it is used, which avoids
+// unused variable warnings in the generated code
+bool CPrinter::usesAgentsInfo() const {
+  return script.usesSave || script.usesLoad
+    || (script.simStmt && script.simStmt->outputExpr);
+}
+
+bool CPrinter::usesTypeInfo(const AST::AgentDeclaration &agent) const {
+  if (params.soaLayout || usesAgentsInfo()) {
+    return true;
+  }
+  for (const AST::FunctionDeclaration *func : script.funcs) {
+    if (func->runtimeAddedAgent == &agent) {
+      return true;
+    }
+  }
+  for (const AST::AgentDeclaration *reordered : getReorderedAgents()) {
+    if (reordered == &agent) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Puts the agents back into creation order before they are written out
+void CPrinter::printOrderRestore(const AST::AgentDeclaration &agent) {
+  *this << nl << "agent_order_restore(&agents_" << agent.name << "_order, &agents.agents_"
+        << agent.name << ", &agents.agents_" << agent.name << "_dbuf, " << agent.name
+        << "_info, " << (params.soaLayout ? "LAYOUT_SOA" : "LAYOUT_AOS") << ");"
+        << nl << "agents_" << agent.name << "_grid.valid = false;";
+}
+
+void CPrinter::printStepLoop(
+    const AST::FunctionDeclaration &stepFunc, size_t stepIndex, const std::string &tLabel) {
+  const AST::Param &param = *(*stepFunc.params)[0];
+  Type type = param.type->resolved;
+
+  std::ostringstream s;
+  s << "agents.agents_" << type;
+  std::string bufName = s.str();
+  s << "_dbuf";
+  std::string dbufName = s.str();
+
+  std::string iLabel = makeAnonLabel();
+  std::string inLabel = makeAnonLabel();
+  std::string outLabel = makeAnonLabel();
+
+  // Each agent gets its own random stream, independent of the thread it runs on
+  std::string rngBegin;
+  if (stepFunc.usesRng) {
+    rngBegin = "random_begin_agent(" + std::to_string(stepIndex) + ", "
+             + tLabel + ", " + iLabel + ");";
+  }
+
+  AST::AgentDeclaration *agent = type.getAgentDecl();
+  const AST::AgentDeclaration *nearAgent = stepFunc.accessedAgent;
+  if (nearAgent && params.mpi) {
+    // Neighbors owned by other ranks are appended as ghosts for this step
+    *this << nl << "#pragma omp single" << nl << "{" << indent << nl
+          << "agents_" << nearAgent->name << "_ghosts = mpi_exchange_halo(&openabl_domain, "
+          << "&agents.agents_" << nearAgent->name << ", sizeof(" << nearAgent->name << "), "
+          << "offsetof(" << nearAgent->name << ", "
+          << nearAgent->getPositionMember()->name << "));" << nl
+          << "agents_" << nearAgent->name << "_grid.valid = false;"
+          << outdent << nl << "}";
+  }
+  bool useVerlet = verletFuncs.count(&stepFunc);
+  if (useVerlet) {
+    printVerletUpdate(stepFunc);
+  } else if (nearAgent) {
+    printGridBuild(*nearAgent);
+  }
+
+  const AST::AgentDeclaration *addedAgent = stepFunc.runtimeAddedAgent;
+  bool usesRemoval = stepFunc.usesRuntimeRemoval;
+  std::string removedLabel = makeAnonLabel();
+
+  // Ghosts are only visible to near() loops, they are not stepped
+  bool hasGhosts = params.mpi && nearAgent == agent;
+  std::string lenExpr = hasGhosts
+    ? "(" + bufName + ".len - agents_" + agent->name + "_ghosts)"
+    : bufName + ".len";
+
+  // Staged agents are appended in thread order, which must be agent order
+  Params::Schedule schedule = addedAgent ? Params::Schedule::STATIC : params.schedule;
+  std::string chunkSize = "schedule_chunk_size("
+    + (nearAgent ? "&agents_" + nearAgent->name + "_grid" : std::string("NULL"))
+    + ", " + lenExpr + ")";
 
-    *this << nl << "if (!" << dbufName << ".values) {" << indent
-          << nl << dbufName << " = DYN_ARRAY_COPY_FIXED(" << type
-          << ", &" << bufName << ");"
+  *this << nl << "#pragma omp single" << nl << "{" << indent;
+  if (params.soaLayout) {
+    *this << nl << "soa_array_ensure((soa_array *) &" << dbufName << ", "
+          << agent->name << "_info, " << lenExpr << ");";
+  } else {
+    *this << nl << "DYN_ARRAY_ENSURE(&" << dbufName << ", " << agent->name
+          << ", " << lenExpr << ");";
+  }
+  if (usesRemoval) {
+    *this << nl << "DYN_ARRAY_ENSURE(&agents_" << agent->name << "_removed, bool, "
+          << lenExpr << ");";
+  }
+  // If few agents were active in the last run of the step, only the active
+  // agents are visited, in index order. The others keep their state, so the
+  // outputs of the active agents are copied back instead of swapping the
+  // buffers. Otherwise all agents are visited, which saves finding them. With
+  // AoS, finding the active agents reads all of them, so it only pays off if
+  // far fewer are active.
+  bool sparse = sparseFuncs.count(&stepFunc);
+  int denseDivisor = params.soaLayout ? 2 : 16;
+  std::string denseName = stepFunc.name + "_dense";
+  std::string numActiveName = stepFunc.name + "_num_active";
+  if (sparse) {
+    *this << nl << "DYN_ARRAY_ENSURE(&" << stepFunc.name << "_skipped, bool, "
+          << lenExpr << ");"
+          << nl << denseName << " = " << numActiveName << " > " << lenExpr << " / " << denseDivisor << ";"
+          << nl << numActiveName << " = 0;";
+  }
+  if (schedule == Params::Schedule::STEAL && !sparse) {
+    *this << nl << "work_queue_reset(openabl_work_queue, " << lenExpr << ", "
+          << chunkSize << ");";
+  }
+  bool useView = neighborViewFuncs.count(&stepFunc);
+  if (useView) {
+    *this << nl << "DYN_ARRAY_ENSURE(&" << stepFunc.name << "_neighbors, " << stepFunc.name
+          << "_neighbor, agents.agents_" << nearAgent->name << ".len);";
+  }
+  *this << outdent << nl << "}";
+  if (useView) {
+    printNeighborViewPack(stepFunc);
+  }
+
+  std::string activeIdsName = stepFunc.name + "_active_ids";
+  std::string skippedName = stepFunc.name + "_skipped";
+  std::string numVisitedLabel = makeAnonLabel();
+  std::string countLabel = makeAnonLabel();
+  if (sparse) {
+    *this << nl << "size_t " << numVisitedLabel << " = " << lenExpr << ";"
+          << nl << "if (!" << denseName << ") {" << indent << nl
+          << "#pragma omp for" << nl
+          << "for (size_t " << iLabel << " = 0; " << iLabel << " < " << lenExpr << "; "
+          << iLabel << "++) {" << indent << nl;
+    if (params.soaLayout) {
+      *this << agent->name << " " << inLabel << ";" << nl
+            << agent->name << "_soa_load(&" << inLabel << ", &" << bufName
+            << ", " << iLabel << ");" << nl
+            << "*DYN_ARRAY_GET(&" << skippedName << ", bool, " << iLabel << ") = !"
+            << stepFunc.name << "_is_active(&" << inLabel << ");";
+    } else {
+      *this << "*DYN_ARRAY_GET(&" << skippedName << ", bool, " << iLabel << ") = !"
+            << stepFunc.name << "_is_active(DYN_ARRAY_GET(&" << bufName << ", "
+            << agent->name << ", " << iLabel << "));";
+    }
+    *this << outdent << nl << "}" << nl
+          << numVisitedLabel << " = dyn_array_compact_indices(&" << activeIdsName
+          << ", " << skippedName << ".values, " << lenExpr << ");"
           << outdent << nl << "}" << nl
-          << "#pragma omp parallel for" << nl
-          << "for (size_t " << iLabel << " = 0; "
-          << iLabel << " < " << bufName << ".len; "
-          << iLabel << "++) {" << indent << nl
-          << type << " *" << inLabel
-          << " = DYN_ARRAY_GET(&" << bufName << ", " << type
+          << "size_t " << countLabel << " = 0;";
+    lenExpr = numVisitedLabel;
+    chunkSize = "schedule_chunk_size("
+      + (nearAgent ? "&agents_" + nearAgent->name + "_grid" : std::string("NULL"))
+      + ", " + lenExpr + ")";
+    if (schedule == Params::Schedule::STEAL) {
+      *this << nl << "#pragma omp single" << nl
+            << "work_queue_reset(openabl_work_queue, " << lenExpr << ", " << chunkSize << ");";
+    }
+  }
+
+  // Steps that only touch their own agent have independent iterations over
+  // contiguous member arrays, which the compiler may vectorize
+  bool independent = !sparse && !nearAgent && !stepFunc.usesRng && !usesRemoval && !addedAgent
+    && stepFunc.depositedFields.empty() && !stepFunc.usesLinks
+    && stepFunc.sentMessages.empty() && !stepFunc.usesInbox;
+  std::string beginLabel = makeAnonLabel();
+  std::string endLabel = makeAnonLabel();
+  if (schedule == Params::Schedule::STEAL) {
+    *this << nl << "size_t " << beginLabel << ", " << endLabel << ";" << nl
+          << "while (work_queue_next(openabl_work_queue, &" << beginLabel
+          << ", &" << endLabel << ")) {" << indent;
+    if (params.soaLayout && independent) {
+      *this << nl << "#pragma omp simd";
+    }
+  } else {
+    *this << nl << "#pragma omp for";
+    if (params.soaLayout && independent) {
+      *this << " simd";
+    }
+    if (schedule == Params::Schedule::DYNAMIC) {
+      *this << " schedule(dynamic, " << chunkSize << ")";
+    } else if (addedAgent) {
+      *this << " schedule(static)";
+    }
+    beginLabel = "0";
+    endLabel = lenExpr;
+  }
+  std::string loopLabel = sparse ? makeAnonLabel() : iLabel;
+  *this << nl << "for (size_t " << loopLabel << " = " << beginLabel << "; "
+        << loopLabel << " < " << endLabel << "; "
+        << loopLabel << "++) {" << indent << nl;
+  if (sparse) {
+    *this << "size_t " << iLabel << " = " << denseName << " ? " << loopLabel
+          << " : *DYN_ARRAY_GET(&" << activeIdsName << ", size_t, " << loopLabel << ");" << nl;
+  }
+  if (params.soaLayout) {
+    *this << agent->name << " " << inLabel << ";" << nl
+          << agent->name << "_soa_load(&" << inLabel << ", &" << bufName
+          << ", " << iLabel << ");" << nl
+          << agent->name << " " << outLabel << " = " << inLabel << ";" << nl;
+  } else {
+    *this << agent->name << " *" << inLabel
+          << " = DYN_ARRAY_GET(&" << bufName << ", " << agent->name
           << ", " << iLabel << ");" << nl
-          << type << " *" << outLabel
-          << " = DYN_ARRAY_GET(&" << dbufName << ", " << type
+          << agent->name << " *" << outLabel
+          << " = DYN_ARRAY_GET(&" << dbufName << ", " << agent->name
           << ", " << iLabel << ");" << nl
-          << stepFunc->name << "(" << inLabel << ", "
-          << outLabel << ");" << outdent << nl << "}" << nl
-          << "tmp = " << bufName << ";" << nl
-          << bufName << " = " << dbufName << ";" << nl
-          << dbufName << " = tmp;";
+          << "*" << outLabel << " = *" << inLabel << ";" << nl;
+  }
+  if (usesRemoval) {
+    *this << "bool *" << removedLabel << " = DYN_ARRAY_GET(&agents_" << agent->name
+          << "_removed, bool, " << iLabel << ");" << nl
+          << "*" << removedLabel << " = false;" << nl;
+  }
+  if (stepFunc.usesRng) {
+    *this << rngBegin << nl;
+  }
+  if (!stepFunc.depositedFields.empty()) {
+    *this << "field_begin_agent(" << iLabel << ");" << nl;
+  }
+
+  const char *ref = params.soaLayout ? "&" : "";
+  if (sparse) {
+    *this << countLabel << " += " << stepFunc.name << "_is_active(" << ref << inLabel << ");"
+          << nl;
+  }
+  *this << stepFunc.name << "(" << ref << inLabel << ", " << ref << outLabel;
+  if (usesRemoval) {
+    *this << ", " << removedLabel;
+  }
+  if (usesAgentIndex(stepFunc)) {
+    *this << ", " << iLabel;
+  }
+  *this << ");";
+  if (params.soaLayout) {
+    *this << nl << agent->name << "_soa_store(&" << dbufName << ", " << iLabel
+          << ", &" << outLabel << ");";
+  }
+  *this << outdent << nl << "}";
+  if (schedule == Params::Schedule::STEAL) {
+    *this << outdent << nl << "}" << nl << "#pragma omp barrier";
+  }
+  if (sparse) {
+    std::string kLabel = makeAnonLabel();
+    *this << nl << "#pragma omp atomic" << nl << numActiveName << " += " << countLabel << ";"
+          << nl << "if (!" << denseName << ") {" << indent << nl
+          << "#pragma omp for" << nl
+          << "for (size_t " << kLabel << " = 0; " << kLabel << " < " << lenExpr << "; "
+          << kLabel << "++) {" << indent << nl
+          << "size_t " << iLabel << " = *DYN_ARRAY_GET(&" << activeIdsName << ", size_t, "
+          << kLabel << ");";
+    printAgentCopy(*agent, bufName, dbufName, iLabel);
+    *this << outdent << nl << "}" << outdent << nl << "}";
+  }
+  if (stepFunc.usesRng) {
+    *this << nl << "random_end_agents();";
+  }
+  printFieldFlush(stepFunc.depositedFields);
+  if (stepFunc.rewiresLinks) {
+    *this << nl << "link_graph_commit(&agents_" << agent->name << "_links);";
+  }
+  for (const auto &message : stepFunc.sentMessages) {
+    *this << nl << "inbox_deliver(&" << getInboxName(*message.first, message.second) << ");";
+  }
+
+  std::string bufType = params.soaLayout ? agent->name + "_soa" : "dyn_array";
+  std::string compactedLabel = makeAnonLabel();
+  if (usesRemoval) {
+    // Compact the surviving agents into the old input buffer, instead of swapping
+    *this << nl << "bool " << compactedLabel << " = ";
+    if (params.soaLayout) {
+      *this << "soa_array_compact((soa_array *) &" << bufName << ", (soa_array *) &"
+            << dbufName << ", agents_" << agent->name << "_removed.values, "
+            << agent->name << "_info);";
+    } else {
+      *this << "dyn_array_compact(&" << bufName << ", &" << dbufName << ", "
+            << "agents_" << agent->name << "_removed.values, sizeof("
+            << agent->name << "));";
+    }
+    if (params.reorderInterval > 0 && isIndexedAgent(script, *agent)) {
+      *this << nl << "agent_order_compact(&agents_" << agent->name << "_order, agents_"
+            << agent->name << "_removed.values);";
+    }
+  }
+
+  *this << nl << "#pragma omp single" << nl << "{" << indent;
+  if (usesRemoval) {
+    *this << nl << "if (!" << compactedLabel << ") {" << indent;
+  }
+  if (sparse) {
+    *this << nl << "if (" << denseName << ") {" << indent;
+  }
+  *this << nl << bufType << " tmp = " << bufName << ";"
+        << nl << bufName << " = " << dbufName << ";"
+        << nl << dbufName << " = tmp;";
+  if (sparse) {
+    *this << outdent << nl << "}";
+  }
+  if (usesRemoval) {
+    *this << outdent << nl << "}";
+    if (usesVerletList(*agent)) {
+      *this << " else {" << indent;
+      printVerletInvalidation(*agent);
+      *this << outdent << nl << "}";
+    }
+  }
+
+  if (nearAgent && params.mpi) {
+    // Swapping drops the ghosts appended to the stepped agents
+    if (!hasGhosts) {
+      *this << nl << "agents.agents_" << nearAgent->name << ".len -= agents_"
+            << nearAgent->name << "_ghosts;";
+    } else if (sparse) {
+      *this << nl << "if (!" << denseName << ") {" << indent
+            << nl << "agents.agents_" << nearAgent->name << ".len -= agents_"
+            << nearAgent->name << "_ghosts;" << outdent << nl << "}";
+    }
+    *this << nl << "agents_" << nearAgent->name << "_ghosts = 0;";
   }
 
+  if (addedAgent) {
+    *this << nl << "agent_staging_flush(&agents_" << addedAgent->name << "_added, "
+          << "&agents.agents_" << addedAgent->name << ", " << addedAgent->name << "_info, "
+          << (params.soaLayout ? "LAYOUT_SOA" : "LAYOUT_AOS") << ");";
+    if (params.reorderInterval > 0 && isIndexedAgent(script, *addedAgent)) {
+      *this << nl << "agent_order_extend(&agents_" << addedAgent->name << "_order, "
+            << "agents.agents_" << addedAgent->name << ".len);";
+    }
+  }
+  if (params.mpi) {
+    // Agents that moved to or were added in the slab of another rank
+    printMigrate(*agent);
+    if (addedAgent && addedAgent != agent) {
+      printMigrate(*addedAgent);
+    }
+  }
+  if (isIndexedAgent(script, *agent)) {
+    *this << nl << "agents_" << agent->name << "_grid.valid = false;";
+  }
+  if (addedAgent && addedAgent != agent && isIndexedAgent(script, *addedAgent)) {
+    *this << nl << "agents_" << addedAgent->name << "_grid.valid = false;";
+  }
+  if (nearAgent && params.mpi && nearAgent != agent && nearAgent != addedAgent) {
+    *this << nl << "agents_" << nearAgent->name << "_grid.valid = false;";
+  }
   *this << outdent << nl << "}";
+}
+
+// Makes the deposits into the given fields visible, called by all threads
+void CPrinter::printFieldFlush(const std::set<std::string> &fields) {
+  for (const std::string &name : fields) {
+    *this << nl << "field_flush(&openabl_field_" << name << ");";
+  }
+}
+
+// Copies the agent at index iLabel from one agent array to another
+void CPrinter::printAgentCopy(const AST::AgentDeclaration &agent, const std::string &dst,
+                              const std::string &src, const std::string &iLabel) {
+  if (params.soaLayout) {
+    std::string tmpLabel = makeAnonLabel();
+    *this << nl << agent.name << " " << tmpLabel << ";"
+          << nl << agent.name << "_soa_load(&" << tmpLabel << ", &" << src << ", "
+          << iLabel << ");"
+          << nl << agent.name << "_soa_store(&" << dst << ", " << iLabel << ", &"
+          << tmpLabel << ");";
+  } else {
+    *this << nl << "*DYN_ARRAY_GET(&" << dst << ", " << agent.name << ", " << iLabel
+          << ") = *DYN_ARRAY_GET(&" << src << ", " << agent.name << ", " << iLabel << ");";
+  }
+}
+
+void CPrinter::printMigrate(const AST::AgentDeclaration &agent) {
+  *this << nl << "mpi_migrate(&openabl_domain, &agents.agents_" << agent.name << ", sizeof("
+        << agent.name << "), offsetof(" << agent.name << ", "
+        << agent.getPositionMember()->name << "));";
+}
+
+void CPrinter::print(const AST::SimulateStatement &stmt) {
+  const AST::EnvironmentDeclaration *envDecl = script.envDecl;
+  for (const AST::AgentDeclaration *agent : getIndexedAgents(script)) {
+    Value::Vec3 envMin = envDecl->envMin.extendToVec3().getVec3();
+    Value::Vec3 envSize = envDecl->envSize.extendToVec3().getVec3();
+    *this << "spatial_grid_init(&agents_" << agent->name << "_grid, "
+          << "float3_create(" << envMin.x << ", " << envMin.y << ", " << envMin.z << "), "
+          << "float3_create(" << envSize.x << ", " << envSize.y << ", " << envSize.z << "), "
+          << (envDecl->envLattice ? 1.0 : envDecl->envGranularity.asFloat()) << ", "
+          << getSpatialIndexKind(script, params, *agent) << ", "
+          << (envDecl->envWrap ? "true" : "false") << ");" << nl;
+    if (envDecl->envLattice) {
+      *this << "spatial_grid_init_lattice(&agents_" << agent->name << "_grid, "
+            << getLatticePad(script) << ", "
+            << (agent->getPositionMember()->type->resolved.isVec3() ? "true" : "false")
+            << ");" << nl;
+    }
+  }
+  for (const AST::AgentDeclaration *agent : getRuntimeAddedAgents(script)) {
+    *this << "agent_staging_init(&agents_" << agent->name << "_added);" << nl;
+  }
+  for (const AST::AgentDeclaration *agent : script.agents) {
+    if (agent->hasLinks) {
+      *this << "link_graph_build(&agents_" << agent->name << "_links, agents.agents_"
+            << agent->name << ".len);" << nl;
+    }
+    for (Type msgType : agent->inboxTypes) {
+      *this << "inbox_init(&" << getInboxName(*agent, msgType) << ", sizeof(";
+      printStorageType(*this, msgType);
+      *this << "), agents.agents_" << agent->name << ".len);" << nl;
+    }
+  }
+  if (script.usesLogging) {
+    if (params.mpi) {
+      *this << "log_writer_open(&openabl_log_file, mpi_output_path(\"log.csv\"));" << nl;
+    } else {
+      *this << "log_writer_open(&openabl_log_file, \"log.csv\");" << nl;
+    }
+  }
+
+  std::string timeLabel = makeAnonLabel();
+  if (script.usesTiming) {
+    *this << "double " << timeLabel << " = time_now();" << nl;
+  }
+
+  std::string writerLabel = makeAnonLabel();
+  std::string intervalLabel = makeAnonLabel();
+  if (stmt.outputExpr) {
+    *this << "int " << intervalLabel << " = " << *stmt.outputIntervalExpr << ";" << nl
+          << "async_writer *" << writerLabel
+          << " = async_writer_create(agents_info, sizeof(agents));" << nl;
+  }
+
+  if (params.schedule == Params::Schedule::STEAL) {
+    *this << "openabl_work_queue = work_queue_create();" << nl;
+  }
+  for (const AST::AgentDeclaration *agent : getReorderedAgents()) {
+    *this << "agent_order_init(&agents_" << agent->name << "_order, agents.agents_"
+          << agent->name << ".len);" << nl;
+  }
+  if (params.mpi) {
+    // Every rank continues with the agents in its own slab
+    *this << "mpi_domain_init(&openabl_domain, " << envDecl->envMin.extendToVec3().getVec3().x
+          << ", " << envDecl->envSize.extendToVec3().getVec3().x << ", "
+          << envDecl->maxNearRadius.asFloat() << ");" << nl;
+    for (const AST::AgentDeclaration *agent : script.agents) {
+      *this << "mpi_keep_owned(&openabl_domain, &agents.agents_" << agent->name
+            << ", sizeof(" << agent->name << "), offsetof(" << agent->name << ", "
+            << agent->getPositionMember()->name << "));" << nl;
+    }
+  }
+
+  // Steps with an interval only run in every n-th timestep
+  std::vector<std::string> stepIntervalLabels;
+  for (const AST::Expression *intervalExpr : stmt.stepIntervalExprs) {
+    stepIntervalLabels.push_back(intervalExpr ? makeAnonLabel() : "");
+    if (intervalExpr) {
+      *this << "int " << stepIntervalLabels.back() << " = " << *intervalExpr << ";" << nl;
+    }
+  }
+  std::string seqIntervalLabel = makeAnonLabel();
+  if (stmt.seqStepIntervalExpr) {
+    *this << "int " << seqIntervalLabel << " = " << *stmt.seqStepIntervalExpr << ";" << nl;
+  }
+
+  // Deposits made during setup
+  for (const std::string &name : script.mainFunc->depositedFields) {
+    *this << "field_flush(&openabl_field_" << name << ");" << nl;
+  }
+
+  // The whole timestep loop runs in a single parallel region. Step loops are
+  // work-shared between the threads, everything else runs on one thread.
+  std::string tLabel = makeAnonLabel();
+  *this << "#pragma omp parallel" << nl << "{" << indent << nl
+        << "for (int " << tLabel << " = 0; "
+        << tLabel << " < " << *stmt.timestepsExpr << "; "
+        << tLabel << "++) {" << indent;
+
+  if (!getSnapshotCalls(script).empty()) {
+    // Parallel steps read the reductions over the state the timestep starts with
+    *this << nl << "openabl_snapshot_reduce();";
+  }
+  if (!getReorderedAgents().empty()) {
+    // Keep spatial neighbors adjacent in memory as the agents move around
+    *this << nl << "if (" << tLabel << " > 0 && " << tLabel << " % "
+          << params.reorderInterval << " == 0) {" << indent;
+    for (const AST::AgentDeclaration *agent : getReorderedAgents()) {
+      printGridBuild(*agent);
+      *this << nl << "agent_order_sort_cells(&agents_" << agent->name << "_order, &agents_"
+            << agent->name << "_grid, &agents.agents_" << agent->name
+            << ", &agents.agents_" << agent->name << "_dbuf, " << agent->name << "_info, "
+            << (params.soaLayout ? "LAYOUT_SOA" : "LAYOUT_AOS") << ");";
+    }
+    if (!verletFuncs.empty()) {
+      *this << nl << "#pragma omp single" << nl << "{" << indent;
+      for (const AST::AgentDeclaration *agent : getReorderedAgents()) {
+        printVerletInvalidation(*agent);
+      }
+      *this << outdent << nl << "}";
+    }
+    *this << outdent << nl << "}";
+  }
+
+  for (size_t i = 0; i < stmt.stepFuncDecls.size(); i++) {
+    // The condition is the same for all threads, so skipped steps don't
+    // leave work-sharing constructs unmatched
+    if (stmt.stepIntervalExprs[i]) {
+      *this << nl << "if (" << tLabel << " % " << stepIntervalLabels[i] << " == 0) {" << indent;
+    }
+    printStepLoop(*stmt.stepFuncDecls[i], i, tLabel);
+    if (stmt.stepIntervalExprs[i]) {
+      *this << outdent << nl << "}";
+    }
+  }
+
+  std::string seqCond = std::string("if (") + tLabel + " % " + seqIntervalLabel + " == 0) {";
+  if (stmt.seqStepDecl && !stmt.seqStepDecl->reductionCalls.empty()) {
+    if (stmt.seqStepIntervalExpr) {
+      *this << nl << seqCond << indent;
+    }
+    *this << nl << stmt.seqStepDecl->sig.name << "_reduce();";
+    if (stmt.seqStepIntervalExpr) {
+      *this << outdent << nl << "}";
+    }
+  }
+  bool hasSerialPart = script.usesTiming || stmt.seqStepDecl || stmt.outputExpr;
+  if (hasSerialPart) {
+    *this << nl << "#pragma omp single" << nl << "{" << indent;
+  }
+  if (script.usesTiming) {
+    std::string nowLabel = makeAnonLabel();
+    *this << nl << "double " << nowLabel << " = time_now();"
+          << nl << "openabl_last_exec_time = " << nowLabel << " - " << timeLabel << ";"
+          << nl << timeLabel << " = " << nowLabel << ";";
+  }
+  if (stmt.seqStepDecl) {
+    if (stmt.seqStepIntervalExpr) {
+      *this << nl << seqCond << indent;
+    }
+    *this << nl << stmt.seqStepDecl->sig.name << "();";
+    // The sequential step may have added agents
+    for (const AST::AgentDeclaration *agent : getReorderedAgents()) {
+      *this << nl << "agent_order_extend(&agents_" << agent->name << "_order, "
+            << "agents.agents_" << agent->name << ".len);";
+    }
+    if (stmt.seqStepIntervalExpr) {
+      *this << outdent << nl << "}";
+    }
+  }
+  if (stmt.outputExpr) {
+    // Formatting and I/O overlap with the following timesteps
+    const auto &call = static_cast<const AST::CallExpression &>(*stmt.outputExpr);
+    *this << nl << "if ((" << tLabel << " + 1) % " << intervalLabel << " == 0) {" << indent;
+    for (const AST::AgentDeclaration *agent : getReorderedAgents()) {
+      printOrderRestore(*agent);
+    }
+    *this << nl << "async_writer_save(" << writerLabel << ", &agents, "
+          << call.getArg(0) << ", " << tLabel << " + 1);"
+          << outdent << nl << "}";
+  }
+  if (hasSerialPart) {
+    *this << outdent << nl << "}";
+  }
+  if (stmt.seqStepDecl && !stmt.seqStepDecl->depositedFields.empty()) {
+    if (stmt.seqStepIntervalExpr) {
+      *this << nl << seqCond << indent;
+    }
+    printFieldFlush(stmt.seqStepDecl->depositedFields);
+    if (stmt.seqStepIntervalExpr) {
+      *this << outdent << nl << "}";
+    }
+  }
+  *this << outdent << nl << "}" << outdent << nl << "}";
+  for (const AST::AgentDeclaration *agent : getReorderedAgents()) {
+    printOrderRestore(*agent);
+    *this << nl << "agent_order_free(&agents_" << agent->name << "_order);";
+  }
+  for (const AST::FunctionDeclaration *func : verletFuncs) {
+    *this << nl << "verlet_list_free(&" << func->name << "_verlet);";
+  }
+  for (const AST::FunctionDeclaration *func : sparseFuncs) {
+    *this << nl << "dyn_array_clean(&" << func->name << "_skipped);"
+          << nl << "dyn_array_clean(&" << func->name << "_active_ids);";
+  }
+  if (params.schedule == Params::Schedule::STEAL) {
+    *this << nl << "work_queue_free(openabl_work_queue);";
+  }
+  if (params.mpi) {
+    for (const AST::AgentDeclaration *agent : script.agents) {
+      *this << nl << "mpi_gather(&openabl_domain, &agents.agents_" << agent->name
+            << ", sizeof(" << agent->name << "));";
+    }
+  }
+  if (stmt.outputExpr) {
+    *this << nl << "async_writer_free(" << writerLabel << ");";
+  }
+  for (const AST::AgentDeclaration *agent : getIndexedAgents(script)) {
+    *this << nl << "spatial_grid_free(&agents_" << agent->name << "_grid);";
+  }
+  for (const AST::AgentDeclaration *agent : getRuntimeAddedAgents(script)) {
+    *this << nl << "agent_staging_free(&agents_" << agent->name << "_added);";
+  }
+  for (const AST::AgentDeclaration *agent : script.agents) {
+    if (agent->hasLinks) {
+      *this << nl << "link_graph_free(&agents_" << agent->name << "_links);";
+    }
+    for (Type msgType : agent->inboxTypes) {
+      *this << nl << "inbox_free(&" << getInboxName(*agent, msgType) << ");";
+    }
+  }
+  if (script.usesLogging) {
+    *this << nl << "log_writer_close(&openabl_log_file);";
+  }
   // TODO Cleanup memory
 }
 
@@ -253,30 +1662,450 @@ void CPrinter::print(const AST::AgentDeclaration &decl) {
         << "} " << decl.name << ";" << nl;
 
   // Runtime type information
-  *this << "static const type_info " << decl.name << "_info[] = {" << indent << nl;
+  if (usesTypeInfo(decl)) {
+    *this << "static const type_info " << decl.name << "_info[] = {" << indent << nl;
+    for (AST::AgentMemberPtr &member : *decl.members) {
+      *this << "{ ";
+      printTypeIdentifier(*this, member->type->resolved);
+      *this << ", offsetof(" << decl.name << ", " << member->name
+            << "), \"" << member->name << "\", "
+            << (member->isPosition ? "true" : "false") << " }," << nl;
+    }
+    *this << "{ TYPE_END, sizeof(" << decl.name << "), NULL }" << outdent << nl << "};" << nl;
+  }
+
+  if (params.soaLayout) {
+    printSoaHelpers(decl);
+  }
+}
+
+void CPrinter::printSoaHelpers(const AST::AgentDeclaration &decl) {
+  // Member arrays, in the same order as the type_info entries (see soa_array)
+  *this << "typedef struct {" << indent << nl
+        << "size_t len;" << nl
+        << "size_t cap;";
+  for (AST::AgentMemberPtr &member : *decl.members) {
+    *this << nl << *member->type << " *" << member->name << ";";
+  }
+  *this << outdent << nl << "} " << decl.name << "_soa;" << nl;
+
+  *this << "static inline " << decl.name << " *" << decl.name << "_soa_load("
+        << decl.name << " *agent, const " << decl.name << "_soa *soa, size_t i) {" << indent;
+  for (AST::AgentMemberPtr &member : *decl.members) {
+    *this << nl << "agent->" << member->name << " = soa->" << member->name << "[i];";
+  }
+  *this << nl << "return agent;" << outdent << nl << "}" << nl;
+
+  *this << "static inline void " << decl.name << "_soa_store("
+        << decl.name << "_soa *soa, size_t i, const " << decl.name << " *agent) {" << indent;
   for (AST::AgentMemberPtr &member : *decl.members) {
-    *this << "{ ";
-    printTypeIdentifier(*this, member->type->resolved);
-    *this << ", offsetof(" << decl.name << ", " << member->name
-          << "), \"" << member->name << "\", "
-          << (member->isPosition ? "true" : "false") << " }," << nl;
+    *this << nl << "soa->" << member->name << "[i] = agent->" << member->name << ";";
+  }
+  *this << outdent << nl << "}" << nl;
+}
+
+static const char componentNames[] = "xyz";
+
+// Value an accumulator combined with op starts out with
+static const char *getReductionIdentity(const std::string &op, bool isFloat) {
+  if (op == "min") {
+    return isFloat ? "INFINITY" : "INT_MAX";
+  } else if (op == "max") {
+    return isFloat ? "-INFINITY" : "INT_MIN";
+  }
+  return "0";
+}
+
+// Prints a function that computes the given reductions, which all threads of
+// the team call. Snapshots are read by parallel steps, so even the agent
+// counts and vector sums are stored in globals, which only change when the
+// function is called again.
+void CPrinter::printReductions(
+    const std::string &funcName, const std::vector<AST::CallExpression *> &calls,
+    bool snapshot) {
+  struct Accumulator {
+    std::string label;
+    // The OpenMP reduction operator, the MPI combine uses the same one
+    std::string op;
+    bool isFloat;
+    // Histogram bins, reduced as an array section
+    bool isArray;
+
+    // Floating-point sums are accumulated per block of agents and the blocks
+    // are added in order, so that they do not depend on the number of threads
+    bool isBlockSum() const {
+      return isFloat && op == "+" && !isArray;
+    }
+  };
+  struct Pass {
+    const AST::AgentDeclaration *agent;
+    std::vector<const AST::CallExpression *> calls;
+    std::vector<Accumulator> accumulators;
+  };
+  std::vector<Pass> passes;
+  // Agent counts that have to be summed over all ranks or kept for the
+  // timestep, by agent type
+  std::map<std::string, std::string> countLabels;
+  for (const AST::AgentDeclaration *agent : script.agents) {
+    Pass pass { agent, {}, {} };
+    // Reductions of a member that take no further arguments are shared
+    std::map<std::string, std::string> memberLabels;
+    for (const AST::CallExpression *call : calls) {
+      Type type = call->getArg(0).type;
+      if (type.getAgentDecl() != agent) {
+        continue;
+      }
+
+      const std::string &name = call->calledSig.name;
+      std::string memberKey = call->getNumArgs() == 1 && type.isAgentMember()
+        ? name + "." + type.getAgentMember()->name : "";
+      if (name == "count" && (params.mpi || snapshot)) {
+        if (!countLabels.count(agent->name)) {
+          countLabels[agent->name] = makeAnonLabel();
+        }
+        reductionLabels[call] = countLabels[agent->name];
+      } else if (name == "count") {
+        // Number of agents, no pass necessary
+        reductionLabels[call] = "((int) agents.agents_" + agent->name + ".len)";
+      } else if (!memberKey.empty() && memberLabels.count(memberKey)) {
+        reductionLabels[call] = memberLabels[memberKey];
+      } else {
+        std::string label = makeAnonLabel();
+        reductionLabels[call] = label;
+        if (!memberKey.empty()) {
+          memberLabels[memberKey] = label;
+        }
+        pass.calls.push_back(call);
+      }
+    }
+    if (!pass.calls.empty()) {
+      passes.push_back(pass);
+    }
+  }
+
+  // Accumulators are globals, so that the passes can be work-shared by all
+  // threads of the simulation loop. Vector sums are reduced per component.
+  for (const auto &count : countLabels) {
+    *this << "static int " << count.second << ";" << nl;
+  }
+  std::vector<const AST::CallExpression *> vecSums;
+  std::vector<const AST::CallExpression *> means;
+  for (Pass &pass : passes) {
+    for (const AST::CallExpression *call : pass.calls) {
+      const std::string &name = call->calledSig.name;
+      const std::string &label = reductionLabels[call];
+      Type memberType = call->getArg(0).type.getAgentMember()->type->resolved;
+      Type resultType = call->calledSig.returnType;
+      if (name == "count_member") {
+        *this << "static int " << label << ";" << nl << "static ";
+        *this << memberType << " " << label << "_value;" << nl;
+        pass.accumulators.push_back({ label, "+", false, false });
+      } else if (name == "histogram") {
+        *this << "static int *" << label << ";" << nl
+              << "static int " << label << "_bins;" << nl << "static ";
+        *this << Type(Type::FLOAT) << " " << label << "_lo, " << label << "_hi;" << nl;
+        pass.accumulators.push_back({ label, "+", false, true });
+      } else if (name == "sum" && memberType.isVec()) {
+        for (unsigned c = 0; c < memberType.getVecLen(); c++) {
+          std::string component = label + "_" + componentNames[c];
+          *this << "static ";
+          *this << Type(Type::FLOAT) << " " << component << ";" << nl;
+          pass.accumulators.push_back({ component, "+", true, false });
+        }
+        if (snapshot) {
+          *this << "static " << memberType << " " << label << ";" << nl;
+          vecSums.push_back(call);
+        }
+      } else {
+        std::string op = name == "min_member" ? "min" : name == "max_member" ? "max" : "+";
+        *this << "static ";
+        *this << resultType << " " << label << ";" << nl;
+        if (name == "mean_member") {
+          // Divided by the agent count once the sum is complete
+          *this << "static int " << label << "_count;" << nl;
+          means.push_back(call);
+        }
+        pass.accumulators.push_back({ label, op, resultType.isFloat(), false });
+      }
+    }
+  }
+
+  for (const Pass &pass : passes) {
+    for (const Accumulator &acc : pass.accumulators) {
+      if (acc.isBlockSum()) {
+        *this << "static dyn_array " << acc.label << "_blocks;" << nl;
+      }
+    }
+  }
+
+  *this << "static void " << funcName << "(void) {" << indent << nl
+        << "#pragma omp single" << nl << "{" << indent;
+  for (const auto &count : countLabels) {
+    *this << nl << count.second << " = (int) agents.agents_" << count.first << ".len;";
+  }
+  for (const Pass &pass : passes) {
+    for (const Accumulator &acc : pass.accumulators) {
+      if (!acc.isArray) {
+        *this << nl << acc.label << " = " << getReductionIdentity(acc.op, acc.isFloat) << ";";
+      }
+      if (acc.isBlockSum()) {
+        *this << nl << "DYN_ARRAY_ENSURE(&" << acc.label << "_blocks, ";
+        *this << Type(Type::FLOAT) << ", reduction_num_blocks(agents.agents_"
+              << pass.agent->name << ".len));";
+      }
+    }
+    for (const AST::CallExpression *call : pass.calls) {
+      const std::string &name = call->calledSig.name;
+      const std::string &label = reductionLabels[call];
+      if (name == "count_member") {
+        *this << nl << label << "_value = " << call->getArg(1) << ";";
+      } else if (name == "mean_member") {
+        *this << nl << label << "_count = (int) agents.agents_" << pass.agent->name << ".len;";
+      } else if (name == "histogram") {
+        *this << nl << label << "_lo = " << call->getArg(1) << ";"
+              << nl << label << "_hi = " << call->getArg(2) << ";"
+              << nl << label << "_bins = " << call->getArg(3) << ";"
+              << nl << "if (" << label << "_bins < 1) " << label << "_bins = 1;"
+              << nl << label << " = realloc(" << label << ", sizeof(int) * "
+              << label << "_bins);"
+              << nl << "memset(" << label << ", 0, sizeof(int) * " << label << "_bins);";
+      }
+    }
+  }
+  *this << outdent << nl << "}";
+
+  // All other reductions over one agent type are fused into a single pass
+  // over blocks of agents
+  for (const Pass &pass : passes) {
+    const std::string &agentName = pass.agent->name;
+    std::string lenExpr = "agents.agents_" + agentName + ".len";
+    std::string bLabel = makeAnonLabel();
+    std::string endLabel = makeAnonLabel();
+    std::string iLabel = makeAnonLabel();
+    std::string agentLabel = makeAnonLabel();
+    // Partial sums of the current block
+    std::map<std::string, std::string> blockLabels;
+    for (const Accumulator &acc : pass.accumulators) {
+      if (acc.isBlockSum()) {
+        blockLabels[acc.label] = makeAnonLabel();
+      }
+    }
+    *this << nl << "#pragma omp for";
+    for (const char *op : { "+", "min", "max" }) {
+      std::vector<const Accumulator *> opAccumulators;
+      for (const Accumulator &acc : pass.accumulators) {
+        if (acc.op == op && !acc.isBlockSum()) {
+          opAccumulators.push_back(&acc);
+        }
+      }
+      if (opAccumulators.empty()) {
+        continue;
+      }
+
+      *this << " reduction(" << op << ":";
+      printCommaSeparated(opAccumulators, [&](const Accumulator *acc) {
+        *this << acc->label;
+        if (acc->isArray) {
+          *this << "[:" << acc->label << "_bins]";
+        }
+      });
+      *this << ")";
+    }
+    *this << nl << "for (size_t " << bLabel << " = 0; " << bLabel
+          << " < reduction_num_blocks(" << lenExpr << "); " << bLabel << "++) {" << indent;
+    for (const auto &block : blockLabels) {
+      *this << nl;
+      *this << Type(Type::FLOAT) << " " << block.second << " = 0;";
+    }
+    *this << nl << "size_t " << endLabel << " = reduction_block_end(" << bLabel << ", "
+          << lenExpr << ");"
+          << nl << "for (size_t " << iLabel << " = " << bLabel << " * REDUCTION_BLOCK_SIZE; "
+          << iLabel << " < " << endLabel << "; " << iLabel << "++) {" << indent;
+    if (!params.soaLayout) {
+      *this << nl << agentName << " *" << agentLabel << " = DYN_ARRAY_GET(&agents.agents_"
+            << agentName << ", " << agentName << ", " << iLabel << ");";
+    }
+    for (const AST::CallExpression *call : pass.calls) {
+      const std::string &name = call->calledSig.name;
+      const std::string &label = reductionLabels[call];
+      const AST::AgentMember *member = call->getArg(0).type.getAgentMember();
+      Type memberType = member->type->resolved;
+      std::string value = params.soaLayout
+        ? "agents.agents_" + agentName + "." + member->name + "[" + iLabel + "]"
+        : agentLabel + "->" + member->name;
+      if (name == "count_member") {
+        *this << nl << label << " += ";
+        if (memberType.isVec()) {
+          *this << memberType << "_equals(" << value << ", " << label << "_value);";
+        } else {
+          *this << value << " == " << label << "_value;";
+        }
+      } else if (name == "min_member" || name == "max_member") {
+        *this << nl << "if (" << value << (name == "min_member" ? " < " : " > ") << label
+              << ") " << label << " = " << value << ";";
+      } else if (name == "histogram") {
+        *this << nl << label << "[histogram_bin(" << value << ", " << label << "_lo, "
+              << label << "_hi, " << label << "_bins)]++;";
+      } else if (memberType.isVec()) {
+        for (unsigned c = 0; c < memberType.getVecLen(); c++) {
+          *this << nl << blockLabels.at(label + "_" + componentNames[c]) << " += "
+                << value << "." << componentNames[c] << ";";
+        }
+      } else if (blockLabels.count(label)) {
+        *this << nl << blockLabels.at(label) << " += " << value << ";";
+      } else {
+        *this << nl << label << " += " << value << ";";
+      }
+    }
+    *this << outdent << nl << "}";
+    for (const auto &block : blockLabels) {
+      *this << nl << "*DYN_ARRAY_GET(&" << block.first << "_blocks, ";
+      *this << Type(Type::FLOAT) << ", " << bLabel << ") = " << block.second << ";";
+    }
+    *this << outdent << nl << "}";
+  }
+
+  bool hasBlockSums = false;
+  for (const Pass &pass : passes) {
+    for (const Accumulator &acc : pass.accumulators) {
+      hasBlockSums |= acc.isBlockSum();
+    }
+  }
+  if (hasBlockSums) {
+    *this << nl << "#pragma omp single" << nl << "{" << indent;
+    for (const Pass &pass : passes) {
+      for (const Accumulator &acc : pass.accumulators) {
+        if (acc.isBlockSum()) {
+          std::string bLabel = makeAnonLabel();
+          *this << nl << "for (size_t " << bLabel << " = 0; " << bLabel << " < "
+                << acc.label << "_blocks.len; " << bLabel << "++) {" << indent << nl
+                << acc.label << " += *DYN_ARRAY_GET(&" << acc.label << "_blocks, ";
+          *this << Type(Type::FLOAT) << ", " << bLabel << ");" << outdent << nl << "}";
+        }
+      }
+    }
+    *this << outdent << nl << "}";
+  }
+
+  if (params.mpi) {
+    // Combine the partial results of all ranks
+    *this << nl << "#pragma omp single" << nl << "{" << indent;
+    for (const auto &count : countLabels) {
+      *this << nl << "mpi_sum_int(&" << count.second << ");";
+    }
+    for (const Pass &pass : passes) {
+      for (const Accumulator &acc : pass.accumulators) {
+        if (acc.isArray) {
+          *this << nl << "mpi_sum_int_array(" << acc.label << ", " << acc.label << "_bins);";
+          continue;
+        }
+
+        const char *opName = acc.op == "min" ? "min" : acc.op == "max" ? "max" : "sum";
+        *this << nl << "mpi_" << opName << (acc.isFloat ? "_float" : "_int")
+              << "(&" << acc.label << ");";
+      }
+    }
+    for (const AST::CallExpression *call : means) {
+      *this << nl << "mpi_sum_int(&" << reductionLabels[call] << "_count);";
+    }
+    *this << outdent << nl << "}";
+  }
+  if (!vecSums.empty() || !means.empty()) {
+    *this << nl << "#pragma omp single" << nl << "{" << indent;
+    for (const AST::CallExpression *call : vecSums) {
+      const std::string &label = reductionLabels[call];
+      Type memberType = call->getArg(0).type.getAgentMember()->type->resolved;
+      *this << nl << label << " = " << memberType << "_create(";
+      for (unsigned c = 0; c < memberType.getVecLen(); c++) {
+        *this << (c ? ", " : "") << label << "_" << componentNames[c];
+      }
+      *this << ");";
+    }
+    for (const AST::CallExpression *call : means) {
+      const std::string &label = reductionLabels[call];
+      *this << nl << label << " = " << label << "_count ? " << label << " / "
+            << label << "_count : 0;";
+    }
+    *this << outdent << nl << "}";
+  }
+  *this << outdent << nl << "}" << nl;
+}
+
+void CPrinter::printVecSumResults(const AST::FunctionDeclaration &seqStep) {
+  std::set<std::string> printed;
+  for (const AST::CallExpression *call : seqStep.reductionCalls) {
+    if (call->calledSig.name != "sum") {
+      continue;
+    }
+
+    const std::string &label = reductionLabels[call];
+    Type memberType = call->getArg(0).type.getAgentMember()->type->resolved;
+    if (memberType.isVec() && printed.insert(label).second) {
+      *this << nl;
+      *this << memberType << " " << label << " = " << memberType << "_create(";
+      for (unsigned c = 0; c < memberType.getVecLen(); c++) {
+        *this << (c ? ", " : "") << label << "_" << componentNames[c];
+      }
+      *this << ");";
+    }
   }
-  *this << "{ TYPE_END, sizeof(" << decl.name << "), NULL }" << outdent << nl << "};" << nl;
 }
 
 void CPrinter::print(const AST::FunctionDeclaration &decl) {
+  currentFunc = &decl;
   if (decl.isMain()) {
     // Return result code from main()
-    *this << "int main() {" << indent << *decl.stmts << nl
-          << "return 0;" << outdent << nl << "}";
-    return;
+    *this << "int main() {" << indent;
+    if (params.mpi) {
+      *this << nl << "mpi_init();";
+    }
+    for (const AST::FieldDeclaration *field : script.fields) {
+      const AST::EnvironmentDeclaration *envDecl = script.envDecl;
+      Value::Vec3 envMin = envDecl->envMin.extendToVec3().getVec3();
+      Value::Vec3 envSize = envDecl->envSize.extendToVec3().getVec3();
+      *this << nl << "field_init(&openabl_field_" << field->var->name << ", "
+            << "float3_create(" << envMin.x << ", " << envMin.y << ", " << envMin.z << "), "
+            << "float3_create(" << envSize.x << ", " << envSize.y << ", " << envSize.z << "), "
+            << (envDecl->envWrap ? "true" : "false") << ", "
+            << (envDecl->getEnvDimension() == 3 ? "true" : "false") << ");";
+    }
+    *this << *decl.stmts << nl;
+    if (params.mpi) {
+      *this << "mpi_finalize();" << nl;
+    }
+    *this << "return 0;" << outdent << nl << "}";
+  } else if (decl.isParallelStep() && (decl.usesRuntimeRemoval || usesAgentIndex(decl))) {
+    *this << *decl.returnType << " " << decl.sig.name << "(";
+    printParams(decl);
+    if (decl.usesRuntimeRemoval) {
+      // removeCurrent() sets the removal flag of the current agent
+      *this << ", bool *_removed";
+    }
+    if (usesAgentIndex(decl)) {
+      // Index of the current agent, into the Verlet list, the links or the inboxes
+      *this << ", size_t _index";
+    }
+    *this << ") {" << indent << *decl.stmts << outdent << nl << "}";
+  } else if (decl.isSequentialStep() && !decl.reductionCalls.empty()) {
+    // Called before the sequential step
+    printReductions(decl.sig.name + "_reduce", decl.reductionCalls, false);
+    *this << *decl.returnType << " " << decl.sig.name << "() {" << indent;
+    printVecSumResults(decl);
+    *this << *decl.stmts << outdent << nl << "}";
+  } else {
+    GenericPrinter::print(decl);
   }
-
-  GenericPrinter::print(decl);
+  if (sparseFuncs.count(&decl)) {
+    const AST::Param &param = decl.stepParam();
+    *this << nl << "bool " << decl.name << "_is_active(" << *param.type << " "
+          << *param.var << ") {" << indent << nl
+          << "return " << *decl.activeGuard << ";" << outdent << nl << "}";
+  }
+  currentFunc = nullptr;
 }
 
 void CPrinter::print(const AST::Script &script) {
-  *this << "#include \"libabl.h\"" << nl << nl;
+  *this << (params.mpi ? "#include \"libabl_mpi.h\"" : "#include \"libabl.h\"") << nl << nl;
 
   // First declare all agents
   for (AST::AgentDeclaration *decl : script.agents) {
@@ -286,25 +2115,121 @@ void CPrinter::print(const AST::Script &script) {
   // Create structure to store agents
   *this << "struct agent_struct {" << indent;
   for (AST::AgentDeclaration *decl : script.agents) {
-    *this << nl << "dyn_array agents_" << decl->name << ";";
-    *this << nl << "dyn_array agents_" << decl->name << "_dbuf;";
+    if (params.soaLayout) {
+      *this << nl << decl->name << "_soa agents_" << decl->name << ";";
+      *this << nl << decl->name << "_soa agents_" << decl->name << "_dbuf;";
+    } else {
+      *this << nl << "dyn_array agents_" << decl->name << ";";
+      *this << nl << "dyn_array agents_" << decl->name << "_dbuf;";
+    }
   }
   *this << outdent << nl << "};" << nl
         << "struct agent_struct agents;" << nl;
 
   // Create runtime type information for this structure
-  *this << "static const agent_info agents_info[] = {" << indent << nl;
+  if (usesAgentsInfo()) {
+    *this << "static const agent_info agents_info[] = {" << indent << nl;
+    for (AST::AgentDeclaration *decl : script.agents) {
+      *this << "{ " << decl->name << "_info, "
+            << "offsetof(struct agent_struct, agents_" << decl->name
+            << "), \"" << decl->name << "\", "
+            << (params.soaLayout ? "LAYOUT_SOA" : "LAYOUT_AOS") << " }," << nl;
+    }
+    *this << "{ NULL, 0, NULL, LAYOUT_AOS }" << outdent << nl << "};" << nl;
+  }
+
+  // Spatial indices for agents used in for-near loops
+  for (const AST::AgentDeclaration *decl : getIndexedAgents(script)) {
+    *this << "spatial_grid agents_" << decl->name << "_grid;" << nl;
+  }
+  // Removal flags and staging buffers for runtime removal and addition
   for (AST::AgentDeclaration *decl : script.agents) {
-    *this << "{ " << decl->name << "_info, "
-          << "offsetof(struct agent_struct, agents_" << decl->name
-          << "), \"" << decl->name << "\" }," << nl;
+    if (decl->usesRuntimeRemoval) {
+      *this << "dyn_array agents_" << decl->name << "_removed;" << nl;
+    }
+  }
+  for (const AST::AgentDeclaration *decl : getRuntimeAddedAgents(script)) {
+    *this << "agent_staging agents_" << decl->name << "_added;" << nl;
   }
-  *this << "{ NULL, 0, NULL }" << outdent << nl << "};" << nl << nl;
+  for (const AST::AgentDeclaration *decl : getReorderedAgents()) {
+    *this << "agent_order agents_" << decl->name << "_order;" << nl;
+  }
+  for (const AST::AgentDeclaration *decl : script.agents) {
+    if (decl->hasLinks) {
+      *this << "link_graph agents_" << decl->name << "_links;" << nl;
+    }
+    for (Type msgType : decl->inboxTypes) {
+      *this << "inbox " << getInboxName(*decl, msgType) << ";" << nl;
+    }
+  }
+  // Packed neighbor views for step functions with for-near loops
+  if (script.simStmt) {
+    for (AST::FunctionDeclaration *func : script.simStmt->stepFuncDecls) {
+      if (!func->accessedAgent || hasNearestLoop(*func)) {
+        continue;
+      }
+
+      if (script.envDecl->envLattice) {
+        // Stencil loops need neither lists nor views, but may still be vectorized
+        collectSimdNearLoops(*func);
+        continue;
+      }
+
+      if (params.verletSkin > 0 && queriesOwnNeighbors(*func)) {
+        verletFuncs.insert(func);
+        *this << "verlet_list " << func->name << "_verlet;" << nl;
+        continue;
+      }
+
+      NeighborAccessChecker checker;
+      func->accept(checker);
+      if (checker.onlyMemberReads()) {
+        neighborViewFuncs.insert(func);
+        printNeighborView(*func);
+        collectSimdNearLoops(*func);
+      }
+    }
+  }
+  // Skip flags and indices of the active agents for steps with an activity guard
+  if (script.simStmt) {
+    for (AST::FunctionDeclaration *func : script.simStmt->stepFuncDecls) {
+      if (isSparseStep(*func) && sparseFuncs.insert(func).second) {
+        *this << "dyn_array " << func->name << "_skipped;" << nl
+              << "dyn_array " << func->name << "_active_ids;" << nl
+              << "size_t " << func->name << "_num_active;" << nl
+              << "bool " << func->name << "_dense;" << nl;
+      }
+    }
+  }
+  if (params.schedule == Params::Schedule::STEAL) {
+    *this << "work_queue *openabl_work_queue;" << nl;
+  }
+  if (params.mpi) {
+    *this << "mpi_domain openabl_domain;" << nl;
+    for (const AST::AgentDeclaration *decl : getIndexedAgents(script)) {
+      *this << "size_t agents_" << decl->name << "_ghosts;" << nl;
+    }
+  }
+  for (const AST::FieldDeclaration *decl : script.fields) {
+    *this << "field openabl_field_" << decl->var->name << ";" << nl;
+  }
+  if (script.usesLogging) {
+    *this << "log_writer openabl_log_file;" << nl;
+  }
+  if (script.usesTiming) {
+    *this << Type(Type::FLOAT) << " openabl_last_exec_time;" << nl;
+  }
+  *this << nl;
 
   // Then declare everything else
   for (AST::ConstDeclaration *decl : script.consts) {
     *this << *decl << nl;
   }
+  std::vector<AST::CallExpression *> snapshotCalls = getSnapshotCalls(script);
+  if (!snapshotCalls.empty()) {
+    // Called at the start of every timestep
+    printReductions("openabl_snapshot_reduce", snapshotCalls, true);
+  }
   for (AST::FunctionDeclaration *decl : script.funcs) {
     *this << *decl << nl;
   }
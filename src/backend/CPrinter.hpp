@@ -14,6 +14,8 @@
 
 #pragma once
 
+#include <map>
+#include <set>
 #include "AST.hpp"
 #include "GenericCPrinter.hpp"
 
@@ -22,15 +24,42 @@ namespace OpenABL {
 struct CPrinter : public GenericCPrinter {
   using GenericCPrinter::print;
 
+  struct Params {
+    // Store agents as one array per member (c.layout=soa)
+    bool soaLayout = false;
+
+    // Distribution of step loops over the threads (c.schedule)
+    enum class Schedule { STATIC, DYNAMIC, STEAL };
+    Schedule schedule = Schedule::STATIC;
+
+    // Sort agents into grid cell order every n timesteps, 0 to disable (c.reorder)
+    long reorderInterval = 0;
+
+    // Reuse neighbor lists of radius + skin across timesteps, 0 to disable (c.verlet_skin)
+    double verletSkin = 0;
+
+    // Spatial index per agent type, grid if absent (c.spatial_index)
+    enum class SpatialIndex { GRID, TREE, AUTO };
+    std::map<std::string, SpatialIndex> spatialIndex;
+
+    // Distribute the agents over MPI ranks (mpic backend)
+    bool mpi = false;
+  };
+
+  CPrinter(AST::Script &script, bool useFloat, Params params)
+    : GenericCPrinter(script), script(script), useFloat(useFloat), params(params) {}
   CPrinter(AST::Script &script, bool useFloat)
-    : GenericCPrinter(script), script(script), useFloat(useFloat) {}
+    : CPrinter(script, useFloat, Params()) {}
 
   void print(const AST::CallExpression &);
+  void print(const AST::VarExpression &);
   void print(const AST::MemberInitEntry &);
   void print(const AST::AgentCreationExpression &);
   void print(const AST::NewArrayExpression &);
   void print(const AST::MemberAccessExpression &);
+  void print(const AST::EnvironmentAccessExpression &);
   void print(const AST::AssignStatement &);
+  void print(const AST::AssignOpStatement &);
   void print(const AST::VarDeclarationStatement &);
   void print(const AST::ForStatement &);
   void print(const AST::SimulateStatement &);
@@ -42,8 +71,75 @@ struct CPrinter : public GenericCPrinter {
   void printType(Type t);
 
 private:
+  void printSoaHelpers(const AST::AgentDeclaration &);
+  void printReductions(const std::string &funcName,
+                       const std::vector<AST::CallExpression *> &calls, bool snapshot);
+  void printVecSumResults(const AST::FunctionDeclaration &seqStep);
+  void printMigrate(const AST::AgentDeclaration &agent);
+  void printAgentCopy(const AST::AgentDeclaration &agent, const std::string &dst,
+                      const std::string &src, const std::string &iLabel);
+  void printPositionArgs(const AST::AgentDeclaration &agent);
+  void printWrapCallStart(const std::string &name, const Type &posType);
+  void printWrapCallEnd(const Type &posType);
+  void printGridBuild(const AST::AgentDeclaration &agent);
+  void printVerletUpdate(const AST::FunctionDeclaration &stepFunc);
+  void printVerletInvalidation(const AST::AgentDeclaration &agent);
+  bool usesVerletList(const AST::AgentDeclaration &agent) const;
+  bool usesAgentIndex(const AST::FunctionDeclaration &stepFunc) const;
+  bool isSparseStep(const AST::FunctionDeclaration &stepFunc) const;
+  void printOrderRestore(const AST::AgentDeclaration &agent);
+  std::vector<const AST::AgentDeclaration *> getReorderedAgents() const;
+  bool usesAgentsInfo() const;
+  bool usesTypeInfo(const AST::AgentDeclaration &agent) const;
+  void printNeighborView(const AST::FunctionDeclaration &stepFunc);
+  void printNeighborViewLoop(
+      const AST::ForStatement &stmt, const std::string &itLabel, const std::string &rLabel);
+  void printNeighborViewPack(const AST::FunctionDeclaration &stepFunc);
+  void printNearNeighbor(
+      const AST::ForStatement &stmt, const std::string &iLabel, const std::string &rLabel);
+  bool printSimdSumsStart(const AST::ForStatement &stmt);
+  void printSimdPragma(const AST::ForStatement &stmt);
+  void printSimdSumsEnd(const AST::ForStatement &stmt);
+  void collectSimdNearLoops(AST::FunctionDeclaration &stepFunc);
+  void printLatticeLoop(const AST::ForStatement &stmt);
+  void printNearestLoop(const AST::ForStatement &stmt);
+  void printFieldFlush(const std::set<std::string> &fields);
+  void printStepLoop(
+      const AST::FunctionDeclaration &stepFunc, size_t stepIndex, const std::string &tLabel);
+
   AST::Script &script;
   bool useFloat;
+  Params params;
+
+  const AST::FunctionDeclaration *currentFunc = nullptr;
+
+  // Variables holding the precomputed results of count() and sum() calls
+  std::map<const AST::CallExpression *, std::string> reductionLabels;
+
+  // Step functions whose for-near loops read from a packed neighbor view
+  std::set<const AST::FunctionDeclaration *> neighborViewFuncs;
+  // Step functions whose for-near loops iterate over a Verlet neighbor list
+  std::set<const AST::FunctionDeclaration *> verletFuncs;
+  // Step functions with an activity guard, whose loops only visit the active agents
+  std::set<const AST::FunctionDeclaration *> sparseFuncs;
+  // Vectorizable for-near loops over a neighbor view, with their sum variables
+  std::map<const AST::ForStatement *, std::vector<const AST::VarExpression *>> simdNearLoops;
+  // Per-component sums of vector variables inside the current SIMD loop
+  std::map<VarId, std::vector<std::string>> simdVecSums;
+
+  // Neighbor variables of the enclosing loops, which are read from
+  // struct-of-arrays storage by index
+  struct SoaNeighbor {
+    std::string index;
+    const AST::AgentDeclaration *agent;
+  };
+  std::map<VarId, SoaNeighbor> soaNeighbors;
+  // Slot of the current link of for-links loop variables, for rewire()
+  std::map<VarId, std::string> linkSlots;
+  // Index of the neighbor variables of the enclosing loops, for send()
+  std::map<VarId, std::string> neighborIndices;
+  // Number of enclosing nearest() loops, each of which uses its own heap
+  int nearestDepth = 0;
 };
 
 }
@@ -67,6 +67,40 @@ void DMasonBackend::generate(
       "than the parent is not supported by DMason");
   }
 
+  if (script.usesLoad) {
+    throw BackendError("load() is not supported by the DMason backend");
+  }
+  if (script.simStmt && script.simStmt->outputExpr) {
+    throw BackendError("Periodic output is not supported by the DMason backend");
+  }
+  if (script.envDecl && script.envDecl->envWrap) {
+    throw BackendError("Wrapping environments are not supported by the DMason backend");
+  }
+  if (!script.fields.empty()) {
+    throw BackendError("Environment fields are not supported by the DMason backend");
+  }
+  if (script.usesNearest) {
+    throw BackendError("nearest() is not supported by the DMason backend");
+  }
+  if (script.usesLinks) {
+    throw BackendError("Agent links are not supported by the DMason backend");
+  }
+  if (script.usesMessages) {
+    throw BackendError("send() is not supported by the DMason backend");
+  }
+  if (script.usesParallelReductions) {
+    throw BackendError("Reductions in parallel steps are not supported by the DMason backend");
+  }
+  if (script.simStmt && script.simStmt->hasStepIntervals()) {
+    throw BackendError("Step intervals are not supported by the DMason backend");
+  }
+  for (const ReductionInfo &info : script.reductions) {
+    if (info.first != ReductionKind::COUNT_TYPE && info.first != ReductionKind::COUNT_MEMBER
+        && info.first != ReductionKind::SUM_MEMBER) {
+      throw BackendError("Only count() and sum() reductions are supported by the DMason backend");
+    }
+  }
+
   writeToFile(ctx.outputDir + "/Sim.java", generateMainCode(script));
   writeToFile(ctx.outputDir + "/SimWithUI.java", generateUICode(script));
   writeToFile(ctx.outputDir + "/LocalTestSim.java",
@@ -223,11 +223,11 @@ void DMasonPrinter::printAgentExtraCtorCode() {
 void DMasonPrinter::printStepDefaultCode(const AST::AgentDeclaration &decl) {
   const AST::AgentMember *posMember = decl.getPositionMember();
 
-  *this << "try {" << indent
+  *this << nl << "try {" << indent
         << nl << "this.setPos(getInState()." << posMember->name << ");"
         << nl << "((Sim) state).env.setDistributedObjectLocation("
         << "getInState()." << posMember->name << ", this, state);"
-        << outdent << nl << "} catch (DMasonException e) { e.printStackTrace(); }" << nl;
+        << outdent << nl << "} catch (DMasonException e) { e.printStackTrace(); }";
 }
 
 void DMasonPrinter::print(const AST::CallExpression &expr) {
@@ -140,6 +140,34 @@ void FlameBackend::generate(AST::Script &script, const BackendContext &ctx) {
   if (script.usesRuntimeRemoval || script.usesRuntimeAddition) {
     throw BackendError("Flame does not support dynamic add/remove");
   }
+  if (script.usesLoad) {
+    throw BackendError("Flame does not support load()");
+  }
+  if (script.simStmt && script.simStmt->outputExpr) {
+    throw BackendError("Flame does not support periodic output");
+  }
+  if (script.envDecl && script.envDecl->envWrap) {
+    throw BackendError("Flame does not support wrapping environments");
+  }
+  if (!script.fields.empty()) {
+    throw BackendError("Flame does not support environment fields");
+  }
+  if (script.usesNearest) {
+    throw BackendError("Flame does not support nearest()");
+  }
+  if (script.usesLinks) {
+    throw BackendError("Flame does not support agent links");
+  }
+  if (script.usesMessages) {
+    throw BackendError("Flame does not support send()");
+  }
+  if (script.usesParallelReductions) {
+    throw BackendError("Flame does not support reductions in parallel steps");
+  }
+  if (script.simStmt && script.simStmt->hasStepIntervals()) {
+    // Agent functions have no access to the iteration number
+    throw BackendError("Flame does not support step intervals");
+  }
 
   bool useFloat = ctx.config.getBool("use_float", false);
   bool parallel = ctx.config.getBool("flame.parallel", false);
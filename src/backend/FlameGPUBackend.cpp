@@ -273,6 +273,40 @@ static std::string createRunFile() {
 }
 
 void FlameGPUBackend::generate(AST::Script &script, const BackendContext &ctx) {
+  if (script.usesLoad) {
+    throw BackendError("FlameGPU does not support load()");
+  }
+  if (script.simStmt && script.simStmt->outputExpr) {
+    throw BackendError("FlameGPU does not support periodic output");
+  }
+  if (script.envDecl && script.envDecl->envWrap) {
+    throw BackendError("FlameGPU does not support wrapping environments");
+  }
+  if (!script.fields.empty()) {
+    throw BackendError("FlameGPU does not support environment fields");
+  }
+  if (script.usesNearest) {
+    throw BackendError("FlameGPU does not support nearest()");
+  }
+  if (script.usesLinks) {
+    throw BackendError("FlameGPU does not support agent links");
+  }
+  if (script.usesMessages) {
+    throw BackendError("FlameGPU does not support send()");
+  }
+  if (script.usesParallelReductions) {
+    throw BackendError("FlameGPU does not support reductions in parallel steps");
+  }
+  if (script.simStmt && script.simStmt->hasStepIntervals()) {
+    // Layers are executed unconditionally in every iteration
+    throw BackendError("FlameGPU does not support step intervals");
+  }
+  for (const ReductionInfo &info : script.reductions) {
+    if (info.first == ReductionKind::HISTOGRAM_MEMBER) {
+      throw BackendError("FlameGPU does not support histogram()");
+    }
+  }
+
   bool useFloat = ctx.config.getBool("use_float", false);
   bool visualize = ctx.config.getBool("visualize", false);
   bool profile = ctx.config.getBool("profile", false);
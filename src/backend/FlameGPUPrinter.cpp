@@ -223,6 +223,22 @@ void FlameGPUPrinter::print(const AST::CallExpression &expr) {
         *this << "reduce_" << decl->name << "_" << state
               << "_" << member->name << "_variable()";
         return;
+      } else if (expr.name == "min" || expr.name == "max" || expr.name == "mean") {
+        if (expr.getArg(0).type.isAgentMember()) {
+          Type type = expr.getArg(0).type;
+          AST::AgentDeclaration *decl = type.getAgentDecl();
+          AST::AgentMember *member = type.getAgentMember();
+          std::string state = decl->name + "_default";
+          std::string variable = decl->name + "_" + state + "_" + member->name + "_variable()";
+          if (expr.name == "mean") {
+            std::string count = "get_agent_" + decl->name + "_" + state + "_count()";
+            *this << "(" << count << " ? reduce_" << variable << " / (double) "
+                  << count << " : 0)";
+          } else {
+            *this << expr.name << "_" << variable;
+          }
+          return;
+        }
       } else if (expr.name == "log_csv") {
         std::string formatStr;
         bool first = true;
@@ -246,6 +262,9 @@ void FlameGPUPrinter::print(const AST::CallExpression &expr) {
       } else if (expr.name == "getLastExecTime") {
         *this << "(openabl_event_elapsed / 1000)";
         return;
+      } else if (expr.name == "displacement") {
+        *this << "(" << expr.getArg(1) << " - " << expr.getArg(0) << ")";
+        return;
       }
     }
 
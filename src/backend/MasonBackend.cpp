@@ -48,6 +48,24 @@ void MasonBackend::generate(
   if (useFloat) {
     throw BackendError("Floats are not supported by the Mason backend");
   }
+  if (script.usesLoad) {
+    throw BackendError("load() is not supported by the Mason backend");
+  }
+  if (script.simStmt && script.simStmt->outputExpr) {
+    throw BackendError("Periodic output is not supported by the Mason backend");
+  }
+  if (script.envDecl && script.envDecl->envWrap) {
+    throw BackendError("Wrapping environments are not supported by the Mason backend");
+  }
+  if (!script.fields.empty() && script.envDecl->getEnvDimension() != 2) {
+    throw BackendError("Environment fields are only supported in 2D by the Mason backend");
+  }
+  if (script.usesLinks) {
+    throw BackendError("Agent links are not supported by the Mason backend");
+  }
+  if (script.usesMessages) {
+    throw BackendError("send() is not supported by the Mason backend");
+  }
 
   writeToFile(ctx.outputDir + "/Sim.java", generateMainCode(script));
   writeToFile(ctx.outputDir + "/SimWithUI.java", generateUICode(script));
@@ -12,10 +12,39 @@
  * See the License for the specific language governing permissions and
  * limitations under the License. */
 
+#include <algorithm>
+#include <cmath>
 #include "MasonPrinter.hpp"
 
 namespace OpenABL {
 
+// The reduction calls in parallel step functions. Their values are taken at
+// the start of each timestep
+static std::vector<const AST::CallExpression *> getSnapshotCalls(const AST::Script &script) {
+  std::vector<const AST::CallExpression *> result;
+  for (const AST::FunctionDeclaration *func : script.funcs) {
+    if (func->isParallelStep()) {
+      result.insert(result.end(), func->reductionCalls.begin(), func->reductionCalls.end());
+    }
+  }
+  return result;
+}
+
+// Reduction results are stored in fields of Sim, numbered over all reduction
+// calls, so that the agent classes agree on the names
+static std::string getReductionName(
+    const AST::Script &script, const AST::CallExpression &expr) {
+  size_t index = 0;
+  for (const AST::FunctionDeclaration *func : script.funcs) {
+    auto it = std::find(func->reductionCalls.begin(), func->reductionCalls.end(), &expr);
+    if (it != func->reductionCalls.end()) {
+      return "reduction" + std::to_string(index + (it - func->reductionCalls.begin()));
+    }
+    index += func->reductionCalls.size();
+  }
+  return "";
+}
+
 void MasonPrinter::print(const AST::MemberInitEntry &) {}
 void MasonPrinter::print(const AST::NewArrayExpression &) {}
 
@@ -64,6 +93,11 @@ void MasonPrinter::print(const AST::VarExpression &expr) {
   }
 }
 
+// Only environment fields remain after analysis
+void MasonPrinter::print(const AST::EnvironmentAccessExpression &expr) {
+  *this << getSimVarName() << ".field_" << expr.member;
+}
+
 bool MasonPrinter::isSpecialBinaryOp(
     AST::BinaryOp, const AST::Expression &left, const AST::Expression &right) {
   return left.type.isVec() || right.type.isVec();
@@ -128,8 +162,14 @@ void MasonPrinter::print(const AST::CallExpression &expr) {
   if (expr.isCtor()) {
     printTypeCtor(*this, expr);
   } else if (expr.isBuiltin()) {
-    if (name == "dist") {
+    std::string reductionName = getReductionName(script, expr);
+    if (!reductionName.empty()) {
+      // Computed upfront, see printReductions()
+      *this << (inAgent ? "_sim." : "") << reductionName;
+    } else if (name == "dist") {
       *this << expr.getArg(0) << ".distance(" << expr.getArg(1) << ")";
+    } else if (name == "displacement") {
+      *this << expr.getArg(1) << ".subtract(" << expr.getArg(0) << ")";
     } else if (name == "length") {
       *this << expr.getArg(0) << ".length()";
     } else if (name == "normalize") {
@@ -172,26 +212,29 @@ void MasonPrinter::print(const AST::CallExpression &expr) {
       } else {
         *this << scheduleVar << ".scheduleRepeating(" << time << ", " << aLabel << ")";
       }
+    } else if (name == "sample" || name == "deposit" || name == "deposit_max") {
+      // Deposits are collected separately, until flushFields() is called
+      Value::Vec3 envMin = script.envDecl->envMin.extendToVec3().getVec3();
+      if (name == "sample") {
+        *this << "Util.sampleField(" << expr.getArg(0) << ", ";
+      } else if (name == "deposit") {
+        *this << "Util.depositField(" << expr.getArg(0) << "_pending, ";
+      } else {
+        *this << "Util.depositMaxField(" << expr.getArg(0) << "_raised, ";
+      }
+      *this << expr.getArg(1) << ", " << envMin.x << ", " << envMin.y;
+      if (name != "sample") {
+        *this << ", " << expr.getArg(2);
+      }
+      *this << ")";
+    } else if (name == "diffuse") {
+      *this << "Util.diffuseField(" << expr.getArg(0) << ", " << expr.getArg(1) << ")";
+    } else if (name == "decay") {
+      *this << expr.getArg(0) << ".multiply(1.0 - " << expr.getArg(1) << ")";
     } else if (name == "save") {
       *this << "Util.save(env.getAllObjects(), " << expr.getArg(0) << ")";
     } else if (name == "removeCurrent") {
       *this << "_isDead = true";
-    } else if (name == "count") {
-      Type type = expr.getArg(0).type;
-      if (expr.getNumArgs() == 2) {
-        AST::AgentDeclaration *decl = type.getAgentDecl();
-        AST::AgentMember *member = type.getAgentMember();
-        *this << "count" << decl->name << "_" << member->name << "("
-              << expr.getArg(1) << ")";
-      } else {
-        AST::AgentDeclaration *decl = type.getAgentDecl();
-        *this << "count" << decl->name << "()";
-      }
-    } else if (name == "sum") {
-      Type type = expr.getArg(0).type;
-      AST::AgentDeclaration *decl = type.getAgentDecl();
-      AST::AgentMember *member = type.getAgentMember();
-      *this << "sum" << decl->name << "_" << member->name << "()";
     } else if (name == "log_csv") {
       bool first = true;
       for (const AST::ExpressionPtr &arg : *expr.args) {
@@ -203,7 +246,7 @@ void MasonPrinter::print(const AST::CallExpression &expr) {
       }
       *this << "logWriter.println()";
     } else if (name == "getLastExecTime") {
-      *this << "lastExecTime";
+      *this << getSimVarName() << ".lastExecTime";
     } else {
       assert(0);
     }
@@ -298,20 +341,26 @@ void MasonPrinter::print(const AST::VarDeclarationStatement &stmt) {
 }
 
 void MasonPrinter::print(const AST::ForStatement &stmt) {
-  if (stmt.isNear()) {
+  if (stmt.isNear() || stmt.isNearest()) {
     AST::AgentDeclaration *agentDecl = stmt.type->resolved.getAgentDecl();
     std::string iLabel = makeAnonLabel();
     const AST::Expression &nearAgent = stmt.getNearAgent();
     AST::AgentDeclaration *nearAgentDecl = nearAgent.type.getAgentDecl();
-    const AST::Expression &nearRadius = stmt.getNearRadius();
 
-    *this << "Bag _bag = _sim.env.getNeighborsExactlyWithinDistance("
-          << nearAgent << "." << nearAgentDecl->getPositionMember()->name
-          << ", " << nearRadius << ");" << nl
-          << "for (int " << iLabel << " = 0; " << iLabel << " < _bag.size(); "
+    if (stmt.isNearest()) {
+      // Only contains agents of the requested type, ordered by distance
+      *this << "Bag _bag = Util.nearest(_sim.env, "
+            << nearAgent << "." << nearAgentDecl->getPositionMember()->name
+            << ", " << stmt.getNearestCount() << ", " << agentDecl->name << ".class);" << nl;
+    } else {
+      *this << "Bag _bag = _sim.env.getNeighborsExactlyWithinDistance("
+            << nearAgent << "." << nearAgentDecl->getPositionMember()->name
+            << ", " << stmt.getNearRadius() << ");" << nl;
+    }
+    *this << "for (int " << iLabel << " = 0; " << iLabel << " < _bag.size(); "
           << iLabel << "++) {" << indent << nl
           << "Object _agent = _bag.get(" << iLabel << ");" << nl;
-    if (script.agents.size() > 1) {
+    if (script.agents.size() > 1 && stmt.isNear()) {
       // If there is more than one agent type, we have to check that we only the agents that
       // were asked for
       *this << "if (!(_agent instanceof " << agentDecl->name << ")) continue;" << nl;
@@ -407,10 +456,28 @@ void MasonPrinter::printAgentExtraCtorCode() { }
 void MasonPrinter::printStepDefaultCode(const AST::AgentDeclaration &decl) {
   if (decl.usesRuntimeRemoval) {
     // Make sure we always reschedule the agent, even if no step function is run
-    *this << "((Sim) state).schedule.scheduleOnceIn(1.0, this);" << nl;
+    *this << nl << "((Sim) state).schedule.scheduleOnceIn(1.0, this);";
   }
 }
 
+void MasonPrinter::printStepCall(
+    const AST::AgentDeclaration &decl, const AST::FunctionDeclaration &stepFn,
+    const AST::Expression *intervalExpr) {
+  if (!intervalExpr) {
+    *this << nl << "_" << stepFn.name << "(state);";
+    return;
+  }
+
+  // Outside of its interval the step behaves as if the agent had no step function
+  size_t numStepFuncs = script.simStmt->stepFuncDecls.size();
+  *this << nl << "if ((((Sim) state).schedule.getSteps() / " << numStepFuncs << ") % ("
+        << *intervalExpr << ") == 0) {" << indent << nl
+        << "_" << stepFn.name << "(state);"
+        << outdent << nl << "} else {" << indent;
+  printStepDefaultCode(decl);
+  *this << outdent << nl << "}";
+}
+
 void MasonPrinter::print(const AST::AgentDeclaration &decl) {
   const auto &stepFns = script.simStmt->stepFuncDecls;
 
@@ -487,23 +554,23 @@ void MasonPrinter::print(const AST::AgentDeclaration &decl) {
         << "void swapStates() {" << indent << nl
         << "currentState ^= 1;"
         << outdent << nl << "}" << nl
-        << "public void step(SimState state) {" << indent << nl;
+        << "public void step(SimState state) {" << indent;
   if (stepFns.size() == 1) {
     // If there is only one step function, just call it directly
     const AST::FunctionDeclaration *stepFn = script.simStmt->stepFuncDecls[0];
-    *this << "_" << stepFn->name << "(state);";
+    printStepCall(decl, *stepFn, script.simStmt->stepIntervalExprs[0]);
   } else {
     // Otherwise cycle through step functions with a counter
-    *this << "switch (currentStep) {" << indent;
+    *this << nl << "switch (currentStep) {" << indent;
     for (size_t i = 0; i < stepFns.size(); i++) {
-      *this << nl << "case " << i << ":" << indent << nl;
+      *this << nl << "case " << i << ":" << indent;
       const auto *stepFn = stepFns[i];
       if (&stepFn->stepAgent() == &decl) {
-        *this << "_" << stepFn->name << "(state);" << nl;
+        printStepCall(decl, *stepFn, script.simStmt->stepIntervalExprs[i]);
       } else {
         printStepDefaultCode(decl);
       }
-      *this << "break;" << outdent;
+      *this << nl << "break;" << outdent;
     }
     *this << outdent << nl << "}" << nl
           << "currentStep++;" << nl
@@ -527,17 +594,40 @@ void MasonPrinter::print(const AST::SimulateStatement &stmt) {
   size_t numStepFuncs = stmt.stepFuncDecls.size();
   std::string tLabel = makeAnonLabel();
   std::string timerLabel = makeAnonLabel();
+  if (!getSnapshotCalls(script).empty()) {
+    *this << "_sim.takeSnapshot();" << nl;
+  }
   *this << "int " << tLabel << " = " << *stmt.timestepsExpr
         << " * " << numStepFuncs << ";" << nl
         << "long lastTime = System.currentTimeMillis();" << nl
         << "do {" << indent << nl
-        << "if (!_sim.schedule.step(_sim)) break;" << nl
+        << "if (!_sim.schedule.step(_sim)) break;" << nl;
+  if (!script.fields.empty()) {
+    *this << "_sim.flushFields();" << nl;
+  }
+  *this
         << "if (_sim.schedule.getSteps() % " << numStepFuncs << " == 0) {" << indent << nl
         << "long curTime = System.currentTimeMillis();" << nl
         << "_sim.lastExecTime = (curTime - lastTime) / 1000.0;" << nl
         << "lastTime = curTime;";
   if (seqStep) {
-    *this << "_sim." << seqStep->name << "();" << nl;
+    if (stmt.seqStepIntervalExpr) {
+      *this << nl << "if ((_sim.schedule.getSteps() / " << numStepFuncs << " - 1) % ("
+            << *stmt.seqStepIntervalExpr << ") == 0) {" << indent;
+    }
+    if (!seqStep->reductionCalls.empty()) {
+      *this << nl << "_sim." << seqStep->name << "_reduce();";
+    }
+    *this << nl << "_sim." << seqStep->name << "();";
+    if (!script.fields.empty()) {
+      *this << nl << "_sim.flushFields();";
+    }
+    if (stmt.seqStepIntervalExpr) {
+      *this << outdent << nl << "}";
+    }
+  }
+  if (!getSnapshotCalls(script).empty()) {
+    *this << nl << "_sim.takeSnapshot();";
   }
   *this << outdent << nl << "}"
         << outdent << nl << "} while (_sim.schedule.getSteps() < " << tLabel << ");";
@@ -549,6 +639,9 @@ void MasonPrinter::print(const AST::Script &script) {
   *this << "import sim.engine.*;" << nl
         << "import sim.util.*;" << nl
         << "import sim.field.continuous.*;" << nl;
+  if (!script.fields.empty()) {
+    *this << "import sim.field.grid.*;" << nl;
+  }
   if (script.usesLogging) {
     *this << "import java.io.*;" << nl;
   }
@@ -570,7 +663,28 @@ void MasonPrinter::print(const AST::Script &script) {
     *this << ");" << nl;
   }
 
-  *this << "private double lastExecTime;" << nl;
+  // Environment fields, with separate grids collecting the deposits of a step
+  for (const AST::FieldDeclaration *field : script.fields) {
+    const std::string &name = field->var->name;
+    std::vector<double> size = envDecl->envSize.getVec();
+    int width = std::max(1, (int) std::ceil(size[0]));
+    int height = std::max(1, (int) std::ceil(size[1]));
+    *this << "public DoubleGrid2D field_" << name << " = new DoubleGrid2D("
+          << width << ", " << height << ");" << nl
+          << "public DoubleGrid2D field_" << name << "_pending = new DoubleGrid2D("
+          << width << ", " << height << ");" << nl
+          << "public DoubleGrid2D field_" << name << "_raised = new DoubleGrid2D("
+          << width << ", " << height << ", Double.NEGATIVE_INFINITY);" << nl;
+  }
+
+  *this << "public double lastExecTime;" << nl;
+  for (const AST::FunctionDeclaration *func : script.funcs) {
+    for (const AST::CallExpression *call : func->reductionCalls) {
+      *this << "public ";
+      printType(call->type);
+      *this << " " << getReductionName(script, *call) << ";" << nl;
+    }
+  }
   if (script.usesLogging) {
     *this << "private PrintWriter logWriter;" << nl;
   }
@@ -584,13 +698,19 @@ void MasonPrinter::print(const AST::Script &script) {
   *this << "public void start() {" << indent
         << nl << "super.start();"
         << nl << "env.clear();";
+  for (const AST::FieldDeclaration *field : script.fields) {
+    *this << nl << "field_" << field->var->name << ".setTo(0.0);";
+  }
   if (script.usesLogging) {
     *this << nl << "try {"
           << nl << "    logWriter = new PrintWriter(\"log.csv\", \"UTF-8\");"
           << nl << "} catch (Exception e) { e.printStackTrace(); }";
   }
-  *this << nl << mainFunc->getStmtsBeforeSimulate()
-        << outdent << nl << "}"
+  *this << nl << mainFunc->getStmtsBeforeSimulate();
+  if (!script.fields.empty()) {
+    *this << nl << "flushFields();";
+  }
+  *this << outdent << nl << "}"
         << nl << "public void finish() {" << indent
         << nl << "super.finish();";
   if (script.usesLogging) {
@@ -613,6 +733,16 @@ void MasonPrinter::print(const AST::Script &script) {
         << outdent << nl << "}" << nl;
   inMain = false;
 
+  if (!script.fields.empty()) {
+    *this << nl << "public void flushFields() {" << indent;
+    for (const AST::FieldDeclaration *field : script.fields) {
+      const std::string &name = field->var->name;
+      *this << nl << "Util.flushField(field_" << name << ", field_" << name << "_pending, "
+            << "field_" << name << "_raised);";
+    }
+    *this << outdent << nl << "}" << nl;
+  }
+
   // Print non-step, non-main functions
   for (const AST::FunctionDeclaration *decl : script.funcs) {
     if (!decl->isParallelStep() && !decl->isMain()) {
@@ -620,68 +750,125 @@ void MasonPrinter::print(const AST::Script &script) {
     }
   }
 
-  // Print reducton helper functions
-  for (const ReductionInfo &info : script.reductions) {
-    ReductionKind kind = info.first;
-    Type type = info.second;
-    if (kind == ReductionKind::COUNT_TYPE) {
-      AST::AgentDeclaration *decl = type.getAgentDecl();
-      *this << nl << "public int count" << decl->name << "() {" << indent << nl
-            << "Bag bag = env.getAllObjects();" << nl
-            << "int count = 0;" << nl
-            << "for (int i = 0; i < bag.size(); i++) {" << indent << nl
-            << "Object agent = bag.get(i);" << nl
-            << "if (agent instanceof " << decl->name << ") count++;"
-            << outdent << nl << "}" << nl
-            << "return count;"
-            << outdent << nl << "}" << nl;
-    } else if (kind == ReductionKind::COUNT_MEMBER) {
-      AST::AgentDeclaration *decl = type.getAgentDecl();
-      AST::AgentMember *member = type.getAgentMember();
-      Type memberType = member->type->resolved;
-      *this << nl << "public int count" << decl->name << "_" << member->name << "("
-            << memberType << " value) {" << indent << nl
-            << "Bag bag = env.getAllObjects();" << nl
-            << "int count = 0;" << nl
-            << "for (int i = 0; i < bag.size(); i++) {" << indent << nl
-            << "Object maybe_agent = bag.get(i);" << nl
-            << "if (!(maybe_agent instanceof " << decl->name << ")) continue;"
-            << decl->name << " agent = (" << decl->name << ") maybe_agent;" << nl
-            << "if (agent.getInState()." << member->name << " == value) count++;" << nl
-            << outdent << nl << "}" << nl
-            << "return count;"
-            << outdent << nl << "}" << nl;
-    } else if (kind == ReductionKind::SUM_MEMBER) {
-      AST::AgentDeclaration *decl = type.getAgentDecl();
-      AST::AgentMember *member = type.getAgentMember();
-      Value identity = Value::getSumIdentity(member->type->resolved);
-      Type resultType = identity.getType();
-      AST::Expression *identityExpr = identity.toExpression();
-      *this << nl << "public " << resultType << " sum"
-            << decl->name << "_" << member->name << "() {" << indent << nl
-            << "Bag bag = env.getAllObjects();" << nl
-            << resultType << " result = " << *identityExpr << ";" << nl
-            << "for (int i = 0; i < bag.size(); i++) {" << indent << nl
-            << "Object maybe_agent = bag.get(i);" << nl
-            << "if (!(maybe_agent instanceof " << decl->name << ")) continue;" << nl
-            << decl->name << " agent = (" << decl->name << ") maybe_agent;" << nl;
-      if (member->type->resolved.isVec()) {
-        *this << "result = result.add(agent.getInState()." << member->name << ");";
-      } else if (member->type->resolved.isBool()) {
-        *this << "result += agent.getInState()." << member->name << " ? 1 : 0;";
-      } else {
-        *this << "result += agent.getInState()." << member->name << ";";
-      }
-      *this << outdent << nl << "}" << nl
-            << "return result;"
-            << outdent << nl << "}" << nl;
+  // Reductions read by parallel steps
+  std::vector<const AST::CallExpression *> snapshotCalls = getSnapshotCalls(script);
+  if (!snapshotCalls.empty()) {
+    printReductions("takeSnapshot", snapshotCalls);
+  }
+  const AST::FunctionDeclaration *seqStep = script.simStmt ? script.simStmt->seqStepDecl : nullptr;
+  if (seqStep && !seqStep->reductionCalls.empty()) {
+    printReductions(seqStep->name + "_reduce",
+        { seqStep->reductionCalls.begin(), seqStep->reductionCalls.end() });
+  }
+
+  *this << outdent << nl << "}";
+}
+
+// Prints a method computing the given reductions in a single pass over all
+// agents. The results are stored in the fields of Sim named by getReductionName()
+void MasonPrinter::printReductions(
+    const std::string &methodName, const std::vector<const AST::CallExpression *> &calls) {
+  *this << nl << "public void " << methodName << "() {" << indent;
+  for (const AST::CallExpression *call : calls) {
+    const std::string &name = call->calledSig.name;
+    std::string label = getReductionName(script, *call);
+    if (name == "count_member") {
+      *this << nl << "final ";
+      printType(call->getArg(1).type);
+      *this << " " << label << "_value = " << call->getArg(1) << ";";
+    } else if (name == "mean_member") {
+      *this << nl << "int " << label << "_count = 0;";
+    } else if (name == "histogram") {
+      *this << nl << "double " << label << "_lo = " << call->getArg(1) << ";"
+            << nl << "double " << label << "_hi = " << call->getArg(2) << ";"
+            << nl << label << " = new int[java.lang.Math.max(" << call->getArg(3) << ", 1)];";
+      continue;
+    }
+
+    Type memberType = call->getArg(0).type.isAgentMember()
+      ? call->getArg(0).type.getAgentMember()->type->resolved : Type();
+    *this << nl << label << " = ";
+    if (name == "sum" && memberType.isVec()) {
+      AST::Expression *identityExpr = Value::getSumIdentity(memberType).toExpression();
+      *this << *identityExpr;
       delete identityExpr;
+    } else if (name == "min_member") {
+      *this << (memberType.isFloat() ? "Double.POSITIVE_INFINITY" : "Integer.MAX_VALUE");
+    } else if (name == "max_member") {
+      *this << (memberType.isFloat() ? "Double.NEGATIVE_INFINITY" : "Integer.MIN_VALUE");
     } else {
-      assert(0);
+      *this << "0";
     }
+    *this << ";";
   }
 
+  *this << nl << "Bag bag = env.getAllObjects();"
+        << nl << "for (int i = 0; i < bag.size(); i++) {" << indent
+        << nl << "Object agent = bag.get(i);";
+  for (const AST::AgentDeclaration *agent : script.agents) {
+    std::vector<const AST::CallExpression *> agentCalls;
+    for (const AST::CallExpression *call : calls) {
+      if (call->getArg(0).type.getAgentDecl() == agent) {
+        agentCalls.push_back(call);
+      }
+    }
+    if (agentCalls.empty()) {
+      continue;
+    }
+
+    *this << nl << "if (agent instanceof " << agent->name << ") {" << indent;
+    bool readsMembers = std::any_of(agentCalls.begin(), agentCalls.end(),
+        [](const AST::CallExpression *call) { return call->calledSig.name != "count"; });
+    if (readsMembers) {
+      *this << nl << agent->name << ".State state = ((" << agent->name
+            << ") agent).getInState();";
+    }
+    for (const AST::CallExpression *call : agentCalls) {
+      const std::string &name = call->calledSig.name;
+      std::string label = getReductionName(script, *call);
+      if (name == "count") {
+        *this << nl << label << "++;";
+        continue;
+      }
+
+      const AST::AgentMember *member = call->getArg(0).type.getAgentMember();
+      Type memberType = member->type->resolved;
+      std::string value = "state." + member->name;
+      if (name == "count_member") {
+        if (memberType.isVec()) {
+          *this << nl << "if (" << value << ".equals(" << label << "_value)) " << label << "++;";
+        } else {
+          *this << nl << "if (" << value << " == " << label << "_value) " << label << "++;";
+        }
+      } else if (name == "min_member" || name == "max_member") {
+        *this << nl << label << " = java.lang.Math." << name.substr(0, 3) << "("
+              << label << ", " << value << ");";
+      } else if (name == "mean_member") {
+        *this << nl << label << " += " << value << ";"
+              << nl << label << "_count++;";
+      } else if (name == "histogram") {
+        *this << nl << label << "[Util.histogramBin(" << value << ", " << label << "_lo, "
+              << label << "_hi, " << label << ".length)]++;";
+      } else if (memberType.isVec()) {
+        *this << nl << label << " = " << label << ".add(" << value << ");";
+      } else if (memberType.isBool()) {
+        *this << nl << label << " += " << value << " ? 1 : 0;";
+      } else {
+        *this << nl << label << " += " << value << ";";
+      }
+    }
+    *this << outdent << nl << "}";
+  }
   *this << outdent << nl << "}";
+
+  for (const AST::CallExpression *call : calls) {
+    if (call->calledSig.name == "mean_member") {
+      std::string label = getReductionName(script, *call);
+      *this << nl << label << " = " << label << "_count > 0 ? "
+            << label << " / " << label << "_count : 0;";
+    }
+  }
+  *this << outdent << nl << "}" << nl;
 }
 
 void MasonPrinter::printUIExtraImports() { }
@@ -24,6 +24,7 @@ struct MasonPrinter : public GenericPrinter {
     : GenericPrinter(script, true) {}
 
   void print(const AST::VarExpression &);
+  void print(const AST::EnvironmentAccessExpression &);
   void print(const AST::UnaryOpExpression &);
   void print(const AST::CallExpression &);
   void print(const AST::MemberInitEntry &);
@@ -59,6 +60,11 @@ struct MasonPrinter : public GenericPrinter {
   void printUI();
 
 protected:
+  void printStepCall(const AST::AgentDeclaration &, const AST::FunctionDeclaration &stepFn,
+                     const AST::Expression *intervalExpr);
+  void printReductions(
+      const std::string &methodName, const std::vector<const AST::CallExpression *> &calls);
+
   const char *getSimVarName() const {
     return inAgent ? "_sim" : "this";
   }
@@ -30,6 +30,8 @@ void registerBuiltinFunctions(FunctionList &funcs) {
   funcs.add("length", "length_float3", { Type::VEC3 }, Type::FLOAT);
   funcs.add("dist", "dist_float2", { Type::VEC2, Type::VEC2 }, Type::FLOAT);
   funcs.add("dist", "dist_float3", { Type::VEC3, Type::VEC3 }, Type::FLOAT);
+  funcs.add("displacement", "displacement_float2", { Type::VEC2, Type::VEC2 }, Type::VEC2);
+  funcs.add("displacement", "displacement_float3", { Type::VEC3, Type::VEC3 }, Type::VEC3);
   funcs.add("normalize", "normalize_float2", { Type::VEC2 }, Type::VEC2);
   funcs.add("normalize", "normalize_float3", { Type::VEC3 }, Type::VEC3);
   funcs.add("random", "random_float", { Type::FLOAT, Type::FLOAT }, Type::FLOAT);
@@ -60,16 +62,45 @@ void registerBuiltinFunctions(FunctionList &funcs) {
     { Type::AGENT, Type::FLOAT },
     { Type::ARRAY, Type::AGENT },
     FunctionSignature::STEP_ONLY);
+  funcs.add("nearest",
+    { Type::AGENT, Type::INT32 },
+    { Type::ARRAY, Type::AGENT },
+    FunctionSignature::STEP_ONLY);
+  funcs.add("links", { Type::AGENT }, { Type::ARRAY, Type::AGENT },
+    FunctionSignature::STEP_ONLY);
+  funcs.add("link", { Type::AGENT_TYPE, Type::INT32, Type::INT32 }, Type::VOID,
+    FunctionSignature::MAIN_ONLY);
+  funcs.add("rewire", { Type::AGENT, Type::INT32 }, Type::VOID,
+    FunctionSignature::STEP_ONLY);
+  funcs.add("inbox", { Type::AGENT }, { Type::ARRAY, Type::UNRESOLVED },
+    FunctionSignature::STEP_ONLY);
   funcs.add("save", { Type::STRING }, Type::VOID, FunctionSignature::MAIN_ONLY);
-
-  // Reduction functions
-  funcs.add("count", { Type::AGENT_TYPE }, Type::INT32, FunctionSignature::SEQ_STEP_ONLY);
-  funcs.add("getLastExecTime", {}, Type::FLOAT, FunctionSignature::SEQ_STEP_ONLY);
+  funcs.add("load", { Type::STRING }, Type::VOID, FunctionSignature::MAIN_ONLY);
+
+  // Environment field functions
+  funcs.add("sample", "field_sample_float2", { Type::FIELD, Type::VEC2 }, Type::FLOAT);
+  funcs.add("sample", "field_sample_float3", { Type::FIELD, Type::VEC3 }, Type::FLOAT);
+  funcs.add("deposit", "field_deposit_float2",
+    { Type::FIELD, Type::VEC2, Type::FLOAT }, Type::VOID);
+  funcs.add("deposit", "field_deposit_float3",
+    { Type::FIELD, Type::VEC3, Type::FLOAT }, Type::VOID);
+  funcs.add("deposit_max", "field_deposit_max_float2",
+    { Type::FIELD, Type::VEC2, Type::FLOAT }, Type::VOID);
+  funcs.add("deposit_max", "field_deposit_max_float3",
+    { Type::FIELD, Type::VEC3, Type::FLOAT }, Type::VOID);
+  funcs.add("diffuse", "field_diffuse", { Type::FIELD, Type::FLOAT }, Type::VOID,
+    FunctionSignature::SEQ_STEP_ONLY);
+  funcs.add("decay", "field_decay", { Type::FIELD, Type::FLOAT }, Type::VOID,
+    FunctionSignature::SEQ_STEP_ONLY);
+
+  // Reduction functions. Parallel steps see the values at the start of the timestep
+  funcs.add("count", { Type::AGENT_TYPE }, Type::INT32, FunctionSignature::STEP_ONLY);
+  funcs.add("getLastExecTime", {}, Type::FLOAT, FunctionSignature::STEP_ONLY);
 
   // sumFn() determines the return type based on the member that is summed over
   FunctionSignature sumFn(
       "sum", "sum", { Type::AGENT_MEMBER }, Type::UNRESOLVED,
-      FunctionSignature::SEQ_STEP_ONLY, nullptr);
+      FunctionSignature::STEP_ONLY, nullptr);
   sumFn.customIsCompatibleWith = [](const std::vector<Type> &argTypes) {
     return argTypes.size() == 1 && argTypes[0].isAgentMember();
   };
@@ -93,7 +124,7 @@ void registerBuiltinFunctions(FunctionList &funcs) {
   // argument must match the type of the member
   FunctionSignature countFn(
       "count", "count_member", { Type::AGENT_MEMBER, Type::UNRESOLVED }, Type::INT32,
-      FunctionSignature::SEQ_STEP_ONLY, nullptr);
+      FunctionSignature::STEP_ONLY, nullptr);
   countFn.customIsCompatibleWith = [](const std::vector<Type> &argTypes) {
     if (argTypes.size() != 2 && !argTypes[0].isAgentMember()) {
       return false;
@@ -109,6 +140,55 @@ void registerBuiltinFunctions(FunctionList &funcs) {
   };
   funcs.add(countFn);
 
+  // min(), max() and mean() of an int or float member. min() and max() have
+  // the type of the member, mean() is always a float
+  for (const char *name : { "min", "max", "mean" }) {
+    FunctionSignature memberFn(
+        name, std::string(name) + "_member", { Type::AGENT_MEMBER }, Type::UNRESOLVED,
+        FunctionSignature::STEP_ONLY, nullptr);
+    memberFn.customIsCompatibleWith = [](const std::vector<Type> &argTypes) {
+      if (argTypes.size() != 1 || !argTypes[0].isAgentMember()) {
+        return false;
+      }
+
+      Type memberType = argTypes[0].getAgentMember()->type->resolved;
+      return memberType.isInt() || memberType.isFloat();
+    };
+    memberFn.customGetConcreteSignature = [memberFn](const std::vector<Type> &argTypes) {
+      FunctionSignature copy = memberFn;
+      copy.paramTypes = argTypes;
+      copy.returnType = copy.name == "mean_member"
+        ? Type(Type::FLOAT) : argTypes[0].getAgentMember()->type->resolved;
+      return copy;
+    };
+    funcs.add(memberFn);
+  }
+
+  // histogram(member, lo, hi, bins) counts the agents in each of bins equally
+  // sized bins between lo and hi. Values outside the range fall into the
+  // first or last bin
+  FunctionSignature histogramFn(
+      "histogram", "histogram",
+      { Type::AGENT_MEMBER, Type::FLOAT, Type::FLOAT, Type::INT32 },
+      Type(Type::ARRAY, Type::INT32), FunctionSignature::STEP_ONLY, nullptr);
+  histogramFn.customIsCompatibleWith = [](const std::vector<Type> &argTypes) {
+    if (argTypes.size() != 4 || !argTypes[0].isAgentMember()) {
+      return false;
+    }
+
+    Type memberType = argTypes[0].getAgentMember()->type->resolved;
+    return (memberType.isInt() || memberType.isFloat())
+        && argTypes[1].isPromotableTo(Type::FLOAT)
+        && argTypes[2].isPromotableTo(Type::FLOAT)
+        && argTypes[3].isInt();
+  };
+  histogramFn.customGetConcreteSignature = [histogramFn](const std::vector<Type> &argTypes) {
+    FunctionSignature copy = histogramFn;
+    copy.paramTypes[0] = argTypes[0];
+    return copy;
+  };
+  funcs.add(histogramFn);
+
   // log_csv() is a variadic function. We don't have native support for variadics,
   // implement some custom handlers.
   FunctionSignature logCsvFn(
@@ -128,11 +208,28 @@ void registerBuiltinFunctions(FunctionList &funcs) {
     return copy;
   };
   funcs.add(logCsvFn);
+
+  // send() a message to an agent. The message type determines the inbox it
+  // arrives in, which is read by for-inbox loops in later steps
+  FunctionSignature sendFn(
+      "send", "send", { Type::AGENT, Type::UNRESOLVED }, Type::VOID,
+      FunctionSignature::STEP_ONLY, nullptr);
+  sendFn.customIsCompatibleWith = [](const std::vector<Type> &argTypes) {
+    return argTypes.size() == 2 && argTypes[0].isAgent()
+      && (argTypes[1].isBool() || argTypes[1].isNumOrVec());
+  };
+  sendFn.customGetConcreteSignature = [sendFn](const std::vector<Type> &argTypes) {
+    FunctionSignature copy = sendFn;
+    copy.paramTypes = argTypes;
+    return copy;
+  };
+  funcs.add(sendFn);
 }
 
 std::map<std::string, std::unique_ptr<Backend>> getBackends() {
   std::map<std::string, std::unique_ptr<Backend>> backends;
   backends["c"] = std::unique_ptr<Backend>(new CBackend);
+  backends["mpic"] = std::unique_ptr<Backend>(new MpiCBackend);
   backends["flame"] = std::unique_ptr<Backend>(new FlameBackend);
   backends["flamegpu"] = std::unique_ptr<Backend>(new FlameGPUBackend);
   backends["mason"] = std::unique_ptr<Backend>(new MasonBackend);
@@ -156,6 +253,7 @@ void printHelp() {
                "\n"
                "Available backends:\n"
                " * c\n"
+               " * mpic\n"
                " * flame\n"
                " * flamegpu\n"
                " * mason\n"
@@ -164,6 +262,12 @@ void printHelp() {
                "Available configuration options:\n"
                " * bool use_float (default: false, flame/gpu only)\n"
                " * bool visualize (default: false, d/mason only)\n"
+               " * string c.layout (aos or soa, default: aos, c only)\n"
+               " * string c.schedule (static, dynamic or steal, default: static, c/mpic only)\n"
+               " * int c.reorder (sort agents by grid cell every n timesteps, default: 0, c only)\n"
+               " * string c.spatial_index (grid, tree or auto, default: grid, c/mpic only)\n"
+               " * string c.spatial_index.<Agent> (overrides c.spatial_index for one agent type)\n"
+               " * float c.verlet_skin (reuse neighbor lists with this skin, default: 0, c only)\n"
             << std::flush;
 }
 